@@ -0,0 +1,176 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Packed page archive output. See kvarchive.h for the format.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sink.h"
+#include "kvarchive.h"
+#include "crc32c.h"
+
+struct archive_sink {
+  struct page_sink base;
+  char *path;
+  int fd;
+  uint64_t offset;
+  struct kvarchive_record *records;
+  unsigned count, allocated;
+  struct kvarchive_record current;
+  uint32_t crc;
+};
+
+static int write_all(struct archive_sink *s, const void *data,
+                     size_t length) {
+  const uint8_t *p = data;
+  while (length) {
+    const ssize_t n = write(s->fd, p, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->path,
+              strerror(errno));
+      return 1;
+    }
+    s->offset += n;
+    p += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static int archive_begin_page(struct page_sink *sink,
+                              const struct page_info *info) {
+  struct archive_sink *s = (struct archive_sink *) sink;
+
+  memset(&s->current, 0, sizeof(s->current));
+  s->current.page = info->page;
+  s->current.side = info->side;
+  s->current.compression_type = info->compression_type;
+  s->current.width = info->width;
+  s->current.height = info->height;
+  s->current.offset = s->offset;
+  s->crc = 0;
+  return 0;
+}
+
+static int archive_write(struct page_sink *sink, const uint8_t *data,
+                         unsigned length) {
+  struct archive_sink *s = (struct archive_sink *) sink;
+
+  s->crc = crc32c(s->crc, data, length);
+  return write_all(s, data, length);
+}
+
+static int archive_end_page(struct page_sink *sink) {
+  struct archive_sink *s = (struct archive_sink *) sink;
+
+  if (s->count == s->allocated) {
+    s->allocated = s->allocated ? s->allocated * 2 : 64;
+    s->records = realloc(s->records,
+                         s->allocated * sizeof(struct kvarchive_record));
+    if (!s->records) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      exit(1);
+    }
+  }
+
+  struct kvarchive_record *r = &s->records[s->count++];
+  const uint64_t length = s->offset - s->current.offset;
+  r->page = htole32(s->current.page);
+  r->side = s->current.side;
+  r->compression_type = s->current.compression_type;
+  r->reserved = 0;
+  r->width = htole32(s->current.width);
+  r->height = htole32(s->current.height);
+  r->offset = htole64(s->current.offset);
+  r->length = htole64(length);
+  r->crc32c = htole32(s->crc);
+  r->reserved2 = 0;
+
+  fprintf(stderr, "%s: page %d%s: %llu bytes\n", s->path, s->current.page,
+          s->current.side ? "B" : "A", (unsigned long long) length);
+  return 0;
+}
+
+static int archive_close(struct page_sink *sink) {
+  struct archive_sink *s = (struct archive_sink *) sink;
+  int r = 0;
+
+  // Data from an unfinished page is left in the file but not indexed
+  static const uint8_t padding[8];
+  const uint64_t index_offset = (s->offset + 7) & ~7ull;
+  r |= write_all(s, padding, index_offset - s->offset);
+  r |= write_all(s, s->records, s->count * sizeof(struct kvarchive_record));
+
+  // The index offset is written last, so that an archive is only readable
+  // once its index is complete.
+  uint8_t header[12];
+  const uint32_t count = htole32(s->count);
+  const uint64_t offset = htole64(index_offset);
+  memcpy(header, &count, 4);
+  memcpy(header + 4, &offset, 8);
+  if (!r && pwrite(s->fd, header, sizeof(header), 12) != sizeof(header)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  if (close(s->fd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  fprintf(stderr, "%s: %u sides\n", s->path, s->count);
+  free(s->records);
+  free(s->path);
+  free(s);
+  return r;
+}
+
+struct page_sink *archive_sink_new(const char *path) {
+  struct archive_sink *s = calloc(1, sizeof(struct archive_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = archive_begin_page;
+  s->base.write = archive_write;
+  s->base.end_page = archive_end_page;
+  s->base.close = archive_close;
+  s->path = strdup(path);
+  s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (s->fd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+
+  uint8_t header[KVARCHIVE_HEADER_SIZE];
+  const uint32_t version = htole32(KVARCHIVE_VERSION);
+  memset(header, 0, sizeof(header));
+  memcpy(header, KVARCHIVE_MAGIC, 8);
+  memcpy(header + 8, &version, 4);
+  if (write_all(s, header, sizeof(header))) {
+    close(s->fd);
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
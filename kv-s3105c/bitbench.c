@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times each bitops.h implementation the CPU has against the scalar one, on
+// a 600 dpi US letter binary page:
+//   bitbench [repeats]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitops.h"
+
+// 8.5 x 11 inches at 600 dpi, with a width that needs padding
+#define BENCH_WIDTH 5099
+#define BENCH_HEIGHT 6600
+
+static const char *const implementations[] = {
+  "scalar", "ssse3", "avx2", "neon",
+};
+
+static const struct {
+  const char *name;
+  unsigned ops;
+  int rows;
+} tests[] = {
+  { "reverse", BITOPS_REVERSE, 0 },
+  { "invert", BITOPS_INVERT, 0 },
+  { "mirror", BITOPS_MIRROR, 1 },
+  { "mirror+reverse+invert",
+    BITOPS_MIRROR | BITOPS_REVERSE | BITOPS_INVERT, 1 },
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns the seconds taken for one page
+static double run(const uint8_t *in, uint8_t *out, unsigned ops, int rows,
+                  int repeats) {
+  const size_t stride = (BENCH_WIDTH + 7) / 8;
+  double best = 1e9;
+
+  for (int r = 0; r < repeats; r++) {
+    const double start = now();
+    if (rows) {
+      for (int y = 0; y < BENCH_HEIGHT; y++)
+        bitops_row(out + y * stride, in + y * stride, BENCH_WIDTH, 1, ops);
+    } else {
+      bitops_bytes(out, in, stride * BENCH_HEIGHT, ops);
+    }
+    const double t = now() - start;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  const int repeats = argc > 1 ? atoi(argv[1]) : 20;
+  const size_t length = (size_t) (BENCH_WIDTH + 7) / 8 * BENCH_HEIGHT;
+  uint8_t *in = malloc(length), *out = malloc(length), *expected =
+      malloc(length);
+
+  if (!in || !out || !expected) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < length; i++)
+    in[i] = rand();
+
+  printf("%zu byte page, best of %d\n", length, repeats);
+  printf("%-22s %-7s %9s %8s\n", "test", "impl", "MB/s", "speedup");
+  for (unsigned t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+    double scalar = 0;
+    for (unsigned i = 0; i < sizeof(implementations) /
+         sizeof(implementations[0]); i++) {
+      if (bitops_select(implementations[i]))
+        continue;
+      memset(out, 0, length);
+      const double seconds = run(in, out, tests[t].ops, tests[t].rows,
+                                 repeats);
+      if (!i) {
+        scalar = seconds;
+        memcpy(expected, out, length);
+      } else if (memcmp(out, expected, length)) {
+        fprintf(stderr, "%s %s: output differs from scalar\n",
+                tests[t].name, implementations[i]);
+        return 1;
+      }
+      printf("%-22s %-7s %9.0f %7.1fx\n", tests[t].name, implementations[i],
+             length / seconds / 1e6, scalar / seconds);
+    }
+  }
+  free(in);
+  free(out);
+  free(expected);
+  return 0;
+}
@@ -0,0 +1,299 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Every kernel does the same thing: optionally read the bytes backwards, then
+// map each byte through a bit reversal and/or inversion. Mirroring a row is
+// reading it backwards with the bits of each byte reversed, then shifting out
+// the padding that has moved to the start.
+//
+// The SIMD kernels map bytes a nibble at a time with two 16-entry table
+// lookups (PSHUFB, VPSHUFB or TBL). The tables for each combination of
+// reversal and inversion are built per call, so there are no branches in the
+// inner loops.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL
+#endif
+
+#include "bitops.h"
+
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+
+static const uint8_t reversed[256] = { R6(0), R6(2), R6(1), R6(3) };
+
+// Map bytes [done, length) one at a time. If backwards, out[i] comes from
+// in[length - 1 - i].
+static void map_scalar_from(uint8_t *out, const uint8_t *in, size_t length,
+                            size_t done, int backwards, unsigned ops) {
+  const uint8_t invert = ops & BITOPS_INVERT ? 0xff : 0;
+
+  for (size_t i = done; i < length; i++) {
+    const uint8_t b = backwards ? in[length - 1 - i] : in[i];
+    out[i] = (ops & BITOPS_REVERSE ? reversed[b] : b) ^ invert;
+  }
+}
+
+static void map_scalar(uint8_t *out, const uint8_t *in, size_t length,
+                       int backwards, unsigned ops) {
+  map_scalar_from(out, in, length, 0, backwards, ops);
+}
+
+// The nibble tables: a byte maps to low[b & 15] | high[b >> 4]
+static void nibble_tables(unsigned ops, uint8_t low[16], uint8_t high[16]) {
+  for (int n = 0; n < 16; n++) {
+    if (ops & BITOPS_REVERSE) {
+      low[n] = reversed[n];
+      high[n] = reversed[n << 4];
+    } else {
+      low[n] = n;
+      high[n] = n << 4;
+    }
+    if (ops & BITOPS_INVERT) {
+      // Each table fills one nibble of the result
+      low[n] ^= ops & BITOPS_REVERSE ? 0xf0 : 0x0f;
+      high[n] ^= ops & BITOPS_REVERSE ? 0x0f : 0xf0;
+    }
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("ssse3")))
+static void map_ssse3(uint8_t *out, const uint8_t *in, size_t length,
+                      int backwards, unsigned ops) {
+  uint8_t low[16], high[16];
+  size_t i = 0;
+
+  nibble_tables(ops, low, high);
+  const __m128i tlow = _mm_loadu_si128((const __m128i *) low);
+  const __m128i thigh = _mm_loadu_si128((const __m128i *) high);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0);
+  for (; i + 16 <= length; i += 16) {
+    __m128i v;
+    if (backwards)
+      v = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *) (in + length - i - 16)), reverse);
+    else
+      v = _mm_loadu_si128((const __m128i *) (in + i));
+    v = _mm_or_si128(
+        _mm_shuffle_epi8(tlow, _mm_and_si128(v, nibble)),
+        _mm_shuffle_epi8(thigh, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    _mm_storeu_si128((__m128i *) (out + i), v);
+  }
+  map_scalar_from(out, in, length, i, backwards, ops);
+}
+
+__attribute__((target("avx2")))
+static void map_avx2(uint8_t *out, const uint8_t *in, size_t length,
+                     int backwards, unsigned ops) {
+  uint8_t low[16], high[16];
+  size_t i = 0;
+
+  nibble_tables(ops, low, high);
+  const __m256i tlow = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *) low));
+  const __m256i thigh = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *) high));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  // VPSHUFB works within 128-bit lanes, so the lanes are swapped separately
+  const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0,
+                                           15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0);
+  for (; i + 32 <= length; i += 32) {
+    __m256i v;
+    if (backwards)
+      v = _mm256_permute4x64_epi64(
+          _mm256_shuffle_epi8(
+              _mm256_loadu_si256((const __m256i *) (in + length - i - 32)),
+              reverse),
+          0x4e);
+    else
+      v = _mm256_loadu_si256((const __m256i *) (in + i));
+    v = _mm256_or_si256(
+        _mm256_shuffle_epi8(tlow, _mm256_and_si256(v, nibble)),
+        _mm256_shuffle_epi8(thigh,
+                            _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                             nibble)));
+    _mm256_storeu_si256((__m256i *) (out + i), v);
+  }
+  map_scalar_from(out, in, length, i, backwards, ops);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+static void map_neon(uint8_t *out, const uint8_t *in, size_t length,
+                     int backwards, unsigned ops) {
+  uint8_t low[16], high[16];
+  size_t i = 0;
+
+  nibble_tables(ops, low, high);
+  const uint8x16_t tlow = vld1q_u8(low), thigh = vld1q_u8(high);
+  const uint8x16_t nibble = vdupq_n_u8(0x0f);
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t v;
+    if (backwards) {
+      v = vrev64q_u8(vld1q_u8(in + length - i - 16));
+      v = vextq_u8(v, v, 8);
+    } else {
+      v = vld1q_u8(in + i);
+    }
+    v = vorrq_u8(vqtbl1q_u8(tlow, vandq_u8(v, nibble)),
+                 vqtbl1q_u8(thigh, vshrq_n_u8(v, 4)));
+    vst1q_u8(out + i, v);
+  }
+  map_scalar_from(out, in, length, i, backwards, ops);
+}
+#endif
+
+struct kernel {
+  const char *name;
+  void (*map)(uint8_t *out, const uint8_t *in, size_t length, int backwards,
+              unsigned ops);
+};
+
+static const struct kernel kernels[] = {
+#ifdef HAVE_X86_KERNELS
+  { "avx2", map_avx2 },
+  { "ssse3", map_ssse3 },
+#endif
+#ifdef HAVE_NEON_KERNEL
+  { "neon", map_neon },
+#endif
+  { "scalar", map_scalar },
+};
+
+// Set once, but possibly from several threads at the same time
+static const struct kernel *selected;
+
+static int supported(const struct kernel *k) {
+#ifdef HAVE_X86_KERNELS
+  if (k->map == map_avx2)
+    return __builtin_cpu_supports("avx2");
+  if (k->map == map_ssse3)
+    return __builtin_cpu_supports("ssse3");
+#endif
+  return 1;
+}
+
+int bitops_select(const char *name) {
+  for (unsigned i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    if ((!name || !strcmp(name, kernels[i].name)) && supported(&kernels[i])) {
+      __atomic_store_n(&selected, &kernels[i], __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const struct kernel *get_kernel(void) {
+  const struct kernel *k = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+  if (!k) {
+    bitops_select(NULL);
+    k = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+  }
+  return k;
+}
+
+const char *bitops_implementation(void) {
+  return get_kernel()->name;
+}
+
+void bitops_bytes(uint8_t *out, const uint8_t *in, size_t length,
+                  unsigned ops) {
+  get_kernel()->map(out, in, length, 0,
+                    ops & (BITOPS_REVERSE | BITOPS_INVERT));
+}
+
+static uint64_t load64(const uint8_t *p, int big_endian) {
+  uint64_t w;
+  memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return big_endian ? __builtin_bswap64(w) : w;
+#else
+  return big_endian ? w : __builtin_bswap64(w);
+#endif
+}
+
+static void store64(uint8_t *p, uint64_t w, int big_endian) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (big_endian)
+    w = __builtin_bswap64(w);
+#else
+  if (!big_endian)
+    w = __builtin_bswap64(w);
+#endif
+  memcpy(p, &w, 8);
+}
+
+// Move the pixels of a row shift (1-7) places towards the start, filling the
+// end with zeros
+static void shift_row(uint8_t *row, size_t length, unsigned shift,
+                      int lsb_first) {
+  size_t i = 0;
+
+  if (lsb_first) {
+    for (; i + 9 <= length; i += 8)
+      store64(row + i, load64(row + i, 0) >> shift |
+              (uint64_t) row[i + 8] << (64 - shift), 0);
+    for (; i < length; i++)
+      row[i] = row[i] >> shift |
+               (i + 1 < length ? row[i + 1] << (8 - shift) : 0);
+  } else {
+    for (; i + 9 <= length; i += 8)
+      store64(row + i, load64(row + i, 1) << shift |
+              row[i + 8] >> (8 - shift), 1);
+    for (; i < length; i++)
+      row[i] = row[i] << shift |
+               (i + 1 < length ? row[i + 1] >> (8 - shift) : 0);
+  }
+}
+
+void bitops_row(uint8_t *out, const uint8_t *in, uint32_t width,
+                int lsb_first, unsigned ops) {
+  const size_t length = ((size_t) width + 7) / 8;
+  const unsigned padding = 8 * length - width;
+  const struct kernel *kernel = get_kernel();
+
+  if (!(ops & BITOPS_MIRROR)) {
+    kernel->map(out, in, length, 0, ops & (BITOPS_REVERSE | BITOPS_INVERT));
+    return;
+  }
+  // Reading backwards reverses the bytes; reversing the bits within them
+  // completes the mirror, unless the bit order is to be swapped as well.
+  const unsigned map_ops = (ops & BITOPS_REVERSE ? 0 : BITOPS_REVERSE);
+  const int out_lsb_first = ops & BITOPS_REVERSE ? !lsb_first : lsb_first;
+  if (!padding) {
+    kernel->map(out, in, length, 1, map_ops | (ops & BITOPS_INVERT));
+    return;
+  }
+  kernel->map(out, in, length, 1, map_ops | (ops & BITOPS_INVERT));
+  shift_row(out, length, padding, out_lsb_first);
+  // The shift leaves zeros in the padding, which should be inverted too
+  if (ops & BITOPS_INVERT)
+    out[length - 1] |= out_lsb_first ? 0xff << (8 - padding) :
+                                       0xff >> (8 - padding);
+}
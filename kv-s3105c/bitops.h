@@ -0,0 +1,68 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Layout changes to packed 1-bpp image data: swapping the bit order within
+// bytes, inverting, and mirroring rows left to right.
+//
+// These are what bit_ordering, reverse_image and mirror_image in
+// kvs3105_window ask the scanner to do. Doing them on the host instead lets
+// the scanner run binary scans in its plain mode. The work is done 32 bytes at
+// a time with AVX2, or 16 with SSSE3 or NEON, whichever the CPU has, with a
+// table-driven fallback.
+
+#ifndef THIRD_PARTY_KVS3105USB_BITOPS_H_
+#define THIRD_PARTY_KVS3105USB_BITOPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  // swap LSB-first and MSB-first
+  BITOPS_REVERSE = 1,
+  // swap black and white
+  BITOPS_INVERT = 2,
+  // reverse the pixels of each row (only for bitops_row)
+  BITOPS_MIRROR = 4,
+};
+
+// -----------------------------------------------------------------------------
+// Apply BITOPS_REVERSE and/or BITOPS_INVERT to length bytes. out may be the
+// same as in.
+// -----------------------------------------------------------------------------
+void bitops_bytes(uint8_t *out, const uint8_t *in, size_t length,
+                  unsigned ops);
+
+// -----------------------------------------------------------------------------
+// Apply ops to a row of width pixels, packed into (width + 7) / 8 bytes with
+// the first pixel in the least significant bit of the first byte if lsb_first,
+// or else in the most significant bit. When mirroring, any padding bits at
+// the end of the output row are zero (one if inverting). out mustn't overlap
+// in.
+// -----------------------------------------------------------------------------
+void bitops_row(uint8_t *out, const uint8_t *in, uint32_t width,
+                int lsb_first, unsigned ops);
+
+// -----------------------------------------------------------------------------
+// Use a particular implementation: "scalar", "ssse3", "avx2" or "neon", or
+// NULL for the fastest the CPU has. Returns 0 on success, or non-zero if the
+// implementation isn't available here.
+// -----------------------------------------------------------------------------
+int bitops_select(const char *name);
+
+// -----------------------------------------------------------------------------
+// The name of the implementation in use.
+// -----------------------------------------------------------------------------
+const char *bitops_implementation(void);
+
+#endif  // THIRD_PARTY_KVS3105USB_BITOPS_H_
@@ -0,0 +1,283 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BLAKE3, following the reference implementation in the specification
+// (https://github.com/BLAKE3-team/BLAKE3-specs).
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blake3.h"
+
+#define BLOCK_LEN 64
+#define CHUNK_LEN 1024
+
+enum {
+  CHUNK_START = 1 << 0,
+  CHUNK_END = 1 << 1,
+  PARENT = 1 << 2,
+  ROOT = 1 << 3,
+};
+
+static const uint32_t IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+// The message words used by each round
+static const uint8_t SCHEDULE[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static uint32_t load32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+#define G(v, a, b, c, d, x, y) do { \
+    v[a] += v[b] + (x); v[d] = rotr(v[d] ^ v[a], 16); \
+    v[c] += v[d]; v[b] = rotr(v[b] ^ v[c], 12); \
+    v[a] += v[b] + (y); v[d] = rotr(v[d] ^ v[a], 8); \
+    v[c] += v[d]; v[b] = rotr(v[b] ^ v[c], 7); \
+  } while (0)
+
+// Compress one block, returning the new chaining value in cv
+static void compress(uint32_t cv[8], const uint8_t block[BLOCK_LEN],
+                     unsigned block_length, uint64_t counter,
+                     unsigned flags) {
+  uint32_t m[16], v[16];
+
+  for (int i = 0; i < 16; i++)
+    m[i] = load32(block + 4 * i);
+  memcpy(v, cv, 32);
+  memcpy(v + 8, IV, 16);
+  v[12] = counter;
+  v[13] = counter >> 32;
+  v[14] = block_length;
+  v[15] = flags;
+  for (int r = 0; r < 7; r++) {
+    const uint8_t *s = SCHEDULE[r];
+    G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+    G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+    G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+    G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+    G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+    G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+    G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+  }
+  for (int i = 0; i < 8; i++)
+    cv[i] = v[i] ^ v[i + 8];
+}
+
+static void store_cv(uint8_t *out, const uint32_t cv[8]) {
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = cv[i];
+    out[4 * i + 1] = cv[i] >> 8;
+    out[4 * i + 2] = cv[i] >> 16;
+    out[4 * i + 3] = cv[i] >> 24;
+  }
+}
+
+// The chaining value of a parent node, or its hash if flags includes ROOT
+static void parent(uint32_t out[8], const uint32_t left[8],
+                   const uint32_t right[8], unsigned flags) {
+  uint8_t block[BLOCK_LEN];
+  store_cv(block, left);
+  store_cv(block + 32, right);
+  memcpy(out, IV, 32);
+  compress(out, block, BLOCK_LEN, 0, PARENT | flags);
+}
+
+// Add the chaining value of a completed chunk, merging every subtree that it
+// completes. total_chunks counts the chunks so far, including this one.
+static void push_chunk(struct blake3 *h, uint32_t cv[8],
+                       uint64_t total_chunks) {
+  while (!(total_chunks & 1)) {
+    parent(cv, h->stack[--h->stack_length], cv, 0);
+    total_chunks >>= 1;
+  }
+  memcpy(h->stack[h->stack_length++], cv, 32);
+}
+
+static void start_chunk(struct blake3 *h, uint64_t counter) {
+  memcpy(h->cv, IV, 32);
+  h->chunk_counter = counter;
+  h->block_length = 0;
+  h->blocks_compressed = 0;
+}
+
+void blake3_init(struct blake3 *h) {
+  memset(h, 0, sizeof(*h));
+  start_chunk(h, 0);
+}
+
+#ifdef __SSE2__
+static __m128i rotr4(__m128i x, int n) {
+  return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n));
+}
+
+#define G4(v, a, b, c, d, x, y) do { \
+    v[a] = _mm_add_epi32(v[a], _mm_add_epi32(v[b], x)); \
+    v[d] = rotr4(_mm_xor_si128(v[d], v[a]), 16); \
+    v[c] = _mm_add_epi32(v[c], v[d]); \
+    v[b] = rotr4(_mm_xor_si128(v[b], v[c]), 12); \
+    v[a] = _mm_add_epi32(v[a], _mm_add_epi32(v[b], y)); \
+    v[d] = rotr4(_mm_xor_si128(v[d], v[a]), 8); \
+    v[c] = _mm_add_epi32(v[c], v[d]); \
+    v[b] = rotr4(_mm_xor_si128(v[b], v[c]), 7); \
+  } while (0)
+
+// Hash four whole chunks starting at data, with counters counter..counter+3,
+// storing their chaining values in cvs. Lane j of each vector belongs to
+// chunk j.
+static void hash4(const uint8_t *data, uint64_t counter, uint32_t cvs[4][8]) {
+  __m128i cv[8], m[16], v[16];
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i low = _mm_add_epi32(_mm_set1_epi32((uint32_t) counter),
+                                    lanes);
+  // carry into the high word where the low word wrapped
+  const __m128i sign = _mm_set1_epi32(0x80000000);
+  const __m128i carry = _mm_cmpgt_epi32(
+      _mm_xor_si128(_mm_set1_epi32((uint32_t) counter), sign),
+      _mm_xor_si128(low, sign));
+  const __m128i high = _mm_sub_epi32(_mm_set1_epi32(counter >> 32), carry);
+
+  for (int i = 0; i < 8; i++)
+    cv[i] = _mm_set1_epi32(IV[i]);
+  for (int b = 0; b < CHUNK_LEN / BLOCK_LEN; b++) {
+    const unsigned flags = (b == 0 ? CHUNK_START : 0) |
+                           (b == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+    for (int i = 0; i < 16; i++) {
+      const uint8_t *p = data + b * BLOCK_LEN + 4 * i;
+      m[i] = _mm_setr_epi32(load32(p), load32(p + CHUNK_LEN),
+                            load32(p + 2 * CHUNK_LEN),
+                            load32(p + 3 * CHUNK_LEN));
+    }
+    for (int i = 0; i < 8; i++)
+      v[i] = cv[i];
+    for (int i = 0; i < 4; i++)
+      v[i + 8] = _mm_set1_epi32(IV[i]);
+    v[12] = low;
+    v[13] = high;
+    v[14] = _mm_set1_epi32(BLOCK_LEN);
+    v[15] = _mm_set1_epi32(flags);
+    for (int r = 0; r < 7; r++) {
+      const uint8_t *s = SCHEDULE[r];
+      G4(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+      G4(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+      G4(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+      G4(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+      G4(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+      G4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G4(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+      G4(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+      cv[i] = _mm_xor_si128(v[i], v[i + 8]);
+  }
+
+  uint32_t words[8][4];
+  for (int i = 0; i < 8; i++)
+    _mm_storeu_si128((__m128i *) words[i], cv[i]);
+  for (int j = 0; j < 4; j++) {
+    for (int i = 0; i < 8; i++)
+      cvs[j][i] = words[i][j];
+  }
+}
+#endif
+
+void blake3_update(struct blake3 *h, const void *data, size_t length) {
+  const uint8_t *p = data;
+
+  while (length) {
+    // A full chunk is only finished once more input arrives, since the last
+    // chunk of the input is treated differently when it's the only one
+    if (h->blocks_compressed * BLOCK_LEN + h->block_length == CHUNK_LEN) {
+      compress(h->cv, h->block, BLOCK_LEN, h->chunk_counter,
+               CHUNK_END | (h->blocks_compressed ? 0 : CHUNK_START));
+      push_chunk(h, h->cv, h->chunk_counter + 1);
+      start_chunk(h, h->chunk_counter + 1);
+    }
+
+#ifdef __SSE2__
+    // Whole chunks, as long as one byte is left for the chunk state
+    if (!h->blocks_compressed && !h->block_length) {
+      while (length > 4 * CHUNK_LEN) {
+        uint32_t cvs[4][8];
+        hash4(p, h->chunk_counter, cvs);
+        for (int j = 0; j < 4; j++)
+          push_chunk(h, cvs[j], h->chunk_counter + j + 1);
+        start_chunk(h, h->chunk_counter + 4);
+        p += 4 * CHUNK_LEN;
+        length -= 4 * CHUNK_LEN;
+      }
+    }
+#endif
+
+    // Fill the block, compressing it only when there's more after it
+    if (h->block_length == BLOCK_LEN) {
+      compress(h->cv, h->block, BLOCK_LEN, h->chunk_counter,
+               h->blocks_compressed ? 0 : CHUNK_START);
+      h->blocks_compressed++;
+      h->block_length = 0;
+    }
+    const unsigned room = BLOCK_LEN - h->block_length;
+    const unsigned n = length < room ? length : room;
+    memcpy(h->block + h->block_length, p, n);
+    h->block_length += n;
+    p += n;
+    length -= n;
+  }
+}
+
+void blake3_final(const struct blake3 *h, uint8_t out[BLAKE3_OUT_LEN]) {
+  // The last chunk's output node
+  uint32_t cv[8];
+  uint8_t block[BLOCK_LEN];
+  unsigned flags = CHUNK_END | (h->blocks_compressed ? 0 : CHUNK_START);
+  unsigned block_length = h->block_length;
+  uint64_t counter = h->chunk_counter;
+
+  memcpy(cv, h->cv, 32);
+  memset(block, 0, sizeof(block));
+  memcpy(block, h->block, h->block_length);
+
+  // Fold the stack into it from the top; the last compression is the root
+  for (unsigned i = h->stack_length; i > 0; i--) {
+    uint32_t right[8];
+    memcpy(right, cv, 32);
+    compress(right, block, block_length, counter, flags);
+    store_cv(block, h->stack[i - 1]);
+    store_cv(block + 32, right);
+    memcpy(cv, IV, 32);
+    block_length = BLOCK_LEN;
+    counter = 0;
+    flags = PARENT;
+  }
+  compress(cv, block, block_length, counter, flags | ROOT);
+  store_cv(out, cv);
+}
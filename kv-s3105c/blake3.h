@@ -0,0 +1,66 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BLAKE3, unkeyed, with a 256-bit output.
+//
+// Whole 1KB chunks are compressed four at a time with SSE2 where it's
+// available, which covers nearly all of the data when it's fed in 64KB at a
+// time. Everything else uses the portable compression function.
+
+#ifndef THIRD_PARTY_KVS3105USB_BLAKE3_H_
+#define THIRD_PARTY_KVS3105USB_BLAKE3_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+
+struct blake3 {
+  // the rest is private
+  // the chunk being hashed
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t block[64];
+  unsigned block_length;
+  unsigned blocks_compressed;
+  // the chaining values of completed subtrees, one per level at most
+  uint32_t stack[54][8];
+  unsigned stack_length;
+};
+
+// -----------------------------------------------------------------------------
+// Start a new hash.
+// -----------------------------------------------------------------------------
+void blake3_init(struct blake3 *hash);
+
+// -----------------------------------------------------------------------------
+// Add length bytes to the hash.
+// -----------------------------------------------------------------------------
+void blake3_update(struct blake3 *hash, const void *data, size_t length);
+
+// -----------------------------------------------------------------------------
+// Write the hash of everything so far to out. The hash can still be updated
+// afterwards.
+// -----------------------------------------------------------------------------
+void blake3_final(const struct blake3 *hash, uint8_t out[BLAKE3_OUT_LEN]);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_BLAKE3_H_
@@ -0,0 +1,293 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Blank side detection on the way to another sink.
+//
+// How much ink a side has is measured according to its data:
+//   uncompressed: the pixels darker than the ink level are counted as the
+//     chunks arrive (bits set, for bilevel scans, which are WhiteIsZero, not
+//     counting the padding at the end of each row). With reverse_image the
+//     scanner sends black as 255, or as a clear bit, and that's allowed for.
+//   JPEG: a side with many bytes per pixel has detail and isn't blank. Any
+//     other side is decoded at 1/8 scale, which only needs the DC coefficient
+//     of each block, and its dark pixels counted.
+//   MH/MR/MMR: only the bytes per pixel are used, since blank pages compress
+//     to almost nothing.
+//
+// To drop blank sides, each side is held in memory until its last chunk has
+// been read; when they're only reported, sides pass straight through.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sink.h"
+#include "jpegsmall.h"
+#include "pagebuf.h"
+
+// Bytes per megapixel above which a side is never blank
+#define BLANK_JPEG_SIZE 100000
+#define BLANK_CCITT_SIZE 1500
+
+struct blank_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  struct blank_options options;
+  FILE *report;
+  struct page_info info;
+  // the side, when it's held back or needs decoding
+  struct pagebuf page;
+  int hold;
+  uint64_t length;
+  // uncompressed data: the ink counted so far, out of the total
+  uint64_t ink, total;
+  // the data is inverted (reverse_image)
+  int reverse;
+  // bilevel data: bytes per row, the bits of the last byte which are pixels,
+  // and how far into the current row the data has got
+  size_t stride, column;
+  uint8_t last_mask;
+  unsigned sides, blank;
+};
+
+// Count the bytes darker than level
+static uint64_t count_dark(const uint8_t *p, size_t length, uint8_t level) {
+  uint64_t dark = 0;
+#ifdef __SSE2__
+  // x < level exactly when level - x doesn't saturate to zero
+  const __m128i l = _mm_set1_epi8((char) level), zero = _mm_setzero_si128();
+  for (; length >= 16; p += 16, length -= 16) {
+    const __m128i x = _mm_loadu_si128((const __m128i *) p);
+    const __m128i light = _mm_cmpeq_epi8(_mm_subs_epu8(l, x), zero);
+    dark += 16 - __builtin_popcount(_mm_movemask_epi8(light));
+  }
+#endif
+  while (length--)
+    dark += *p++ < level;
+  return dark;
+}
+
+static uint64_t count_bits(const uint8_t *p, size_t length) {
+  uint64_t bits = 0;
+  for (; length >= 8; p += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    bits += __builtin_popcountll(word);
+  }
+  while (length--)
+    bits += __builtin_popcount(*p++);
+  return bits;
+}
+
+// Count the bytes which are ink: darker than level or, when the data is
+// inverted, lighter than 255 - level
+static uint64_t count_ink(const uint8_t *p, size_t length, unsigned level,
+                          int reverse) {
+  if (!reverse)
+    return count_dark(p, length, level);
+  if (!level)
+    return 0;
+  return length - count_dark(p, length, 256 - level);
+}
+
+// Count the ink in bilevel data, leaving out the padding bits of each row
+static void count_binary_ink(struct blank_sink *s, const uint8_t *p,
+                             size_t length) {
+  while (length && s->stride) {
+    size_t n = s->stride - s->column;
+    if (n > length)
+      n = length;
+    const int row_ends = s->column + n == s->stride;
+    const size_t whole = row_ends ? n - 1 : n;
+    uint64_t bits = count_bits(p, whole);
+    uint64_t pixels = 8ull * whole;
+    if (row_ends) {
+      bits += __builtin_popcount(p[whole] & s->last_mask);
+      pixels += __builtin_popcount(s->last_mask);
+    }
+    s->ink += s->reverse ? pixels - bits : bits;
+    s->total += pixels;
+    s->column = row_ends ? 0 : s->column + n;
+    p += n;
+    length -= n;
+  }
+}
+
+// Decode a JPEG side small, counting the dark pixels. Returns 0 on success.
+static int count_jpeg_ink(const struct pagebuf *page, uint8_t level,
+                          int reverse, uint64_t *ink, uint64_t *total) {
+  uint8_t *pixels;
+  unsigned width, height;
+
+  if (jpeg_decode_small(page->data, page->length, &pixels, &width, &height))
+    return 1;
+  *total = (uint64_t) width * height;
+  *ink = count_ink(pixels, *total, level, reverse);
+  free(pixels);
+  return 0;
+}
+
+static int blank_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct blank_sink *s = (struct blank_sink *) sink;
+
+  s->info = *info;
+  s->length = s->ink = s->total = 0;
+  s->reverse = info->window->reverse_image != 0;
+  s->stride = ((size_t) info->width + 7) / 8;
+  s->column = 0;
+  const unsigned spare = info->width & 7;
+  if (!spare)
+    s->last_mask = 0xff;
+  else if (!info->window->bit_ordering)  // LSB first
+    s->last_mask = (1 << spare) - 1;
+  else
+    s->last_mask = 0xff << (8 - spare);
+  pagebuf_reset(&s->page);
+  s->hold = s->options.drop;
+  if (s->hold)
+    return 0;
+  return s->next->begin_page(s->next, info);
+}
+
+static int blank_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct blank_sink *s = (struct blank_sink *) sink;
+
+  s->length += length;
+  if (!s->info.compression_type) {
+    if (s->info.window->bpp == 1) {
+      count_binary_ink(s, data, length);
+    } else {
+      s->ink += count_ink(data, length, s->options.level, s->reverse);
+      s->total += length;
+    }
+  } else if (KVS3105_IS_JPEG(s->info.compression_type) && !s->hold) {
+    // Kept for decoding
+    if (pagebuf_append(&s->page, data, length))
+      return 1;
+  }
+  if (s->hold)
+    return pagebuf_append(&s->page, data, length);
+  return s->next->write(s->next, data, length);
+}
+
+// Decide whether the side that has just finished is blank. *ink is the
+// fraction of ink, or negative if it wasn't measured.
+static int is_blank(struct blank_sink *s, double *ink) {
+  const uint64_t pixels = (uint64_t) s->info.width * s->info.height;
+  const double per_mpixel = pixels ? s->length * 1e6 / pixels : 0;
+  const uint8_t type = s->info.compression_type;
+
+  *ink = -1;
+  if (!type) {
+    *ink = s->total ? (double) s->ink / s->total : 0;
+    return *ink < s->options.ink;
+  }
+  if (KVS3105_IS_JPEG(type)) {
+    if (per_mpixel > (s->options.size ? s->options.size : BLANK_JPEG_SIZE))
+      return 0;
+    uint64_t dark, total;
+    if (count_jpeg_ink(&s->page, s->options.level, s->reverse, &dark,
+                       &total)) {
+      fprintf(stderr, "page %d%s: can't decode to look for a blank page\n",
+              s->info.page, s->info.side ? "B" : "A");
+      return 0;
+    }
+    *ink = total ? (double) dark / total : 0;
+    return *ink < s->options.ink;
+  }
+  return per_mpixel <= (s->options.size ? s->options.size : BLANK_CCITT_SIZE);
+}
+
+static int blank_end_page(struct page_sink *sink) {
+  struct blank_sink *s = (struct blank_sink *) sink;
+  const uint64_t pixels = (uint64_t) s->info.width * s->info.height;
+  double ink;
+  const int blank = is_blank(s, &ink);
+
+  s->sides++;
+  s->blank += blank;
+  if (s->report) {
+    fprintf(s->report, "%u,%c,%llu,%.0f,", s->info.page,
+            s->info.side ? 'B' : 'A', (unsigned long long) s->length,
+            pixels ? s->length * 1e6 / pixels : 0);
+    if (ink >= 0)
+      fprintf(s->report, "%.3f", 100 * ink);
+    fprintf(s->report, ",%s\n", !blank ? "no" :
+            s->options.drop ? "dropped" : "yes");
+  }
+
+  if (blank) {
+    fprintf(stderr, "page %d%s: blank%s\n", s->info.page,
+            s->info.side ? "B" : "A", s->options.drop ? ", dropped" : "");
+    if (s->hold)
+      return 0;
+  }
+  if (s->hold &&
+      (s->next->begin_page(s->next, &s->info) ||
+       page_sink_write(s->next, s->page.data, s->page.length)))
+    return 1;
+  return s->next->end_page(s->next);
+}
+
+static int blank_close(struct page_sink *sink) {
+  struct blank_sink *s = (struct blank_sink *) sink;
+  int r = s->next->close(s->next);
+
+  fprintf(stderr, "%u of %u sides blank%s\n", s->blank, s->sides,
+          s->options.drop && s->blank ? " and dropped" : "");
+  if (s->report && fclose(s->report)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->options.report,
+            strerror(errno));
+    r = 1;
+  }
+  pagebuf_free(&s->page);
+  free(s);
+  return r;
+}
+
+struct page_sink *blank_sink_new(struct page_sink *next,
+                                 const struct blank_options *options) {
+  struct blank_sink *s = calloc(1, sizeof(struct blank_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  if (options->report) {
+    s->report = fopen(options->report, "w");
+    if (!s->report) {
+      fprintf(stderr, "Failed to open %s: %s\n", options->report,
+              strerror(errno));
+      free(s);
+      return NULL;
+    }
+    fprintf(s->report, "page,side,bytes,bytes_per_megapixel,ink_percent,"
+            "blank\n");
+  }
+  s->base.begin_page = blank_begin_page;
+  s->base.write = blank_write;
+  s->base.end_page = blank_end_page;
+  s->base.close = blank_close;
+  s->next = next;
+  s->options = *options;
+  return &s->base;
+}
@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bufmon.h"
+
+struct bufmon {
+  FILE *log;
+  uint32_t high_watermark;
+  unsigned interval_ms;
+  uint64_t start_ms;
+  uint64_t last_ms;
+  int sampled;
+  // set while the level is above the watermark; cleared once it falls below
+  // 3/4 of it so that a level hovering around the mark doesn't spam stderr.
+  int alarmed;
+  unsigned alarms;
+  unsigned samples;
+  uint32_t peak;
+  uint64_t total;
+};
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct bufmon *bufmon_new(const char *path, uint32_t high_watermark,
+                          unsigned interval_ms) {
+  struct bufmon *mon = calloc(1, sizeof(struct bufmon));
+  if (!mon)
+    return NULL;
+  if (path) {
+    mon->log = fopen(path, "w");
+    if (!mon->log) {
+      fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+      free(mon);
+      return NULL;
+    }
+    fprintf(mon->log, "ms,page,side,bytes\n");
+  }
+  mon->high_watermark = high_watermark;
+  mon->interval_ms = interval_ms;
+  mon->start_ms = now_ms();
+  return mon;
+}
+
+void bufmon_sample(struct bufmon *mon, usb_handle handle, unsigned page,
+                   int side) {
+  const uint64_t now = now_ms();
+  if (mon->sampled && now - mon->last_ms < mon->interval_ms)
+    return;
+
+  uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
+  uint32_t length;
+  if (kvs3105_data_buffer_status(handle, &length, requestsense))
+    return;  // a failed sample isn't worth failing the scan for
+
+  mon->sampled = 1;
+  mon->last_ms = now;
+  mon->samples++;
+  mon->total += length;
+  if (length > mon->peak)
+    mon->peak = length;
+
+  if (mon->log)
+    fprintf(mon->log, "%llu,%u,%c,%u\n",
+            (unsigned long long) (now - mon->start_ms), page,
+            side ? 'B' : 'A', length);
+
+  if (!mon->high_watermark)
+    return;
+  if (!mon->alarmed && length >= mon->high_watermark) {
+    mon->alarmed = 1;
+    mon->alarms++;
+    fprintf(stderr, "warning: scanner buffer at %u bytes (watermark %u) "
+            "reading page %u%c; host is falling behind\n",
+            length, mon->high_watermark, page, side ? 'B' : 'A');
+  } else if (mon->alarmed && length < mon->high_watermark / 4 * 3) {
+    mon->alarmed = 0;
+    fprintf(stderr, "scanner buffer back down to %u bytes\n", length);
+  }
+}
+
+void bufmon_close(struct bufmon *mon) {
+  if (!mon)
+    return;
+  if (mon->samples)
+    fprintf(stderr, "scanner buffer: %u samples, mean %llu bytes, "
+            "peak %u bytes, %u alarms\n", mon->samples,
+            (unsigned long long) (mon->total / mon->samples), mon->peak,
+            mon->alarms);
+  if (mon->log)
+    fclose(mon->log);
+  free(mon);
+}
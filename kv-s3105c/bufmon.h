@@ -0,0 +1,57 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scanner buffer-occupancy monitor.
+//
+// While a scan runs, the scanner holds finished images in its own memory until
+// the host READs them. If the host can't keep up, that memory fills and the
+// ADF throttles. Sampling GET DATA BUFFER STATUS between reads therefore tells
+// you whether the host is fast enough for its scanner.
+//
+// The monitor rate-limits its own sampling, records a time series (CSV of
+// milliseconds since start, page, side and buffered bytes) and warns on stderr
+// when the level crosses a high watermark.
+
+#ifndef THIRD_PARTY_KVS3105USB_BUFMON_H_
+#define THIRD_PARTY_KVS3105USB_BUFMON_H_
+
+#include <stdint.h>
+
+#include "kvs3105usb.h"
+
+struct bufmon;
+
+// -----------------------------------------------------------------------------
+// Create a monitor.
+//   path: file to write the time series to, or NULL for none
+//   high_watermark: alarm level in bytes, or 0 for no alarm
+//   interval_ms: minimum time between samples
+// Returns NULL on error.
+// -----------------------------------------------------------------------------
+struct bufmon *bufmon_new(const char *path, uint32_t high_watermark,
+                          unsigned interval_ms);
+
+// -----------------------------------------------------------------------------
+// Query the scanner and record a sample, unless the last sample was taken less
+// than interval_ms ago. Call this between reads; it issues a SCSI command.
+// -----------------------------------------------------------------------------
+void bufmon_sample(struct bufmon *mon, usb_handle handle, unsigned page,
+                   int side);
+
+// -----------------------------------------------------------------------------
+// Print a summary to stderr and free the monitor.
+// -----------------------------------------------------------------------------
+void bufmon_close(struct bufmon *mon);
+
+#endif  // THIRD_PARTY_KVS3105USB_BUFMON_H_
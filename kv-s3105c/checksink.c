@@ -0,0 +1,101 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Validation of JPEG sides on their way to another sink. See jpegcheck.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sink.h"
+#include "jpegcheck.h"
+
+struct check_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  struct jpeg_check check;
+  // whether the current side is JPEG
+  int checking;
+  unsigned page;
+  int side;
+  unsigned sides, bad;
+};
+
+static int check_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct check_sink *s = (struct check_sink *) sink;
+
+  s->checking = KVS3105_IS_JPEG(info->compression_type);
+  if (s->checking)
+    jpeg_check_init(&s->check, info->width, info->height);
+  s->page = info->page;
+  s->side = info->side;
+  return s->next->begin_page(s->next, info);
+}
+
+static int check_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct check_sink *s = (struct check_sink *) sink;
+
+  if (s->checking)
+    jpeg_check_update(&s->check, data, length);
+  return s->next->write(s->next, data, length);
+}
+
+static int check_end_page(struct page_sink *sink) {
+  struct check_sink *s = (struct check_sink *) sink;
+  const int r = s->next->end_page(s->next);
+
+  if (s->checking) {
+    const char *error = jpeg_check_finish(&s->check);
+    s->sides++;
+    if (error) {
+      s->bad++;
+      fprintf(stderr, "page %d%s: bad JPEG: %s\n", s->page,
+              s->side ? "B" : "A", error);
+    }
+  }
+  return r;
+}
+
+static uint8_t *check_get_buffer(struct page_sink *sink) {
+  struct check_sink *s = (struct check_sink *) sink;
+  return s->next->get_buffer(s->next);
+}
+
+static int check_close(struct page_sink *sink) {
+  struct check_sink *s = (struct check_sink *) sink;
+  int r = s->next->close(s->next);
+
+  if (s->bad) {
+    fprintf(stderr, "%u of %u sides failed validation\n", s->bad, s->sides);
+    r = 1;
+  }
+  free(s);
+  return r;
+}
+
+struct page_sink *check_sink_new(struct page_sink *next) {
+  struct check_sink *s = calloc(1, sizeof(struct check_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  s->base.begin_page = check_begin_page;
+  s->base.write = check_write;
+  s->base.end_page = check_end_page;
+  s->base.get_buffer = next->get_buffer ? check_get_buffer : NULL;
+  s->base.close = check_close;
+  s->next = next;
+  return &s->base;
+}
@@ -0,0 +1,90 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSTRUCTION
+#endif
+
+#include "crc32c.h"
+
+// Reflected polynomial 0x1EDC6F41
+#define CRC32C_POLY 0x82f63b78
+
+// Built once, by whichever thread first needs it, since this is also used
+// by libkvarchive in the caller's threads
+static uint32_t table[256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    table[i] = c;
+  }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t length) {
+  pthread_once(&table_once, init_table);
+  while (length--)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+// SSE4.2 has an instruction for exactly this polynomial
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length) {
+#ifdef __x86_64__
+  uint64_t c = crc;
+  for (; length >= 8; p += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+  crc = c;
+#endif
+  for (; length >= 4; p += 4, length -= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  while (length--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+  static uint32_t (*selected)(uint32_t, const uint8_t *, size_t);
+  uint32_t (*update)(uint32_t, const uint8_t *, size_t) =
+      __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+
+  // Threads which get here together all pick the same one
+  if (!update) {
+    update = crc32c_table;
+#ifdef HAVE_CRC32_INSTRUCTION
+    if (__builtin_cpu_supports("sse4.2"))
+      update = crc32c_sse42;
+#endif
+    __atomic_store_n(&selected, update, __ATOMIC_RELEASE);
+  }
+  return ~update(~crc, data, length);
+}
@@ -0,0 +1,37 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_KVS3105USB_CRC32C_H_
+#define THIRD_PARTY_KVS3105USB_CRC32C_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Extend a CRC-32C (Castagnoli, as used by iSCSI and ext4) with more data.
+// Start with crc = 0; the pre and post inversion is handled internally, so
+// crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b. Uses the SSE4.2
+// CRC32 instruction when the CPU has it.
+// -----------------------------------------------------------------------------
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_CRC32C_H_
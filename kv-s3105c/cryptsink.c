@@ -0,0 +1,234 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// AES-256-GCM encryption of every side on its way to another sink.
+//
+// Each side is encrypted separately, with a fresh random 96-bit nonce and the
+// page and side as associated data, so a file can't be swapped for another
+// without being noticed. GCM doesn't change the length, so chunks are
+// encrypted as they arrive, straight into next's buffers when it has them.
+// Those hold KVS3105_BUFFER_SIZE bytes, so longer writes are passed on in
+// pieces of that size.
+// OpenSSL uses AES-NI (or VAES) and carry-less multiplication where the CPU
+// has them, which runs at gigabytes a second, far beyond the USB link.
+//
+// The nonce and authentication tag of each side go into a text index:
+//   <page> <side> <length> <nonce in hex> <tag in hex>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "sink.h"
+
+#define CRYPT_KEY_SIZE 32
+#define CRYPT_NONCE_SIZE 12
+#define CRYPT_TAG_SIZE 16
+
+struct crypt_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  EVP_CIPHER_CTX *ctx;
+  const char *index_path;
+  FILE *index;
+  uint8_t *buffer;
+  unsigned page;
+  int side;
+  uint64_t length;
+  uint8_t nonce[CRYPT_NONCE_SIZE];
+};
+
+static void put_hex(FILE *f, const uint8_t *data, unsigned length) {
+  for (unsigned i = 0; i < length; i++)
+    fprintf(f, "%02x", data[i]);
+}
+
+static int crypt_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct crypt_sink *s = (struct crypt_sink *) sink;
+  char aad[32];
+  int n;
+
+  s->page = info->page;
+  s->side = info->side;
+  s->length = 0;
+  snprintf(aad, sizeof(aad), "page %u side %c", s->page, s->side ? 'B' : 'A');
+  if (RAND_bytes(s->nonce, sizeof(s->nonce)) != 1 ||
+      !EVP_EncryptInit_ex(s->ctx, NULL, NULL, NULL, s->nonce) ||
+      !EVP_EncryptUpdate(s->ctx, NULL, &n, (const uint8_t *) aad,
+                         strlen(aad))) {
+    fprintf(stderr, "Failed to start encrypting page %u\n", s->page);
+    return 1;
+  }
+  return s->next->begin_page(s->next, info);
+}
+
+static int crypt_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct crypt_sink *s = (struct crypt_sink *) sink;
+
+  while (length) {
+    const unsigned piece = length < KVS3105_BUFFER_SIZE ?
+        length : KVS3105_BUFFER_SIZE;
+    uint8_t *out = s->buffer;
+    int n;
+
+    if (s->next->get_buffer && !(out = s->next->get_buffer(s->next)))
+      return 1;
+    if (!EVP_EncryptUpdate(s->ctx, out, &n, data, piece) ||
+        n != (int) piece) {
+      fprintf(stderr, "Failed to encrypt page %u\n", s->page);
+      return 1;
+    }
+    s->length += piece;
+    if (s->next->write(s->next, out, piece))
+      return 1;
+    data += piece;
+    length -= piece;
+  }
+  return 0;
+}
+
+static int crypt_end_page(struct page_sink *sink) {
+  struct crypt_sink *s = (struct crypt_sink *) sink;
+  uint8_t tag[CRYPT_TAG_SIZE];
+  int n;
+
+  if (!EVP_EncryptFinal_ex(s->ctx, tag, &n) ||
+      !EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_GET_TAG, sizeof(tag), tag)) {
+    fprintf(stderr, "Failed to encrypt page %u\n", s->page);
+    return 1;
+  }
+  if (s->next->end_page(s->next))
+    return 1;
+
+  fprintf(s->index, "%u %c %llu ", s->page, s->side ? 'B' : 'A',
+          (unsigned long long) s->length);
+  put_hex(s->index, s->nonce, sizeof(s->nonce));
+  fputc(' ', s->index);
+  put_hex(s->index, tag, sizeof(tag));
+  if (fputc('\n', s->index) == EOF || fflush(s->index)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->index_path,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static void free_sink(struct crypt_sink *s) {
+  EVP_CIPHER_CTX_free(s->ctx);
+  free(s->buffer);
+  free(s);
+}
+
+static int crypt_close(struct page_sink *sink) {
+  struct crypt_sink *s = (struct crypt_sink *) sink;
+  int r = s->next->close(s->next);
+
+  if (fclose(s->index)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->index_path,
+            strerror(errno));
+    r = 1;
+  }
+  free_sink(s);
+  return r;
+}
+
+static int hex_value(uint8_t c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Read a key file holding either 32 raw bytes or 64 hex digits
+static int read_key(const char *path, uint8_t key[CRYPT_KEY_SIZE]) {
+  uint8_t contents[2 * CRYPT_KEY_SIZE + 2];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  size_t n = fread(contents, 1, sizeof(contents), f);
+  fclose(f);
+
+  int ok = 0;
+  if (n == CRYPT_KEY_SIZE) {
+    memcpy(key, contents, CRYPT_KEY_SIZE);
+    ok = 1;
+  } else {
+    if (n == 2 * CRYPT_KEY_SIZE + 1 && contents[n - 1] == '\n')
+      n--;
+    ok = n == 2 * CRYPT_KEY_SIZE;
+    for (unsigned i = 0; ok && i < CRYPT_KEY_SIZE; i++) {
+      const int high = hex_value(contents[2 * i]);
+      const int low = hex_value(contents[2 * i + 1]);
+      ok = high >= 0 && low >= 0;
+      key[i] = high << 4 | low;
+    }
+  }
+  memset(contents, 0, sizeof(contents));
+  if (!ok) {
+    fprintf(stderr, "%s: the key must be %d bytes, or %d hex digits\n", path,
+            CRYPT_KEY_SIZE, 2 * CRYPT_KEY_SIZE);
+    return 1;
+  }
+  return 0;
+}
+
+struct page_sink *crypt_sink_new(struct page_sink *next, const char *key_path,
+                                 const char *index_path) {
+  uint8_t key[CRYPT_KEY_SIZE];
+  if (read_key(key_path, key))
+    return NULL;
+
+  struct crypt_sink *s = calloc(1, sizeof(struct crypt_sink));
+  if (!s || !(s->buffer = malloc(KVS3105_BUFFER_SIZE))) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    free(s);
+    return NULL;
+  }
+  s->ctx = EVP_CIPHER_CTX_new();
+  const int ok = s->ctx &&
+      EVP_EncryptInit_ex(s->ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+      EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_GCM_SET_IVLEN, CRYPT_NONCE_SIZE,
+                          NULL) &&
+      EVP_EncryptInit_ex(s->ctx, NULL, NULL, key, NULL);
+  memset(key, 0, sizeof(key));
+  if (!ok) {
+    fprintf(stderr, "Failed to set up AES-256-GCM\n");
+    free_sink(s);
+    return NULL;
+  }
+  s->index = fopen(index_path, "w");
+  if (!s->index) {
+    fprintf(stderr, "Failed to open %s: %s\n", index_path, strerror(errno));
+    free_sink(s);
+    return NULL;
+  }
+  s->base.begin_page = crypt_begin_page;
+  s->base.write = crypt_write;
+  s->base.end_page = crypt_end_page;
+  s->base.close = crypt_close;
+  s->next = next;
+  s->index_path = index_path;
+  return &s->base;
+}
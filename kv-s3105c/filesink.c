@@ -0,0 +1,479 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The original kvscanner output: one file per side, or stdout.
+//
+// In atomic mode a side is written to an unnamed O_TMPFILE in the target
+// directory and only given its name with linkat once it's complete and
+// durable, so a crash never leaves a truncated JPEG behind. Completed sides
+// are committed in groups: an fdatasync of each, the links, then one fsync of
+// the directory. A committer thread makes sure a group which is still short
+// of commit_pages is committed once commit_ms has passed, even while the
+// scanner waits for paper. Filesystems without O_TMPFILE (e.g. NFS) fall back
+// to a .tmp file which is renamed into place.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "sink.h"
+#include "zcopy.h"
+#include "pagebuf.h"
+
+// Enough buffers to cover a 1MB pipe
+#define ZERO_COPY_BUFFERS 16
+
+struct file_sink {
+  struct page_sink base;
+  const char *filebase;
+  int outfd;
+  char *output_filename;
+  unsigned done;
+  struct zcopy *zc;
+
+  // atomic mode
+  int atomic;
+  char *dir;
+  unsigned commit_pages, commit_ms;
+  int no_tmpfile;
+  // the temporary name of the current side, without O_TMPFILE
+  char *tmp_filename;
+  // completed sides waiting for the next commit
+  struct pending_side {
+    int fd;
+    char *filename, *tmp_filename;
+  } *pending;
+  unsigned num_pending;
+  uint64_t first_pending_ms;
+  // The committer thread, and the lock over pending which it shares with
+  // end_page. failed is set when one of its commits fails, for end_page or
+  // close to report.
+  pthread_t committer;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int stop, failed;
+
+  // preallocate mode: the current side, and the space allocated for it
+  int preallocate;
+  struct pagebuf page;
+  uint32_t allocated;
+
+  int count_io;
+  unsigned sides;
+  uint64_t write_calls, extents;
+};
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int open_temporary(struct file_sink *s) {
+  if (!s->no_tmpfile) {
+    const int fd = open(s->dir, O_TMPFILE | O_WRONLY, 0644);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+      return fd;
+    s->no_tmpfile = 1;
+  }
+  if (asprintf(&s->tmp_filename, "%s.tmp", s->output_filename) == -1) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    exit(1);
+  }
+  return open(s->tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+// Give a completed, synced side its final name, replacing any existing file
+static int publish(const struct pending_side *p) {
+  if (p->tmp_filename)
+    return rename(p->tmp_filename, p->filename);
+
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", p->fd);
+  if (!linkat(AT_FDCWD, proc_path, AT_FDCWD, p->filename,
+              AT_SYMLINK_FOLLOW))
+    return 0;
+  if (errno != EEXIST)
+    return -1;
+
+  // linkat won't replace a file, so link beside it and rename over it
+  char *tmp;
+  if (asprintf(&tmp, "%s.tmp", p->filename) == -1) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    exit(1);
+  }
+  unlink(tmp);
+  int r = linkat(AT_FDCWD, proc_path, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW);
+  if (!r)
+    r = rename(tmp, p->filename);
+  free(tmp);
+  return r;
+}
+
+// Make the pending sides durable and publish them
+static int commit(struct file_sink *s) {
+  int r = 0;
+
+  if (!s->num_pending)
+    return 0;
+  for (unsigned i = 0; i < s->num_pending && !r; i++) {
+    if (fdatasync(s->pending[i].fd)) {
+      fprintf(stderr, "Failed to write to %s: %s\n", s->pending[i].filename,
+              strerror(errno));
+      r = 1;
+    }
+  }
+  for (unsigned i = 0; i < s->num_pending; i++) {
+    struct pending_side *p = &s->pending[i];
+    // If the sync failed the data may not be there, so nothing is published
+    if (!r && publish(p)) {
+      fprintf(stderr, "Failed to write to %s: %s\n", p->filename,
+              strerror(errno));
+      r = 1;
+    }
+    if (r && p->tmp_filename)
+      unlink(p->tmp_filename);
+    close(p->fd);
+    free(p->filename);
+    free(p->tmp_filename);
+  }
+  s->num_pending = 0;
+
+  const int dirfd = open(s->dir, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0 || fsync(dirfd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->dir, strerror(errno));
+    r = 1;
+  }
+  if (dirfd >= 0)
+    close(dirfd);
+  return r;
+}
+
+// Commit the pending sides once the first has waited commit_ms, so that they
+// don't wait for the next side to end
+static void *committer(void *arg) {
+  struct file_sink *s = arg;
+
+  pthread_mutex_lock(&s->lock);
+  while (!s->stop) {
+    if (!s->num_pending) {
+      pthread_cond_wait(&s->changed, &s->lock);
+      continue;
+    }
+    const uint64_t deadline = s->first_pending_ms + s->commit_ms;
+    if (now_ms() >= deadline) {
+      if (commit(s))
+        s->failed = 1;
+      continue;
+    }
+    const struct timespec ts = { deadline / 1000,
+                                 deadline % 1000 * 1000000 };
+    pthread_cond_timedwait(&s->changed, &s->lock, &ts);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+static int file_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  if (!s->filebase) {
+    s->outfd = 1;
+    s->output_filename = strdup("stdout");
+  } else {
+    if (asprintf(&s->output_filename, "%s-%03d-%s.jpeg", s->filebase,
+                 info->page, info->side ? "B" : "A" ) == -1) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      exit(1);
+    }
+    if (s->atomic) {
+      s->outfd = open_temporary(s);
+    } else {
+      s->outfd = open(s->output_filename,
+                      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+  }
+  if (s->outfd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->output_filename,
+            strerror(errno));
+    free(s->output_filename);
+    s->output_filename = NULL;
+    free(s->tmp_filename);
+    s->tmp_filename = NULL;
+    return 1;
+  }
+  s->done = 0;
+
+  if (s->preallocate) {
+    pagebuf_reset(&s->page);
+    s->allocated = 0;
+    if (s->outfd != 1 && info->size_hint) {
+      if (pagebuf_reserve(&s->page, info->size_hint))
+        return 1;
+      // Not every filesystem can, and that's fine
+      if (!fallocate(s->outfd, 0, 0, info->size_hint))
+        s->allocated = info->size_hint;
+    }
+  }
+  return 0;
+}
+
+// Return the number of extents in the file, or 0 if that can't be found.
+// The file is flushed first: until writeback, delayed allocation reports few
+// or no extents, and a preallocated file reports its unwritten ones.
+static unsigned count_extents(int fd) {
+  struct fiemap fm;
+  memset(&fm, 0, sizeof(fm));
+  fm.fm_length = FIEMAP_MAX_OFFSET;
+  fm.fm_flags = FIEMAP_FLAG_SYNC;
+  if (ioctl(fd, FS_IOC_FIEMAP, &fm))
+    return 0;
+  return fm.fm_mapped_extents;
+}
+
+// Write the whole side collected in preallocate mode
+static int write_page(struct file_sink *s) {
+  const uint8_t *data = s->page.data;
+  size_t length = s->page.length;
+  off_t offset = 0;
+
+  while (length) {
+    const ssize_t written = s->outfd == 1 ?
+        write(s->outfd, data, length) : pwrite(s->outfd, data, length, offset);
+    s->write_calls++;
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->output_filename,
+              strerror(errno));
+      return 1;
+    }
+    data += written;
+    offset += written;
+    length -= written;
+  }
+  // Give back whatever was allocated beyond the end
+  if (s->allocated > s->page.length &&
+      ftruncate(s->outfd, s->page.length)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->output_filename,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static uint8_t *file_get_buffer(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+  return zcopy_buffer(s->zc);
+}
+
+static int file_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  if (s->preallocate) {
+    s->done += length;
+    return pagebuf_append(&s->page, data, length);
+  }
+
+  if (s->zc) {
+    s->write_calls++;
+    if (zcopy_write(s->zc, s->outfd, data, length)) {
+      fprintf(stderr, "Failed to write to %s\n", s->output_filename);
+      return 1;
+    }
+    s->done += length;
+    return 0;
+  }
+
+  while (length) {
+    const ssize_t written = write(s->outfd, data, length);
+    s->write_calls++;
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->output_filename,
+              strerror(errno));
+      return 1;
+    }
+    s->done += written;
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+static int file_end_page(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  if (s->preallocate && write_page(s))
+    return 1;
+  s->sides++;
+  if (s->count_io && s->outfd != 1)
+    s->extents += count_extents(s->outfd);
+
+  fprintf(stderr, "%s: %d bytes\n", s->output_filename, s->done);
+  if (s->atomic) {
+    int r = 0;
+    pthread_mutex_lock(&s->lock);
+    if (!s->num_pending) {
+      s->first_pending_ms = now_ms();
+      pthread_cond_signal(&s->changed);
+    }
+    struct pending_side *p = &s->pending[s->num_pending++];
+    p->fd = s->outfd;
+    p->filename = s->output_filename;
+    p->tmp_filename = s->tmp_filename;
+    s->output_filename = s->tmp_filename = NULL;
+    s->outfd = -1;
+    if (s->num_pending >= s->commit_pages ||
+        now_ms() - s->first_pending_ms >= s->commit_ms)
+      r = commit(s);
+    r |= s->failed;
+    s->failed = 0;
+    pthread_mutex_unlock(&s->lock);
+    return r;
+  }
+  free(s->output_filename);
+  s->output_filename = NULL;
+  if (s->outfd != 1)
+    close(s->outfd);
+  s->outfd = -1;
+  return 0;
+}
+
+static int file_close(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+  int r = 0;
+
+  // A page that was started but never finished is left as it is, as it
+  // always has been, except in atomic mode where it's discarded.
+  if (s->outfd > 1)
+    close(s->outfd);
+  if (s->tmp_filename)
+    unlink(s->tmp_filename);
+  if (s->atomic) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->committer, NULL);
+    pthread_cond_destroy(&s->changed);
+    pthread_mutex_destroy(&s->lock);
+    r = commit(s) | s->failed;
+  }
+  if (s->count_io && s->sides) {
+    fprintf(stderr, "%u sides: %.1f write calls, %.1f extents per side\n",
+            s->sides, (double) s->write_calls / s->sides,
+            (double) s->extents / s->sides);
+  }
+  pagebuf_free(&s->page);
+  free(s->output_filename);
+  free(s->tmp_filename);
+  free(s->pending);
+  free(s->dir);
+  zcopy_free(s->zc);
+  free(s);
+  return r;
+}
+
+struct page_sink *file_sink_new(const char *filebase) {
+  struct file_sink *s = calloc(1, sizeof(struct file_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = file_begin_page;
+  s->base.write = file_write;
+  s->base.end_page = file_end_page;
+  s->base.close = file_close;
+  s->filebase = filebase;
+  s->outfd = -1;
+  return &s->base;
+}
+
+int file_sink_use_zero_copy(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  s->zc = zcopy_new(ZERO_COPY_BUFFERS);
+  if (!s->zc)
+    return 1;
+  s->base.get_buffer = file_get_buffer;
+  return 0;
+}
+
+int file_sink_use_preallocate(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  if (s->zc) {
+    fprintf(stderr, "Preallocation and zero copy don't go together\n");
+    return 1;
+  }
+  s->preallocate = 1;
+  return 0;
+}
+
+void file_sink_count_io(struct page_sink *sink) {
+  struct file_sink *s = (struct file_sink *) sink;
+  s->count_io = 1;
+}
+
+int file_sink_use_atomic(struct page_sink *sink, unsigned commit_pages,
+                         unsigned commit_ms) {
+  struct file_sink *s = (struct file_sink *) sink;
+
+  if (!s->filebase) {
+    fprintf(stderr, "Atomic output needs files, not stdout\n");
+    return 1;
+  }
+  if (!commit_pages)
+    commit_pages = 1;
+  char *copy = strdup(s->filebase);
+  s->dir = strdup(dirname(copy));
+  free(copy);
+  s->pending = calloc(commit_pages, sizeof(struct pending_side));
+  if (!s->dir || !s->pending) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  s->commit_pages = commit_pages;
+  s->commit_ms = commit_ms;
+
+  // The deadlines are on the same clock as now_ms
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&s->lock, NULL);
+  const int err = pthread_create(&s->committer, NULL, committer, s);
+  if (err) {
+    fprintf(stderr, "Failed to start a thread: %s\n", strerror(err));
+    pthread_cond_destroy(&s->changed);
+    pthread_mutex_destroy(&s->lock);
+    return 1;
+  }
+  s->atomic = 1;
+  return 0;
+}
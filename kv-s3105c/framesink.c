@@ -0,0 +1,175 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Length-prefixed framed output. See kvframe.h for the format.
+//
+// The length of a side isn't known until its last chunk has been read, so
+// each side is collected in memory and written with its header in a single
+// writev.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "sink.h"
+#include "kvframe.h"
+#include "pagebuf.h"
+
+struct frame_sink {
+  struct page_sink base;
+  char *path;
+  int fd;
+  struct page_info info;
+  struct pagebuf page;
+  unsigned frames;
+  uint64_t total;
+  // set by frame_sink_finish: the job succeeded, so close writes the trailer
+  int finished;
+};
+
+static void put32(uint8_t *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, v >> 32);
+  put32(p + 4, v);
+}
+
+static int write_frame(struct frame_sink *s, const uint8_t *header,
+                       const uint8_t *data, size_t length) {
+  struct iovec iov[2] = {
+    { (void *) header, KVFRAME_HEADER_SIZE },
+    { (void *) data, length },
+  };
+  int n = length ? 2 : 1;
+  struct iovec *v = iov;
+
+  while (n) {
+    ssize_t written = writev(s->fd, v, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->path,
+              strerror(errno));
+      return 1;
+    }
+    while (n && (size_t) written >= v->iov_len) {
+      written -= v->iov_len;
+      v++;
+      n--;
+    }
+    if (n) {
+      v->iov_base = (uint8_t *) v->iov_base + written;
+      v->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static int frame_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct frame_sink *s = (struct frame_sink *) sink;
+
+  s->info = *info;
+  pagebuf_reset(&s->page);
+  return 0;
+}
+
+static int frame_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct frame_sink *s = (struct frame_sink *) sink;
+  return pagebuf_append(&s->page, data, length);
+}
+
+static int frame_end_page(struct page_sink *sink) {
+  struct frame_sink *s = (struct frame_sink *) sink;
+  uint8_t header[KVFRAME_HEADER_SIZE];
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, KVFRAME_PAGE_MAGIC, 4);
+  put32(header + 4, s->info.page);
+  header[8] = s->info.side;
+  header[9] = s->info.compression_type;
+  put32(header + 12, s->info.width);
+  put32(header + 16, s->info.height);
+  put64(header + 24, s->page.length);
+  if (write_frame(s, header, s->page.data, s->page.length))
+    return 1;
+
+  s->frames++;
+  s->total += s->page.length;
+  fprintf(stderr, "%s: page %d%s: %llu bytes\n", s->path, s->info.page,
+          s->info.side ? "B" : "A", (unsigned long long) s->page.length);
+  return 0;
+}
+
+static int frame_close(struct page_sink *sink) {
+  struct frame_sink *s = (struct frame_sink *) sink;
+  uint8_t trailer[KVFRAME_HEADER_SIZE];
+  int r = 0;
+
+  if (s->finished) {
+    memset(trailer, 0, sizeof(trailer));
+    memcpy(trailer, KVFRAME_TRAILER_MAGIC, 4);
+    put32(trailer + 4, s->frames);
+    put64(trailer + 8, s->total);
+    r = write_frame(s, trailer, NULL, 0);
+  }
+
+  if (s->fd != 1 && close(s->fd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  pagebuf_free(&s->page);
+  free(s->path);
+  free(s);
+  return r;
+}
+
+void frame_sink_finish(struct page_sink *sink) {
+  ((struct frame_sink *) sink)->finished = 1;
+}
+
+struct page_sink *frame_sink_new(const char *path) {
+  struct frame_sink *s = calloc(1, sizeof(struct frame_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = frame_begin_page;
+  s->base.write = frame_write;
+  s->base.end_page = frame_end_page;
+  s->base.close = frame_close;
+  if (path) {
+    s->path = strdup(path);
+    s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else {
+    s->path = strdup("stdout");
+    s->fd = 1;
+  }
+  if (s->fd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
@@ -0,0 +1,281 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Most of the time in G4 encoding goes on finding the next changing element
+// (the next pixel of a different colour) on the coding and reference lines.
+// Documents are mostly long white runs, so the search skips uniform bytes 16
+// at a time with SSE2, then 8 at a time, before counting leading bits within
+// the byte where the colour changes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "g4.h"
+#include "bitops.h"
+
+struct code {
+  uint16_t bits;
+  uint8_t length;
+};
+
+// Run lengths 0-63
+static const struct code white_terminating[64] = {
+  { 0x35, 8 }, { 0x7, 6 }, { 0x7, 4 }, { 0x8, 4 }, { 0xb, 4 }, { 0xc, 4 },
+  { 0xe, 4 }, { 0xf, 4 }, { 0x13, 5 }, { 0x14, 5 }, { 0x7, 5 }, { 0x8, 5 },
+  { 0x8, 6 }, { 0x3, 6 }, { 0x34, 6 }, { 0x35, 6 }, { 0x2a, 6 }, { 0x2b, 6 },
+  { 0x27, 7 }, { 0xc, 7 }, { 0x8, 7 }, { 0x17, 7 }, { 0x3, 7 }, { 0x4, 7 },
+  { 0x28, 7 }, { 0x2b, 7 }, { 0x13, 7 }, { 0x24, 7 }, { 0x18, 7 }, { 0x2, 8 },
+  { 0x3, 8 }, { 0x1a, 8 }, { 0x1b, 8 }, { 0x12, 8 }, { 0x13, 8 }, { 0x14, 8 },
+  { 0x15, 8 }, { 0x16, 8 }, { 0x17, 8 }, { 0x28, 8 }, { 0x29, 8 }, { 0x2a, 8 },
+  { 0x2b, 8 }, { 0x2c, 8 }, { 0x2d, 8 }, { 0x4, 8 }, { 0x5, 8 }, { 0xa, 8 },
+  { 0xb, 8 }, { 0x52, 8 }, { 0x53, 8 }, { 0x54, 8 }, { 0x55, 8 }, { 0x24, 8 },
+  { 0x25, 8 }, { 0x58, 8 }, { 0x59, 8 }, { 0x5a, 8 }, { 0x5b, 8 }, { 0x4a, 8 },
+  { 0x4b, 8 }, { 0x32, 8 }, { 0x33, 8 }, { 0x34, 8 },
+};
+
+// Run lengths 64-1728, in steps of 64
+static const struct code white_makeup[27] = {
+  { 0x1b, 5 }, { 0x12, 5 }, { 0x17, 6 }, { 0x37, 7 }, { 0x36, 8 }, { 0x37, 8 },
+  { 0x64, 8 }, { 0x65, 8 }, { 0x68, 8 }, { 0x67, 8 }, { 0xcc, 9 }, { 0xcd, 9 },
+  { 0xd2, 9 }, { 0xd3, 9 }, { 0xd4, 9 }, { 0xd5, 9 }, { 0xd6, 9 }, { 0xd7, 9 },
+  { 0xd8, 9 }, { 0xd9, 9 }, { 0xda, 9 }, { 0xdb, 9 }, { 0x98, 9 }, { 0x99, 9 },
+  { 0x9a, 9 }, { 0x18, 6 }, { 0x9b, 9 },
+};
+
+// Run lengths 0-63
+static const struct code black_terminating[64] = {
+  { 0x37, 10 }, { 0x2, 3 }, { 0x3, 2 }, { 0x2, 2 }, { 0x3, 3 }, { 0x3, 4 },
+  { 0x2, 4 }, { 0x3, 5 }, { 0x5, 6 }, { 0x4, 6 }, { 0x4, 7 }, { 0x5, 7 },
+  { 0x7, 7 }, { 0x4, 8 }, { 0x7, 8 }, { 0x18, 9 }, { 0x17, 10 }, { 0x18, 10 },
+  { 0x8, 10 }, { 0x67, 11 }, { 0x68, 11 }, { 0x6c, 11 }, { 0x37, 11 },
+  { 0x28, 11 }, { 0x17, 11 }, { 0x18, 11 }, { 0xca, 12 }, { 0xcb, 12 },
+  { 0xcc, 12 }, { 0xcd, 12 }, { 0x68, 12 }, { 0x69, 12 }, { 0x6a, 12 },
+  { 0x6b, 12 }, { 0xd2, 12 }, { 0xd3, 12 }, { 0xd4, 12 }, { 0xd5, 12 },
+  { 0xd6, 12 }, { 0xd7, 12 }, { 0x6c, 12 }, { 0x6d, 12 }, { 0xda, 12 },
+  { 0xdb, 12 }, { 0x54, 12 }, { 0x55, 12 }, { 0x56, 12 }, { 0x57, 12 },
+  { 0x64, 12 }, { 0x65, 12 }, { 0x52, 12 }, { 0x53, 12 }, { 0x24, 12 },
+  { 0x37, 12 }, { 0x38, 12 }, { 0x27, 12 }, { 0x28, 12 }, { 0x58, 12 },
+  { 0x59, 12 }, { 0x2b, 12 }, { 0x2c, 12 }, { 0x5a, 12 }, { 0x66, 12 },
+  { 0x67, 12 },
+};
+
+// Run lengths 64-1728, in steps of 64
+static const struct code black_makeup[27] = {
+  { 0xf, 10 }, { 0xc8, 12 }, { 0xc9, 12 }, { 0x5b, 12 }, { 0x33, 12 },
+  { 0x34, 12 }, { 0x35, 12 }, { 0x6c, 13 }, { 0x6d, 13 }, { 0x4a, 13 },
+  { 0x4b, 13 }, { 0x4c, 13 }, { 0x4d, 13 }, { 0x72, 13 }, { 0x73, 13 },
+  { 0x74, 13 }, { 0x75, 13 }, { 0x76, 13 }, { 0x77, 13 }, { 0x52, 13 },
+  { 0x53, 13 }, { 0x54, 13 }, { 0x55, 13 }, { 0x5a, 13 }, { 0x5b, 13 },
+  { 0x64, 13 }, { 0x65, 13 },
+};
+
+// Run lengths 1792-2560, in steps of 64, for either colour
+static const struct code extended_makeup[13] = {
+  { 0x8, 11 }, { 0xc, 11 }, { 0xd, 11 }, { 0x12, 12 }, { 0x13, 12 },
+  { 0x14, 12 }, { 0x15, 12 }, { 0x16, 12 }, { 0x17, 12 }, { 0x1c, 12 },
+  { 0x1d, 12 }, { 0x1e, 12 }, { 0x1f, 12 },
+};
+
+// Pass, horizontal and the vertical modes VL3 to VR3
+static const struct code pass_code = { 0x1, 4 };
+static const struct code horizontal_code = { 0x1, 3 };
+static const struct code vertical_codes[7] = {
+  { 0x2, 7 }, { 0x2, 6 }, { 0x2, 3 }, { 0x1, 1 }, { 0x3, 3 }, { 0x3, 6 },
+  { 0x3, 7 },
+};
+static const struct code eol_code = { 0x1, 12 };
+
+// Bits are collected in the low end of a 64-bit word and stored a byte at a
+// time. The caller makes sure out has room.
+struct bit_writer {
+  uint8_t *out;
+  size_t length;
+  uint64_t bits;
+  unsigned count;
+};
+
+static void put_code(struct bit_writer *w, struct code code) {
+  w->bits = w->bits << code.length | code.bits;
+  w->count += code.length;
+  while (w->count >= 8) {
+    w->count -= 8;
+    w->out[w->length++] = w->bits >> w->count;
+  }
+}
+
+static void put_run(struct bit_writer *w, uint32_t run, int black) {
+  const struct code *terminating = black ? black_terminating :
+                                           white_terminating;
+  const struct code *makeup = black ? black_makeup : white_makeup;
+
+  while (run > 2560) {
+    put_code(w, extended_makeup[12]);
+    run -= 2560;
+  }
+  if (run >= 1792) {
+    put_code(w, extended_makeup[(run - 1792) / 64]);
+    run %= 64;
+  } else if (run >= 64) {
+    put_code(w, makeup[run / 64 - 1]);
+    run %= 64;
+  }
+  put_code(w, terminating[run]);
+}
+
+// The first pixel at or after start, and before end, which isn't colour; or
+// end if there isn't one. Rows are MSB first.
+static uint32_t find_change(const uint8_t *row, uint32_t start, uint32_t end,
+                            int colour) {
+  const uint8_t fill = colour ? 0xff : 0;
+
+  if (start >= end)
+    return end;
+  const unsigned first = (row[start >> 3] ^ fill) & (0xff >> (start & 7));
+  if (first) {
+    const uint32_t x = (start & ~7u) + __builtin_clz(first) - 24;
+    return x < end ? x : end;
+  }
+  const size_t bytes = ((size_t) end + 7) / 8;
+  size_t i = (start >> 3) + 1;
+#ifdef __SSE2__
+  const __m128i f = _mm_set1_epi8((char) fill);
+  for (; i + 16 <= bytes; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+    const unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(v, f));
+    if (same != 0xffff) {
+      i += __builtin_ctz(~same);
+      break;
+    }
+  }
+#endif
+  for (; i + 8 <= bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, row + i, 8);
+    word ^= fill ? ~0ull : 0;
+    if (word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      i += __builtin_ctzll(word) / 8;
+#else
+      i += __builtin_clzll(word) / 8;
+#endif
+      break;
+    }
+  }
+  for (; i < bytes; i++) {
+    const unsigned b = row[i] ^ fill;
+    if (b) {
+      const uint32_t x = 8 * i + __builtin_clz(b) - 24;
+      return x < end ? x : end;
+    }
+  }
+  return end;
+}
+
+static int pixel(const uint8_t *row, uint32_t x) {
+  return row[x >> 3] >> (7 - (x & 7)) & 1;
+}
+
+// Code one row against the row before it
+static void encode_row(struct bit_writer *w, const uint8_t *row,
+                       const uint8_t *reference, uint32_t width) {
+  uint32_t a0 = 0;
+  int colour = 0;
+  uint32_t a1 = find_change(row, 0, width, 0);
+  uint32_t b1 = find_change(reference, 0, width, 0);
+
+  for (;;) {
+    const uint32_t b2 = b1 < width ?
+        find_change(reference, b1, width, pixel(reference, b1)) : width;
+    if (b2 < a1) {
+      put_code(w, pass_code);
+      a0 = b2;
+    } else {
+      const int32_t d = (int32_t) a1 - (int32_t) b1;
+      if (d >= -3 && d <= 3) {
+        put_code(w, vertical_codes[d + 3]);
+        a0 = a1;
+        colour = !colour;
+      } else {
+        const uint32_t a2 = a1 < width ?
+            find_change(row, a1, width, !colour) : width;
+        put_code(w, horizontal_code);
+        put_run(w, a1 - a0, colour);
+        put_run(w, a2 - a1, !colour);
+        a0 = a2;
+      }
+    }
+    if (a0 >= width)
+      break;
+    a1 = find_change(row, a0, width, colour);
+    // b1 is the first change to the opposite of colour after a0
+    b1 = find_change(reference, a0, width, !colour);
+    b1 = find_change(reference, b1, width, colour);
+  }
+}
+
+int g4_encode(const uint8_t *image, uint32_t width, uint32_t height,
+              int lsb_first, struct pagebuf *out) {
+  const size_t stride = ((size_t) width + 7) / 8;
+  // At worst, a horizontal mode for every two pixels
+  const size_t row_limit = 2 * stride * 8 + 16;
+  // The reference line for the first row is white
+  uint8_t *rows = calloc(2, stride + 1);
+  uint8_t *reference = rows, *row = rows + stride + 1;
+  struct bit_writer w = { NULL, 0, 0, 0 };
+
+  if (!rows) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    if (pagebuf_reserve(out, out->length + row_limit)) {
+      free(rows);
+      return 1;
+    }
+    w.out = out->data;
+    w.length = out->length;
+    const uint8_t *src = image + y * stride;
+    if (lsb_first) {
+      bitops_bytes(row, src, stride, BITOPS_REVERSE);
+    } else {
+      memcpy(row, src, stride);
+    }
+    // Clear the padding so that it can't look like a change
+    if (width & 7)
+      row[stride - 1] &= 0xff << (8 - (width & 7));
+    encode_row(&w, row, reference, width);
+    out->length = w.length;
+    uint8_t *const t = reference;
+    reference = row;
+    row = t;
+  }
+  if (pagebuf_reserve(out, out->length + 8)) {
+    free(rows);
+    return 1;
+  }
+  w.out = out->data;
+  // EOFB is two EOLs, then pad to a byte
+  put_code(&w, eol_code);
+  put_code(&w, eol_code);
+  if (w.count)
+    put_code(&w, (struct code) { 0, 8 - w.count });
+  out->length = w.length;
+  free(rows);
+  return 0;
+}
@@ -0,0 +1,35 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A CCITT Group 4 (T.6, MMR) encoder for bilevel images, producing the same
+// kind of data as the scanner's compression_type 3.
+
+#ifndef THIRD_PARTY_KVS3105USB_G4_H_
+#define THIRD_PARTY_KVS3105USB_G4_H_
+
+#include <stdint.h>
+
+#include "pagebuf.h"
+
+// -----------------------------------------------------------------------------
+// Encode height rows of width pixels, each packed into (width + 7) / 8 bytes,
+// with 1 as black. The first pixel of each row is in the least significant
+// bit of its first byte if lsb_first, or else in the most significant bit.
+// The result, ending with an EOFB and with the bits of each byte filled most
+// significant first, is appended to out. Returns 0 on success.
+// -----------------------------------------------------------------------------
+int g4_encode(const uint8_t *image, uint32_t width, uint32_t height,
+              int lsb_first, struct pagebuf *out);
+
+#endif  // THIRD_PARTY_KVS3105USB_G4_H_
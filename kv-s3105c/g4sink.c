@@ -0,0 +1,241 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Group 4 compression of uncompressed binary scans on the host, on the way to
+// another sink, as if the scanner had been asked for compression_type 3.
+//
+// Each side is collected in memory and encoded on a worker pool, so several
+// pages are encoded at once while the next ones are read. Encoded sides are
+// passed on in the order they were scanned, from the reading thread, as soon
+// as they're ready. Reading waits only when G4_QUEUE_PER_THREAD sides per
+// worker are queued.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+#include "g4.h"
+#include "pagebuf.h"
+#include "workpool.h"
+
+#define G4_QUEUE_PER_THREAD 2
+
+struct g4_side {
+  struct workpool_task task;
+  struct g4_sink *sink;
+  struct page_info info;
+  struct kvs3105_window window;
+  struct pagebuf raw, coded;
+  // protected by sink->lock
+  int done, failed;
+  struct g4_side *next;
+};
+
+struct g4_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  struct workpool *pool;
+  unsigned max_queued;
+  // the side being read, or NULL when passing a side straight through
+  struct g4_side *current;
+  // sides waiting to be passed on, oldest first
+  struct g4_side *head, *tail;
+  unsigned queued;
+  // sides whose buffers can be reused
+  struct g4_side *spare;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+static void encode_side(struct workpool_task *task) {
+  struct g4_side *side = (struct g4_side *) task;
+  struct g4_sink *s = side->sink;
+  const size_t stride = ((size_t) side->info.width + 7) / 8;
+  int failed;
+
+  // A short side is encoded as far as it goes
+  if (stride && side->info.height > side->raw.length / stride)
+    side->info.height = side->raw.length / stride;
+  failed = g4_encode(side->raw.data, side->info.width, side->info.height,
+                     !side->window.bit_ordering, &side->coded);
+
+  pthread_mutex_lock(&s->lock);
+  side->done = 1;
+  side->failed = failed;
+  pthread_cond_broadcast(&s->finished);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Pass on the oldest side, waiting for it to be encoded if wait is set.
+// Returns 0 if there was nothing to do.
+static int pass_on(struct g4_sink *s, int wait, int *error) {
+  struct g4_side *side = s->head;
+
+  if (!side)
+    return 0;
+  pthread_mutex_lock(&s->lock);
+  while (wait && !side->done)
+    pthread_cond_wait(&s->finished, &s->lock);
+  const int done = side->done;
+  pthread_mutex_unlock(&s->lock);
+  if (!done)
+    return 0;
+
+  s->head = side->next;
+  if (!s->head)
+    s->tail = NULL;
+  s->queued--;
+  if (side->failed) {
+    fprintf(stderr, "page %d%s: G4 encoding failed\n", side->info.page,
+            side->info.side ? "B" : "A");
+    *error = 1;
+  } else {
+    side->info.size_hint = side->coded.length;
+    if (s->next->begin_page(s->next, &side->info) ||
+        page_sink_write(s->next, side->coded.data, side->coded.length) ||
+        s->next->end_page(s->next))
+      *error = 1;
+  }
+  side->next = s->spare;
+  s->spare = side;
+  return 1;
+}
+
+static int pass_on_all(struct g4_sink *s) {
+  int error = 0;
+  while (pass_on(s, 1, &error))
+    continue;
+  return error;
+}
+
+static int g4_begin_page(struct page_sink *sink,
+                         const struct page_info *info) {
+  struct g4_sink *s = (struct g4_sink *) sink;
+  struct g4_side *side;
+
+  if (info->compression_type || info->window->bpp != 1) {
+    // Keep the order
+    s->current = NULL;
+    if (pass_on_all(s))
+      return 1;
+    return s->next->begin_page(s->next, info);
+  }
+  if (s->spare) {
+    side = s->spare;
+    s->spare = side->next;
+  } else {
+    side = calloc(1, sizeof(struct g4_side));
+    if (!side) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      return 1;
+    }
+  }
+  side->task.run = encode_side;
+  side->sink = s;
+  side->info = *info;
+  side->window = *info->window;
+  side->window.compression_type = 3;
+  side->info.compression_type = 3;
+  side->info.window = &side->window;
+  pagebuf_reset(&side->raw);
+  pagebuf_reset(&side->coded);
+  side->done = side->failed = 0;
+  side->next = NULL;
+  s->current = side;
+  return 0;
+}
+
+static int g4_write(struct page_sink *sink, const uint8_t *data,
+                    unsigned length) {
+  struct g4_sink *s = (struct g4_sink *) sink;
+
+  if (!s->current)
+    return s->next->write(s->next, data, length);
+  return pagebuf_append(&s->current->raw, data, length);
+}
+
+static int g4_end_page(struct page_sink *sink) {
+  struct g4_sink *s = (struct g4_sink *) sink;
+  struct g4_side *side = s->current;
+  int error = 0;
+
+  if (!side)
+    return s->next->end_page(s->next);
+  s->current = NULL;
+  if (s->tail)
+    s->tail->next = side;
+  else
+    s->head = side;
+  s->tail = side;
+  s->queued++;
+  workpool_submit(s->pool, &side->task);
+
+  while (pass_on(s, s->queued > s->max_queued, &error))
+    continue;
+  return error;
+}
+
+static void free_sides(struct g4_side *side) {
+  while (side) {
+    struct g4_side *next = side->next;
+    pagebuf_free(&side->raw);
+    pagebuf_free(&side->coded);
+    free(side);
+    side = next;
+  }
+}
+
+static int g4_close(struct page_sink *sink) {
+  struct g4_sink *s = (struct g4_sink *) sink;
+  int r = pass_on_all(s);
+
+  if (s->next->close(s->next))
+    r = 1;
+  workpool_free(s->pool);
+  // A side that was being read when the job stopped is lost, as it would be
+  // in the scanner
+  if (s->current) {
+    s->current->next = s->spare;
+    s->spare = s->current;
+  }
+  free_sides(s->spare);
+  pthread_cond_destroy(&s->finished);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+  return r;
+}
+
+struct page_sink *g4_sink_new(struct page_sink *next, unsigned threads) {
+  struct g4_sink *s = calloc(1, sizeof(struct g4_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  s->pool = workpool_new(threads);
+  if (!s->pool) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->finished, NULL);
+  s->max_queued = G4_QUEUE_PER_THREAD * workpool_threads(s->pool);
+  s->base.begin_page = g4_begin_page;
+  s->base.write = g4_write;
+  s->base.end_page = g4_end_page;
+  s->base.close = g4_close;
+  s->next = next;
+  return &s->base;
+}
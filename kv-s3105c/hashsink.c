@@ -0,0 +1,121 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Hashing of every side on its way to another sink, into a manifest.
+//
+// Each chunk is hashed just before it's passed on, while it's still in the
+// cache from being read, so the hashes cost no extra pass over the data.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+#include "blake3.h"
+#include "crc32c.h"
+
+struct hash_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  const char *path;
+  FILE *manifest;
+  unsigned page;
+  int side;
+  uint64_t length;
+  uint32_t crc;
+  struct blake3 blake3;
+};
+
+static int hash_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct hash_sink *s = (struct hash_sink *) sink;
+
+  s->page = info->page;
+  s->side = info->side;
+  s->length = 0;
+  s->crc = 0;
+  blake3_init(&s->blake3);
+  return s->next->begin_page(s->next, info);
+}
+
+static int hash_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct hash_sink *s = (struct hash_sink *) sink;
+
+  s->length += length;
+  s->crc = crc32c(s->crc, data, length);
+  blake3_update(&s->blake3, data, length);
+  return s->next->write(s->next, data, length);
+}
+
+static int hash_end_page(struct page_sink *sink) {
+  struct hash_sink *s = (struct hash_sink *) sink;
+  uint8_t digest[BLAKE3_OUT_LEN];
+  char hex[2 * BLAKE3_OUT_LEN + 1];
+
+  if (s->next->end_page(s->next))
+    return 1;
+  blake3_final(&s->blake3, digest);
+  for (int i = 0; i < BLAKE3_OUT_LEN; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  if (fprintf(s->manifest, "%u %c %llu %08x %s\n", s->page,
+              s->side ? 'B' : 'A', (unsigned long long) s->length, s->crc,
+              hex) < 0 ||
+      fflush(s->manifest)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static uint8_t *hash_get_buffer(struct page_sink *sink) {
+  struct hash_sink *s = (struct hash_sink *) sink;
+  return s->next->get_buffer(s->next);
+}
+
+static int hash_close(struct page_sink *sink) {
+  struct hash_sink *s = (struct hash_sink *) sink;
+  int r = s->next->close(s->next);
+
+  if (fclose(s->manifest)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  free(s);
+  return r;
+}
+
+struct page_sink *hash_sink_new(struct page_sink *next, const char *path) {
+  struct hash_sink *s = calloc(1, sizeof(struct hash_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  s->manifest = fopen(path, "w");
+  if (!s->manifest) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    free(s);
+    return NULL;
+  }
+  fprintf(s->manifest, "# page side length crc32c blake3\n");
+  s->base.begin_page = hash_begin_page;
+  s->base.write = hash_write;
+  s->base.end_page = hash_end_page;
+  s->base.get_buffer = next->get_buffer ? hash_get_buffer : NULL;
+  s->base.close = hash_close;
+  s->next = next;
+  s->path = path;
+  return &s->base;
+}
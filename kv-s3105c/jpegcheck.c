@@ -0,0 +1,221 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "jpegcheck.h"
+
+enum {
+  EXPECT_SOI,
+  EXPECT_SOI_CODE,
+  // between segments, where only a marker may come
+  EXPECT_MARKER,
+  MARKER_CODE,
+  SEGMENT_LENGTH,
+  // the first five bytes of a SOF: precision, height and width
+  FRAME_HEADER,
+  SKIP_SEGMENT,
+  ENTROPY_CODED,
+  ENTROPY_CODED_FF,
+  DONE,
+};
+
+// SOF0..SOF15, apart from DHT, JPG and DAC which share the range
+static int is_sof(uint8_t marker) {
+  return marker >= 0xc0 && marker <= 0xcf &&
+         marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+// Find the first 0xFF in [p, end), or return end.
+static const uint8_t *find_ff(const uint8_t *p, const uint8_t *end) {
+#ifdef __SSE2__
+  const __m128i ff = _mm_set1_epi8((char) 0xff);
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *) p);
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  const uint8_t *q = memchr(p, 0xff, end - p);
+  return q ? q : end;
+}
+
+static int fail(struct jpeg_check *c, const char *error) {
+  c->error = error;
+  c->error_offset = c->offset;
+  return 1;
+}
+
+void jpeg_check_init(struct jpeg_check *c, uint32_t expected_width,
+                     uint32_t expected_height) {
+  memset(c, 0, sizeof(*c));
+  c->state = EXPECT_SOI;
+  c->expected_width = expected_width;
+  c->expected_height = expected_height;
+}
+
+// A marker code has been read; c->offset is just past it.
+static int marker(struct jpeg_check *c, uint8_t code) {
+  switch (code) {
+    case 0xd8:
+      return fail(c, "second SOI");
+    case 0xd9:
+      if (!c->seen_sos)
+        return fail(c, "EOI before any scan");
+      c->state = DONE;
+      return 0;
+    case 0x00:
+    case 0x01:
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7:
+      return fail(c, "unexpected marker outside a scan");
+  }
+  if (is_sof(code)) {
+    if (c->seen_sof)
+      return fail(c, "second SOF");
+    c->seen_sof = 1;
+  } else if (code == 0xda) {
+    if (!c->seen_sof)
+      return fail(c, "SOS before SOF");
+    c->seen_sos = 1;
+  }
+  c->marker = code;
+  c->header_length = 0;
+  c->state = SEGMENT_LENGTH;
+  return 0;
+}
+
+int jpeg_check_update(struct jpeg_check *c, const uint8_t *data,
+                      unsigned length) {
+  const uint8_t *p = data, *const end = data + length;
+
+  if (c->error)
+    return 1;
+  while (p < end) {
+    switch (c->state) {
+      case ENTROPY_CODED: {
+        const uint8_t *q = find_ff(p, end);
+        c->offset += q - p;
+        p = q;
+        if (p < end) {
+          p++;
+          c->offset++;
+          c->state = ENTROPY_CODED_FF;
+        }
+        continue;
+      }
+      case SKIP_SEGMENT: {
+        const unsigned n = end - p < c->remaining ? end - p : c->remaining;
+        p += n;
+        c->offset += n;
+        c->remaining -= n;
+        if (!c->remaining)
+          c->state = c->marker == 0xda ? ENTROPY_CODED : EXPECT_MARKER;
+        continue;
+      }
+      case DONE:
+        // Anything after EOI is padding, which decoders ignore
+        c->offset += end - p;
+        p = end;
+        continue;
+    }
+
+    const uint8_t b = *p++;
+    c->offset++;
+    switch (c->state) {
+      case EXPECT_SOI:
+        if (b != 0xff)
+          return fail(c, "no SOI: not JPEG data");
+        c->state = EXPECT_SOI_CODE;
+        break;
+      case EXPECT_SOI_CODE:
+        if (b != 0xd8)
+          return fail(c, "no SOI: not JPEG data");
+        c->state = EXPECT_MARKER;
+        break;
+      case EXPECT_MARKER:
+        if (b != 0xff)
+          return fail(c, "garbage between segments");
+        c->state = MARKER_CODE;
+        break;
+      case MARKER_CODE:
+        // 0xFF fill bytes may precede a marker code
+        if (b != 0xff && marker(c, b))
+          return 1;
+        break;
+      case ENTROPY_CODED_FF:
+        // A stuffed zero, restart markers and fill bytes stay in the scan
+        if (b == 0x00 || (b >= 0xd0 && b <= 0xd7))
+          c->state = ENTROPY_CODED;
+        else if (b != 0xff && marker(c, b))
+          return 1;
+        break;
+      case SEGMENT_LENGTH:
+        c->header[c->header_length++] = b;
+        if (c->header_length == 2) {
+          const unsigned n = (c->header[0] << 8) | c->header[1];
+          if (n < 2 || (is_sof(c->marker) && n < 7))
+            return fail(c, "bad segment length");
+          c->remaining = n - 2;
+          c->state = is_sof(c->marker) ? FRAME_HEADER :
+                     c->remaining ? SKIP_SEGMENT :
+                     c->marker == 0xda ? ENTROPY_CODED : EXPECT_MARKER;
+        }
+        break;
+      case FRAME_HEADER:
+        c->header[c->header_length++] = b;
+        c->remaining--;
+        if (c->header_length == 7) {
+          c->height = (c->header[3] << 8) | c->header[4];
+          c->width = (c->header[5] << 8) | c->header[6];
+          c->state = SKIP_SEGMENT;
+        }
+        break;
+    }
+  }
+  return 0;
+}
+
+const char *jpeg_check_finish(struct jpeg_check *c) {
+  if (c->error) {
+    snprintf(c->message, sizeof(c->message), "%s at byte %llu", c->error,
+             (unsigned long long) c->error_offset);
+    return c->message;
+  }
+  if (c->state != DONE) {
+    if (!c->offset)
+      return "no data";
+    snprintf(c->message, sizeof(c->message), "truncated after %llu bytes%s",
+             (unsigned long long) c->offset,
+             c->seen_sos ? "" : ", before any scan");
+    return c->message;
+  }
+  // A height of 0 in the SOF means it's given by a DNL marker later
+  if (c->expected_width && c->expected_height &&
+      (c->width != c->expected_width ||
+       (c->height && c->height != c->expected_height))) {
+    snprintf(c->message, sizeof(c->message), "image is %ux%u, but the scanner "
+             "said %ux%u", c->width, c->height, c->expected_width,
+             c->expected_height);
+    return c->message;
+  }
+  return NULL;
+}
@@ -0,0 +1,69 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Streaming structural validation of JPEG data.
+//
+// The scanner's JPEG is checked as it arrives, a chunk at a time, without
+// being decoded: the markers must run SOI, the header segments (including a
+// SOF giving the dimensions), SOS, entropy-coded data and EOI. Entropy-coded
+// data, which is nearly all of a side, is only searched for 0xFF bytes, with
+// SSE2 where it's available, so checking keeps up with the USB transfer with
+// plenty to spare.
+//
+// This finds truncated sides (a READ which failed part way through a page on
+// a jam, say), data that isn't JPEG at all and images of the wrong size. It
+// can't tell whether the entropy-coded data itself decodes.
+
+#ifndef THIRD_PARTY_KVS3105USB_JPEGCHECK_H_
+#define THIRD_PARTY_KVS3105USB_JPEGCHECK_H_
+
+#include <stdint.h>
+
+struct jpeg_check {
+  // the rest is private
+  int state;
+  uint8_t marker;
+  uint8_t header[7];
+  unsigned header_length;
+  unsigned remaining;
+  int seen_sof, seen_sos;
+  uint32_t width, height;
+  uint32_t expected_width, expected_height;
+  uint64_t offset;
+  const char *error;
+  uint64_t error_offset;
+  char message[128];
+};
+
+// -----------------------------------------------------------------------------
+// Start checking a side. If expected_width and expected_height are non-zero,
+// the SOF must match them.
+// -----------------------------------------------------------------------------
+void jpeg_check_init(struct jpeg_check *check, uint32_t expected_width,
+                     uint32_t expected_height);
+
+// -----------------------------------------------------------------------------
+// Check the next length bytes of the side. Returns 0 while the data is still
+// good, and non-zero from the first problem on.
+// -----------------------------------------------------------------------------
+int jpeg_check_update(struct jpeg_check *check, const uint8_t *data,
+                      unsigned length);
+
+// -----------------------------------------------------------------------------
+// Finish checking a side. Returns NULL if it was a complete JPEG, or else a
+// description of the first problem, which is valid until the check is reused.
+// -----------------------------------------------------------------------------
+const char *jpeg_check_finish(struct jpeg_check *check);
+
+#endif  // THIRD_PARTY_KVS3105USB_JPEGCHECK_H_
@@ -0,0 +1,390 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// JPEG compression of uncompressed gray and colour scans on the host, on the
+// way to another sink, as if the scanner had been asked for JPEG.
+//
+// Each side is cut into horizontal strips, which are encoded with libjpeg on
+// a worker pool as soon as their rows have been read. Every strip is encoded
+// with the same tables and a restart marker after each row of MCUs, so the
+// strips' entropy-coded data can simply be joined into one baseline JPEG:
+//   the headers of the first strip, with the height of the whole side
+//   each strip's data, separated by RST7
+//   EOI
+// A strip is 16 rows of MCUs, a multiple of 8, so its restart markers run
+// RST0..RST7, RST0..RST6 and the next strip can start again from RST0.
+//
+// Encoded strips are passed on in order, from the reading thread, as they
+// finish. Reading waits when JPEG_QUEUE_PER_THREAD strips per worker are
+// queued, and at the end of each side for its last strips.
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include "sink.h"
+#include "pagebuf.h"
+#include "workpool.h"
+
+#define JPEG_QUEUE_PER_THREAD 2
+#define JPEG_STRIP_MCU_ROWS 16
+
+struct jpeg_strip {
+  struct workpool_task task;
+  struct jpeg_encode_sink *sink;
+  // the first strip of a side keeps its headers
+  int first;
+  uint32_t width, rows;
+  int components;
+  struct pagebuf raw;
+  // from libjpeg, and where the entropy-coded data starts and ends in it
+  uint8_t *coded;
+  unsigned long coded_length;
+  size_t data_start, data_end;
+  // protected by sink->lock
+  int done, failed;
+  struct jpeg_strip *next;
+};
+
+struct jpeg_encode_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  int quality;
+  struct workpool *pool;
+  unsigned max_queued;
+  // whether the current side is being encoded
+  int active;
+  struct page_info info;
+  struct kvs3105_window window;
+  size_t stride;
+  uint32_t strip_rows;
+  // bytes of the side received so far
+  uint64_t received;
+  // the strip being filled
+  struct jpeg_strip *current;
+  // strips waiting to be passed on, oldest first
+  struct jpeg_strip *head, *tail;
+  unsigned queued;
+  struct jpeg_strip *spare;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+struct encode_error {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void encode_error_exit(j_common_ptr cinfo) {
+  longjmp(((struct encode_error *) cinfo->err)->jump, 1);
+}
+
+// Find the entropy-coded data: from the end of the SOS segment to the EOI.
+// On the first strip, also set the height in SOF0 to the whole side's.
+static int find_data(struct jpeg_strip *strip, uint32_t height) {
+  const uint8_t *p = strip->coded;
+  const size_t length = strip->coded_length;
+  size_t i = 2;
+
+  while (i + 4 <= length && p[i] == 0xff) {
+    const uint8_t marker = p[i + 1];
+    const size_t segment = p[i + 2] << 8 | p[i + 3];
+    if (marker == 0xc0 && strip->first && i + 7 <= length) {
+      strip->coded[i + 5] = height >> 8;
+      strip->coded[i + 6] = height;
+    }
+    i += 2 + segment;
+    if (marker == 0xda) {
+      if (i + 2 > length)
+        return 1;
+      strip->data_start = i;
+      strip->data_end = length - 2;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void encode_strip(struct workpool_task *task) {
+  struct jpeg_strip *strip = (struct jpeg_strip *) task;
+  struct jpeg_encode_sink *s = strip->sink;
+  struct jpeg_compress_struct cinfo;
+  struct encode_error error;
+  int failed = 1;
+
+  strip->coded = NULL;
+  strip->coded_length = 0;
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = encode_error_exit;
+  if (!setjmp(error.jump)) {
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &strip->coded, &strip->coded_length);
+    cinfo.image_width = strip->width;
+    cinfo.image_height = strip->rows;
+    cinfo.input_components = strip->components;
+    cinfo.in_color_space = strip->components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, s->quality, TRUE);
+    cinfo.restart_in_rows = 1;
+    cinfo.write_JFIF_header = strip->first;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+      JSAMPROW rows[1] = { strip->raw.data +
+                           (size_t) cinfo.next_scanline * s->stride };
+      jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    failed = find_data(strip, s->info.height);
+  }
+  jpeg_destroy_compress(&cinfo);
+
+  pthread_mutex_lock(&s->lock);
+  strip->done = 1;
+  strip->failed = failed;
+  pthread_cond_broadcast(&s->finished);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Pass on the oldest strip, waiting for it to be encoded if wait is set.
+// Returns 0 if there was nothing to do.
+static int pass_on(struct jpeg_encode_sink *s, int wait, int *error) {
+  static const uint8_t rst7[2] = { 0xff, 0xd7 };
+  struct jpeg_strip *strip = s->head;
+
+  if (!strip)
+    return 0;
+  pthread_mutex_lock(&s->lock);
+  while (wait && !strip->done)
+    pthread_cond_wait(&s->finished, &s->lock);
+  const int done = strip->done;
+  pthread_mutex_unlock(&s->lock);
+  if (!done)
+    return 0;
+
+  s->head = strip->next;
+  if (!s->head)
+    s->tail = NULL;
+  s->queued--;
+  if (strip->failed) {
+    fprintf(stderr, "page %d%s: JPEG encoding failed\n", s->info.page,
+            s->info.side ? "B" : "A");
+    *error = 1;
+  } else if (!*error &&
+             ((strip->first ?
+               page_sink_write(s->next, strip->coded, strip->data_start) :
+               s->next->write(s->next, rst7, sizeof(rst7))) ||
+              page_sink_write(s->next, strip->coded + strip->data_start,
+                              strip->data_end - strip->data_start))) {
+    *error = 1;
+  }
+  free(strip->coded);
+  strip->coded = NULL;
+  strip->next = s->spare;
+  s->spare = strip;
+  return 1;
+}
+
+static int pass_on_all(struct jpeg_encode_sink *s) {
+  int error = 0;
+  while (pass_on(s, 1, &error))
+    continue;
+  return error;
+}
+
+static struct jpeg_strip *new_strip(struct jpeg_encode_sink *s) {
+  struct jpeg_strip *strip = s->spare;
+
+  if (strip) {
+    s->spare = strip->next;
+  } else {
+    strip = calloc(1, sizeof(struct jpeg_strip));
+    if (!strip) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      return NULL;
+    }
+  }
+  strip->task.run = encode_strip;
+  strip->sink = s;
+  strip->first = !s->received;
+  strip->width = s->info.width;
+  strip->components = s->info.window->bpp / 8;
+  pagebuf_reset(&strip->raw);
+  strip->done = strip->failed = 0;
+  strip->next = NULL;
+  return strip;
+}
+
+// Queue the current strip for encoding
+static int submit(struct jpeg_encode_sink *s) {
+  struct jpeg_strip *strip = s->current;
+  int error = 0;
+
+  s->current = NULL;
+  strip->rows = strip->raw.length / s->stride;
+  if (s->tail)
+    s->tail->next = strip;
+  else
+    s->head = strip;
+  s->tail = strip;
+  s->queued++;
+  workpool_submit(s->pool, &strip->task);
+  while (pass_on(s, s->queued > s->max_queued, &error))
+    continue;
+  return error;
+}
+
+static int jpeg_encode_begin_page(struct page_sink *sink,
+                                  const struct page_info *info) {
+  struct jpeg_encode_sink *s = (struct jpeg_encode_sink *) sink;
+
+  s->active = !info->compression_type &&
+      (info->window->bpp == 8 || info->window->bpp == 24) &&
+      info->width && info->height && info->height <= 0xffff;
+  if (!s->active)
+    return s->next->begin_page(s->next, info);
+
+  s->window = *info->window;
+  s->window.compression_type = 0x81;
+  s->window.compression_argument = s->quality;
+  s->info = *info;
+  s->info.compression_type = 0x81;
+  s->info.window = &s->window;
+  s->info.size_hint = info->size_hint / 10;
+  s->stride = (size_t) info->width * (info->window->bpp / 8);
+  // libjpeg's default sampling: 2x2 for colour, so 16-row MCUs
+  s->strip_rows = JPEG_STRIP_MCU_ROWS * (info->window->bpp == 24 ? 16 : 8);
+  s->received = 0;
+  s->current = NULL;
+  return s->next->begin_page(s->next, &s->info);
+}
+
+// Add length bytes of the side, or white if data is NULL
+static int add(struct jpeg_encode_sink *s, const uint8_t *data,
+               size_t length) {
+  const uint64_t total = (uint64_t) s->stride * s->info.height;
+
+  // Anything past the height given at the start is dropped
+  if (length > total - s->received)
+    length = total - s->received;
+  while (length) {
+    if (!s->current && !(s->current = new_strip(s)))
+      return 1;
+    struct pagebuf *raw = &s->current->raw;
+    const size_t room = s->strip_rows * s->stride - raw->length;
+    const size_t n = length < room ? length : room;
+    if (pagebuf_reserve(raw, raw->length + n))
+      return 1;
+    if (data)
+      memcpy(raw->data + raw->length, data, n);
+    else
+      memset(raw->data + raw->length, 0xff, n);
+    raw->length += n;
+    s->received += n;
+    length -= n;
+    if (data)
+      data += n;
+    if (raw->length == s->strip_rows * s->stride && submit(s))
+      return 1;
+  }
+  return 0;
+}
+
+static int jpeg_encode_write(struct page_sink *sink, const uint8_t *data,
+                             unsigned length) {
+  struct jpeg_encode_sink *s = (struct jpeg_encode_sink *) sink;
+
+  if (!s->active)
+    return s->next->write(s->next, data, length);
+  return add(s, data, length);
+}
+
+static int jpeg_encode_end_page(struct page_sink *sink) {
+  struct jpeg_encode_sink *s = (struct jpeg_encode_sink *) sink;
+  static const uint8_t eoi[2] = { 0xff, 0xd9 };
+  const uint64_t total = (uint64_t) s->stride * s->info.height;
+
+  if (!s->active)
+    return s->next->end_page(s->next);
+  // The height is already in the headers, so a short side is made up with
+  // white
+  if (s->received < total) {
+    fprintf(stderr, "page %d%s: %llu rows missing, filled with white\n",
+            s->info.page, s->info.side ? "B" : "A",
+            (unsigned long long) ((total - s->received) / s->stride));
+    if (add(s, NULL, total - s->received))
+      return 1;
+  }
+  if ((s->current && submit(s)) || pass_on_all(s) ||
+      s->next->write(s->next, eoi, sizeof(eoi)))
+    return 1;
+  return s->next->end_page(s->next);
+}
+
+static void free_strips(struct jpeg_strip *strip) {
+  while (strip) {
+    struct jpeg_strip *next = strip->next;
+    pagebuf_free(&strip->raw);
+    free(strip->coded);
+    free(strip);
+    strip = next;
+  }
+}
+
+static int jpeg_encode_close(struct page_sink *sink) {
+  struct jpeg_encode_sink *s = (struct jpeg_encode_sink *) sink;
+  // Strips of a side which didn't finish are only waited for, not passed on
+  int error = 1;
+
+  while (pass_on(s, 1, &error))
+    continue;
+  const int r = s->next->close(s->next);
+  workpool_free(s->pool);
+  if (s->current) {
+    s->current->next = s->spare;
+    s->spare = s->current;
+  }
+  free_strips(s->spare);
+  pthread_cond_destroy(&s->finished);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+  return r;
+}
+
+struct page_sink *jpeg_encode_sink_new(struct page_sink *next, int quality,
+                                       unsigned threads) {
+  struct jpeg_encode_sink *s = calloc(1, sizeof(struct jpeg_encode_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  s->pool = workpool_new(threads);
+  if (!s->pool) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->finished, NULL);
+  s->max_queued = JPEG_QUEUE_PER_THREAD * workpool_threads(s->pool);
+  s->quality = quality;
+  s->base.begin_page = jpeg_encode_begin_page;
+  s->base.write = jpeg_encode_write;
+  s->base.end_page = jpeg_encode_end_page;
+  s->base.close = jpeg_encode_close;
+  s->next = next;
+  return &s->base;
+}
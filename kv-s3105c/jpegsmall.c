@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <jpeglib.h>
+
+#include "jpegsmall.h"
+
+struct decode_error {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void decode_error_exit(j_common_ptr cinfo) {
+  longjmp(((struct decode_error *) cinfo->err)->jump, 1);
+}
+
+// Corrupt data is reported by the caller
+static void decode_output_message(j_common_ptr cinfo) {
+}
+
+int jpeg_decode_small(const uint8_t *data, size_t length, uint8_t **pixels,
+                      unsigned *width, unsigned *height) {
+  struct jpeg_decompress_struct cinfo;
+  struct decode_error error;
+  // volatile since it's used after a longjmp
+  uint8_t *volatile out = NULL;
+
+  cinfo.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = decode_error_exit;
+  error.pub.output_message = decode_output_message;
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(out);
+    return 1;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (uint8_t *) data, length);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 8;
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+  out = malloc((size_t) cinfo.output_width * cinfo.output_height);
+  if (!out)
+    longjmp(error.jump, 1);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW rows[1] = { out + (size_t) cinfo.output_scanline *
+                               cinfo.output_width };
+    jpeg_read_scanlines(&cinfo, rows, 1);
+  }
+  *width = cinfo.output_width;
+  *height = cinfo.output_height;
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  *pixels = out;
+  return 0;
+}
@@ -0,0 +1,33 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Fast, small decodes of JPEG sides, for looking at a page rather than
+// displaying it.
+
+#ifndef THIRD_PARTY_KVS3105USB_JPEGSMALL_H_
+#define THIRD_PARTY_KVS3105USB_JPEGSMALL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Decode a JPEG at 1/8 scale in gray. At that scale libjpeg only uses the DC
+// coefficient of each block, so this costs little more than the entropy
+// decoding. On success, returns 0 and sets *pixels to a malloced buffer of
+// *width x *height bytes.
+// -----------------------------------------------------------------------------
+int jpeg_decode_small(const uint8_t *data, size_t length, uint8_t **pixels,
+                      unsigned *width, unsigned *height);
+
+#endif  // THIRD_PARTY_KVS3105USB_JPEGSMALL_H_
@@ -0,0 +1,176 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reader for packed page archives. See kvarchive.h.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kvarchive.h"
+#include "crc32c.h"
+
+struct kvarchive {
+  const uint8_t *map;
+  size_t size;
+  const struct kvarchive_record *records;
+  unsigned count;
+  // 2 if the archive holds both sides of every page, otherwise 1
+  unsigned sides;
+};
+
+struct kvarchive *kvarchive_open(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size < KVARCHIVE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a page archive\n", path);
+    close(fd);
+    return NULL;
+  }
+  const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  uint32_t version, count;
+  uint64_t index_offset;
+  memcpy(&version, map + 8, 4);
+  memcpy(&count, map + 12, 4);
+  memcpy(&index_offset, map + 16, 8);
+  version = le32toh(version);
+  count = le32toh(count);
+  index_offset = le64toh(index_offset);
+
+  const char *error = NULL;
+  if (memcmp(map, KVARCHIVE_MAGIC, 8))
+    error = "not a page archive";
+  else if (version != KVARCHIVE_VERSION)
+    error = "unsupported archive version";
+  else if (!index_offset)
+    error = "archive wasn't finished";
+  else if (index_offset % 8 ||
+           index_offset > (uint64_t) st.st_size ||
+           ((uint64_t) st.st_size - index_offset) /
+               sizeof(struct kvarchive_record) < count)
+    error = "corrupt archive index";
+  if (error) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    munmap((void *) map, st.st_size);
+    return NULL;
+  }
+
+  struct kvarchive *archive = calloc(1, sizeof(struct kvarchive));
+  if (!archive) {
+    munmap((void *) map, st.st_size);
+    return NULL;
+  }
+  archive->map = map;
+  archive->size = st.st_size;
+  archive->records = (const struct kvarchive_record *) (map + index_offset);
+  archive->count = count;
+  archive->sides = count > 1 &&
+      archive->records[0].page == archive->records[1].page ? 2 : 1;
+  return archive;
+}
+
+unsigned kvarchive_count(const struct kvarchive *archive) {
+  return archive->count;
+}
+
+int kvarchive_get(const struct kvarchive *archive, unsigned index,
+                  struct kvarchive_page *page) {
+  if (index >= archive->count)
+    return 1;
+  const struct kvarchive_record *r = &archive->records[index];
+  const uint64_t offset = le64toh(r->offset);
+  const uint64_t length = le64toh(r->length);
+  if (offset > archive->size || archive->size - offset < length)
+    return 1;
+
+  page->page = le32toh(r->page);
+  page->side = r->side;
+  page->compression_type = r->compression_type;
+  page->width = le32toh(r->width);
+  page->height = le32toh(r->height);
+  page->data = archive->map + offset;
+  page->length = length;
+  page->crc32c = le32toh(r->crc32c);
+  return 0;
+}
+
+static int compare(const struct kvarchive_record *r, uint32_t page, int side) {
+  const uint32_t p = le32toh(r->page);
+  if (p != page)
+    return p < page ? -1 : 1;
+  return r->side - side;
+}
+
+int kvarchive_find(const struct kvarchive *archive, uint32_t page, int side,
+                   struct kvarchive_page *result) {
+  if (!archive->count)
+    return 1;
+
+  // kvscanner writes consecutive pages, so the position can be computed
+  const uint32_t first = le32toh(archive->records[0].page);
+  if (page >= first) {
+    const uint64_t guess = (uint64_t) (page - first) * archive->sides +
+        (archive->sides == 2 ? side : 0);
+    if (guess < archive->count &&
+        !compare(&archive->records[guess], page, side))
+      return kvarchive_get(archive, guess, result);
+  }
+
+  unsigned lo = 0, hi = archive->count;
+  while (lo < hi) {
+    const unsigned mid = lo + (hi - lo) / 2;
+    const int c = compare(&archive->records[mid], page, side);
+    if (!c)
+      return kvarchive_get(archive, mid, result);
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 1;
+}
+
+int kvarchive_verify(const struct kvarchive_page *page) {
+  return crc32c(0, page->data, page->length) != page->crc32c;
+}
+
+void kvarchive_close(struct kvarchive *archive) {
+  if (!archive)
+    return;
+  munmap((void *) archive->map, archive->size);
+  free(archive);
+}
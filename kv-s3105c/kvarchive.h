@@ -0,0 +1,113 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Packed page archives.
+//
+// kvscanner -o archive appends every side of a job to one file, instead of a
+// file per side, and finishes it with a fixed-size index record per side.
+// This library maps an archive and hands out pointers straight into the
+// mapping, so a reader pays one open and one mmap per job rather than an
+// open/stat/read/close per page.
+//
+// File layout (all integers little endian):
+//   header (32 bytes):
+//     0: magic "KVSPAK01"
+//     8: uint32 version (1)
+//    12: uint32 number of index records
+//    16: uint64 offset of the index, or 0 if the archive wasn't finished
+//    24: uint64 reserved
+//   page data, back to back, in the order it was scanned
+//   index (8 byte aligned): one struct kvarchive_record per side
+//
+// Records are in scan order, which is ascending (page, side) order.
+
+#ifndef THIRD_PARTY_KVS3105USB_KVARCHIVE_H_
+#define THIRD_PARTY_KVS3105USB_KVARCHIVE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define KVARCHIVE_MAGIC "KVSPAK01"
+#define KVARCHIVE_VERSION 1
+#define KVARCHIVE_HEADER_SIZE 32
+
+// One index record, as stored in the file
+struct kvarchive_record {
+  uint32_t page;
+  uint8_t side;               // 0 -> front, 1 -> back
+  uint8_t compression_type;   // as in kvs3105_window
+  uint16_t reserved;
+  uint32_t width, height;     // from kvs3105_picture_size
+  uint64_t offset;            // of the page data from the start of the file
+  uint64_t length;
+  uint32_t crc32c;            // of the page data
+  uint32_t reserved2;
+};
+
+// A page, as returned by the reader. data points into the mapping and is
+// valid until kvarchive_close.
+struct kvarchive_page {
+  uint32_t page;
+  int side;
+  uint8_t compression_type;
+  uint32_t width, height;
+  const uint8_t *data;
+  uint64_t length;
+  uint32_t crc32c;
+};
+
+struct kvarchive;
+
+// -----------------------------------------------------------------------------
+// Map an archive. Returns NULL (having printed a message) if it can't be
+// opened or isn't a finished archive.
+// -----------------------------------------------------------------------------
+struct kvarchive *kvarchive_open(const char *path);
+
+// -----------------------------------------------------------------------------
+// Return the number of sides in the archive.
+// -----------------------------------------------------------------------------
+unsigned kvarchive_count(const struct kvarchive *archive);
+
+// -----------------------------------------------------------------------------
+// Get the index'th side in scan order.
+// -----------------------------------------------------------------------------
+int kvarchive_get(const struct kvarchive *archive, unsigned index,
+                  struct kvarchive_page *page);
+
+// -----------------------------------------------------------------------------
+// Get a side by page number. This is O(1) for archives of consecutive pages,
+// as kvscanner writes, with a binary search as a fallback.
+// -----------------------------------------------------------------------------
+int kvarchive_find(const struct kvarchive *archive, uint32_t page, int side,
+                   struct kvarchive_page *result);
+
+// -----------------------------------------------------------------------------
+// Return 0 if the page's data matches its checksum.
+// -----------------------------------------------------------------------------
+int kvarchive_verify(const struct kvarchive_page *page);
+
+// -----------------------------------------------------------------------------
+// Unmap the archive.
+// -----------------------------------------------------------------------------
+void kvarchive_close(struct kvarchive *archive);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_KVARCHIVE_H_
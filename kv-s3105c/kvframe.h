@@ -0,0 +1,50 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The framed stream written by kvscanner -o framed.
+//
+// The stream is a sequence of 32 byte headers, all integers in network byte
+// order. A page header is followed by length bytes of image data, exactly as
+// the scanner produced it. After the last page of a job which succeeded comes
+// a trailer, so a consumer can tell a finished job from one which was cut
+// short or failed, whose stream just ends:
+//
+//   page header:
+//      0: magic "KVSF"
+//      4: uint32 page number
+//      8: uint8 side (0 -> front, 1 -> back)
+//      9: uint8 compression type (as in kvs3105_window)
+//     10: uint16 reserved
+//     12: uint32 width in pixels
+//     16: uint32 height in pixels
+//     20: uint32 reserved
+//     24: uint64 length of the data which follows
+//
+//   trailer:
+//      0: magic "KVSE"
+//      4: uint32 number of pages in the stream
+//      8: uint64 total length of the page data
+//     16: 16 bytes reserved
+//
+// A side is only written once it has been read completely, so a page that
+// fails half way never appears in the stream.
+
+#ifndef THIRD_PARTY_KVS3105USB_KVFRAME_H_
+#define THIRD_PARTY_KVS3105USB_KVFRAME_H_
+
+#define KVFRAME_HEADER_SIZE 32
+#define KVFRAME_PAGE_MAGIC "KVSF"
+#define KVFRAME_TRAILER_MAGIC "KVSE"
+
+#endif  // THIRD_PARTY_KVS3105USB_KVFRAME_H_
@@ -0,0 +1,410 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "kvring.h"
+
+#define RING_MAGIC 0x4b565352  // "KVSR"
+#define RING_VERSION 1
+#define MIN_CAPACITY (1 << 20)
+// Records wrap to the start of the ring rather than straddle its end. Where
+// there's room a PAD record says so; where there isn't, the gap is implied.
+#define RECORD_PAD 0
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+// How often a blocked producer checks whether consumers are still alive
+#define PRODUCER_POLL_MS 100
+
+// All positions are byte counts since the ring was created; the offset in
+// the ring is the position modulo the capacity. Fields written by different
+// processes are kept on separate cache lines.
+struct consumer_slot {
+  uint32_t active;
+  uint32_t pid;
+  // the position of the next record this consumer will read
+  uint64_t tail;
+  uint8_t pad[48];
+};
+
+struct ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint32_t policy;
+  uint32_t closed;
+  uint8_t pad0[40];
+
+  // Written by the producer. It writes into [head, reserved_end) and then
+  // moves head up to reserved_end.
+  uint64_t head;
+  uint64_t reserved_end;
+  uint64_t last_page_start;
+  // futex, bumped whenever head moves
+  uint32_t head_seq;
+  uint32_t head_waiters;
+  uint8_t pad1[32];
+
+  // Written by consumers. futex, bumped whenever a tail moves.
+  uint32_t tail_seq;
+  uint32_t tail_waiters;
+  uint8_t pad2[56];
+
+  struct consumer_slot consumers[KVRING_MAX_CONSUMERS];
+};
+
+#define DATA_OFFSET ((sizeof(struct ring_header) + 4095) & ~(size_t) 4095)
+
+struct kvring {
+  struct ring_header *header;
+  uint8_t *data;
+  size_t map_size;
+};
+
+struct kvring_consumer {
+  struct ring_header *header;
+  uint8_t *data;
+  size_t map_size;
+  struct consumer_slot *slot;
+  // the record handed out by kvring_read
+  uint64_t held, held_end;
+  // set after losing data, until the next PAGE_START
+  int resync;
+};
+
+static int futex_wait(uint32_t *word, uint32_t value, int timeout_ms) {
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+  return syscall(SYS_futex, word, FUTEX_WAIT, value,
+                 timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Bump a futex word and wake anybody waiting on it
+static void signal_word(uint32_t *word, uint32_t *waiters) {
+  __atomic_fetch_add(word, 1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+    futex_wake(word);
+}
+
+static void *map_ring(const char *name, int create, size_t capacity,
+                      size_t *map_size) {
+  char *path;
+  if (asprintf(&path, "/kvs3105-ring-%s", name) == -1)
+    return NULL;
+  if (create)
+    shm_unlink(path);
+  const int fd = shm_open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR,
+                          0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open shared memory %s: %s\n", path,
+            strerror(errno));
+    free(path);
+    return NULL;
+  }
+  free(path);
+
+  if (create) {
+    *map_size = DATA_OFFSET + capacity;
+    if (ftruncate(fd, *map_size)) {
+      close(fd);
+      return NULL;
+    }
+  } else {
+    struct ring_header h;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != RING_MAGIC ||
+        h.version != RING_VERSION) {
+      fprintf(stderr, "kvs3105-ring-%s is not a page ring\n", name);
+      close(fd);
+      return NULL;
+    }
+    *map_size = DATA_OFFSET + h.capacity;
+  }
+  void *p = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  return p;
+}
+
+struct kvring *kvring_create(const char *name, size_t capacity,
+                             enum kvring_policy policy) {
+  size_t size = MIN_CAPACITY;
+  while (size < capacity)
+    size <<= 1;
+
+  struct kvring *ring = calloc(1, sizeof(struct kvring));
+  if (!ring)
+    return NULL;
+  ring->header = map_ring(name, 1, size, &ring->map_size);
+  if (!ring->header) {
+    free(ring);
+    return NULL;
+  }
+  ring->data = (uint8_t *) ring->header + DATA_OFFSET;
+  ring->header->capacity = size;
+  ring->header->policy = policy;
+  ring->header->version = RING_VERSION;
+  __atomic_store_n(&ring->header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+  return ring;
+}
+
+void kvring_set_policy(struct kvring *ring, enum kvring_policy policy) {
+  __atomic_store_n(&ring->header->policy, policy, __ATOMIC_RELAXED);
+}
+
+// Wait until the slowest live consumer leaves room to write up to end
+static void wait_for_room(struct kvring *ring, uint64_t end) {
+  struct ring_header *h = ring->header;
+
+  for (;;) {
+    const uint32_t seq = __atomic_load_n(&h->tail_seq, __ATOMIC_ACQUIRE);
+    int full = 0;
+    for (int i = 0; i < KVRING_MAX_CONSUMERS; i++) {
+      struct consumer_slot *c = &h->consumers[i];
+      if (!__atomic_load_n(&c->active, __ATOMIC_ACQUIRE))
+        continue;
+      if (end - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) <= h->capacity)
+        continue;
+      if (kill(c->pid, 0) && errno == ESRCH) {
+        // It died without detaching
+        __atomic_store_n(&c->active, 0, __ATOMIC_RELEASE);
+        continue;
+      }
+      full = 1;
+    }
+    if (!full || h->policy != KVRING_BLOCK)
+      return;
+
+    __atomic_fetch_add(&h->tail_waiters, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&h->tail_seq, seq, PRODUCER_POLL_MS);
+    __atomic_fetch_sub(&h->tail_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+int kvring_write(struct kvring *ring, const struct kvring_record *record,
+                 const uint8_t *data) {
+  struct ring_header *h = ring->header;
+  const uint64_t capacity = h->capacity;
+  const uint64_t need = ALIGN8(sizeof(*record) + record->length);
+
+  if (need > capacity / 2) {
+    fprintf(stderr, "Record too large for the ring: %u bytes\n",
+            record->length);
+    return 1;
+  }
+
+  uint64_t pos = h->head;
+  const uint64_t space = capacity - (pos & (capacity - 1));
+  const uint64_t pad = space < need ? space : 0;
+  const uint64_t end = pos + pad + need;
+
+  wait_for_room(ring, end);
+  __atomic_store_n(&h->reserved_end, end, __ATOMIC_RELEASE);
+  // Consumers must see the reservation before any of the bytes change
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (pad >= sizeof(*record)) {
+    struct kvring_record padding;
+    memset(&padding, 0, sizeof(padding));
+    padding.type = RECORD_PAD;
+    memcpy(ring->data + (pos & (capacity - 1)), &padding, sizeof(padding));
+  }
+  pos += pad;
+  uint8_t *p = ring->data + (pos & (capacity - 1));
+  memcpy(p, record, sizeof(*record));
+  if (record->length)
+    memcpy(p + sizeof(*record), data, record->length);
+
+  if (record->type == KVRING_PAGE_START)
+    __atomic_store_n(&h->last_page_start, pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->head, end, __ATOMIC_RELEASE);
+  signal_word(&h->head_seq, &h->head_waiters);
+  return 0;
+}
+
+void kvring_close(struct kvring *ring) {
+  if (!ring)
+    return;
+  struct kvring_record record;
+  memset(&record, 0, sizeof(record));
+  record.type = KVRING_JOB_END;
+  kvring_write(ring, &record, NULL);
+  __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+  signal_word(&ring->header->head_seq, &ring->header->head_waiters);
+  munmap(ring->header, ring->map_size);
+  free(ring);
+}
+
+// Is everything from pos onwards still intact?
+static int intact(const struct ring_header *h, uint64_t pos) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&h->reserved_end, __ATOMIC_ACQUIRE) <=
+      pos + h->capacity;
+}
+
+// Move a consumer to the start of the latest page, if that's no earlier than
+// from and is still intact, or else to the head to wait for the next page
+static void recover(struct kvring_consumer *c, uint64_t from) {
+  struct ring_header *h = c->header;
+  const uint64_t page = __atomic_load_n(&h->last_page_start,
+                                        __ATOMIC_ACQUIRE);
+  if (page >= from && intact(h, page)) {
+    __atomic_store_n(&c->slot->tail, page, __ATOMIC_RELEASE);
+    c->resync = 0;
+  } else {
+    __atomic_store_n(&c->slot->tail,
+                     __atomic_load_n(&h->head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    c->resync = 1;
+  }
+  signal_word(&h->tail_seq, &h->tail_waiters);
+}
+
+struct kvring_consumer *kvring_attach(const char *name) {
+  struct kvring_consumer *c = calloc(1, sizeof(struct kvring_consumer));
+  if (!c)
+    return NULL;
+  c->header = map_ring(name, 0, 0, &c->map_size);
+  if (!c->header) {
+    free(c);
+    return NULL;
+  }
+  c->data = (uint8_t *) c->header + DATA_OFFSET;
+
+  struct ring_header *h = c->header;
+  for (int i = 0; i < KVRING_MAX_CONSUMERS; i++) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&h->consumers[i].active, &expected, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      c->slot = &h->consumers[i];
+      break;
+    }
+  }
+  if (!c->slot) {
+    fprintf(stderr, "The ring already has %d consumers\n",
+            KVRING_MAX_CONSUMERS);
+    munmap(c->header, c->map_size);
+    free(c);
+    return NULL;
+  }
+  c->slot->pid = getpid();
+  // Start at the beginning of the current page, if it's still there
+  c->slot->tail = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  recover(c, 0);
+  return c;
+}
+
+int kvring_read(struct kvring_consumer *c, struct kvring_record *record,
+                const uint8_t **data, int timeout_ms) {
+  struct ring_header *h = c->header;
+  const uint64_t capacity = h->capacity;
+  const uint64_t deadline = now_ms() + timeout_ms;
+
+  for (;;) {
+    const uint32_t seq = __atomic_load_n(&h->head_seq, __ATOMIC_ACQUIRE);
+    const uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = c->slot->tail;
+
+    if (tail == head) {
+      if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+        return KVRING_END;
+      int wait_ms = -1;
+      if (timeout_ms >= 0) {
+        const uint64_t now = now_ms();
+        if (now >= deadline)
+          return KVRING_TIMEOUT;
+        wait_ms = deadline - now;
+      }
+      __atomic_fetch_add(&h->head_waiters, 1, __ATOMIC_SEQ_CST);
+      futex_wait(&h->head_seq, seq, wait_ms);
+      __atomic_fetch_sub(&h->head_waiters, 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    if (!intact(h, tail)) {
+      recover(c, tail);
+      return KVRING_LOST;
+    }
+    const uint64_t offset = tail & (capacity - 1);
+    int wrap = capacity - offset < sizeof(*record);
+    if (!wrap) {
+      memcpy(record, c->data + offset, sizeof(*record));
+      if (!intact(h, tail)) {
+        recover(c, tail);
+        return KVRING_LOST;
+      }
+      wrap = record->type == RECORD_PAD;
+    }
+    if (wrap) {
+      __atomic_store_n(&c->slot->tail, tail + capacity - offset,
+                       __ATOMIC_RELEASE);
+      signal_word(&h->tail_seq, &h->tail_waiters);
+      continue;
+    }
+
+    c->held = tail;
+    c->held_end = tail + ALIGN8(sizeof(*record) + record->length);
+    if (c->resync && record->type != KVRING_PAGE_START) {
+      // Skip the rest of a page we've lost the start of
+      __atomic_store_n(&c->slot->tail, c->held_end, __ATOMIC_RELEASE);
+      signal_word(&h->tail_seq, &h->tail_waiters);
+      continue;
+    }
+    c->resync = 0;
+    *data = record->length ? c->data + offset + sizeof(*record) : NULL;
+    return KVRING_OK;
+  }
+}
+
+int kvring_release(struct kvring_consumer *c) {
+  struct ring_header *h = c->header;
+
+  if (!intact(h, c->held)) {
+    recover(c, c->held);
+    return KVRING_LOST;
+  }
+  __atomic_store_n(&c->slot->tail, c->held_end, __ATOMIC_RELEASE);
+  signal_word(&h->tail_seq, &h->tail_waiters);
+  return KVRING_OK;
+}
+
+void kvring_detach(struct kvring_consumer *c) {
+  if (!c)
+    return;
+  __atomic_store_n(&c->slot->active, 0, __ATOMIC_RELEASE);
+  signal_word(&c->header->tail_seq, &c->header->tail_waiters);
+  munmap(c->header, c->map_size);
+  free(c);
+}
@@ -0,0 +1,145 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A single-producer, multi-consumer ring of page data in shared memory.
+//
+// kvscanner -o ring creates /dev/shm/kvs3105-ring-<name> and appends a record
+// for each chunk as soon as kvs3105_read_data returns it, so a consumer on the
+// same host can start on a page while the rest of it is still being read. A
+// side is a PAGE_START record, any number of CHUNK records and a PAGE_END
+// record; the job finishes with a JOB_END record.
+//
+// Each consumer has its own cursor, so every consumer sees every record. What
+// happens when the slowest consumer is a whole ring behind depends on the
+// policy the producer chose:
+//   block: the producer waits for it (a consumer which dies without detaching
+//     is noticed and dropped).
+//   overwrite: the producer carries on, and the consumer is told that it lost
+//     data and resumes at the next page.
+// Waiting on either side uses futexes in the segment, and the fast paths make
+// no syscalls at all.
+//
+// Build consumers against libkvring.a (-lrt).
+
+#ifndef THIRD_PARTY_KVS3105USB_KVRING_H_
+#define THIRD_PARTY_KVS3105USB_KVRING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KVRING_MAX_CONSUMERS 8
+
+enum kvring_policy {
+  KVRING_BLOCK,
+  KVRING_OVERWRITE,
+};
+
+enum kvring_record_type {
+  KVRING_PAGE_START = 1,
+  KVRING_CHUNK,
+  KVRING_PAGE_END,
+  KVRING_JOB_END,
+};
+
+// The header of every record. For CHUNK records length bytes of image data
+// follow; the other types have none. The page fields are repeated in every
+// record of a side.
+struct kvring_record {
+  uint32_t type;
+  uint32_t length;
+  uint32_t page;
+  uint8_t side;
+  uint8_t compression_type;
+  uint16_t reserved;
+  uint32_t width, height;
+};
+
+// Results of kvring_read and kvring_release
+enum {
+  KVRING_OK = 0,
+  KVRING_ERROR = -1,
+  KVRING_TIMEOUT = -2,
+  // the producer overwrote data this consumer hadn't read yet
+  KVRING_LOST = -3,
+  // the producer has finished and every record has been read
+  KVRING_END = -4,
+};
+
+struct kvring;
+struct kvring_consumer;
+
+// -----------------------------------------------------------------------------
+// Create (or replace) the ring kvs3105-ring-<name> with room for capacity
+// bytes of records. capacity is rounded up to a power of two of at least
+// 1MB. Returns NULL on error.
+// -----------------------------------------------------------------------------
+struct kvring *kvring_create(const char *name, size_t capacity,
+                             enum kvring_policy policy);
+
+// -----------------------------------------------------------------------------
+// Change the policy for when a consumer falls a whole ring behind.
+// -----------------------------------------------------------------------------
+void kvring_set_policy(struct kvring *ring, enum kvring_policy policy);
+
+// -----------------------------------------------------------------------------
+// Append a record, with length bytes of data for a CHUNK. This blocks while a
+// consumer is a whole ring behind under KVRING_BLOCK. Returns 0 on success.
+// -----------------------------------------------------------------------------
+int kvring_write(struct kvring *ring, const struct kvring_record *record,
+                 const uint8_t *data);
+
+// -----------------------------------------------------------------------------
+// Append a JOB_END record and unmap the ring. The segment is left in /dev/shm
+// so that consumers which are behind can finish.
+// -----------------------------------------------------------------------------
+void kvring_close(struct kvring *ring);
+
+// -----------------------------------------------------------------------------
+// Attach to a ring as a new consumer, starting at the most recent PAGE_START
+// that's still in the ring. Returns NULL on error.
+// -----------------------------------------------------------------------------
+struct kvring_consumer *kvring_attach(const char *name);
+
+// -----------------------------------------------------------------------------
+// Get the next record, waiting up to timeout_ms (-1 for ever) for one. On
+// KVRING_OK, *data points at a CHUNK's bytes inside the ring; they stay valid
+// until kvring_release, which must be called before the next kvring_read.
+// Returns KVRING_LOST once after records were overwritten; reading then
+// continues at the next PAGE_START.
+// -----------------------------------------------------------------------------
+int kvring_read(struct kvring_consumer *consumer,
+                struct kvring_record *record, const uint8_t **data,
+                int timeout_ms);
+
+// -----------------------------------------------------------------------------
+// Finish with the record returned by kvring_read. Under KVRING_OVERWRITE this
+// returns KVRING_LOST if the producer overwrote the data while it was being
+// used, in which case it mustn't be trusted.
+// -----------------------------------------------------------------------------
+int kvring_release(struct kvring_consumer *consumer);
+
+// -----------------------------------------------------------------------------
+// Give up the consumer's slot and unmap the ring.
+// -----------------------------------------------------------------------------
+void kvring_detach(struct kvring_consumer *consumer);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_KVRING_H_
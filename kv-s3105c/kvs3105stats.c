@@ -0,0 +1,259 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kvs3105stats.h"
+
+#define STATS_MAGIC 0x4b565353  // "KVSS"
+#define STATS_VERSION 1
+#define STATS_FIELDS (sizeof(struct kvs3105_stats_values) / sizeof(uint64_t))
+#define MAX_REGISTERED 8
+// The read rate is measured over windows of at least this long
+#define RATE_WINDOW_NS 250000000ull
+
+// This is the layout of the shared segment. Readers must only access it with
+// the atomic builtins below.
+struct stats_segment {
+  uint32_t magic;
+  uint32_t version;
+  // odd while the writer is updating the values
+  uint32_t sequence;
+  uint32_t reserved;
+  uint64_t values[STATS_FIELDS];
+};
+
+struct kvs3105_stats {
+  struct stats_segment *segment;
+  usb_handle handle;
+  // The writer's private copy, published as a whole on each update
+  struct kvs3105_stats_values values;
+  uint64_t window_start_ns;
+  uint64_t window_bytes;
+  // The last READ ended a side, so the next one starts a new page_bytes
+  int page_ended;
+};
+
+static struct kvs3105_stats *registered[MAX_REGISTERED];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct kvs3105_stats *find_stats(usb_handle handle) {
+  for (int i = 0; i < MAX_REGISTERED; i++) {
+    if (registered[i] && registered[i]->handle == handle)
+      return registered[i];
+  }
+  return NULL;
+}
+
+static void publish(struct kvs3105_stats *stats) {
+  struct stats_segment *seg = stats->segment;
+  uint64_t fields[STATS_FIELDS];
+
+  stats->values.updated_ns = now_ns();
+  memcpy(fields, &stats->values, sizeof(fields));
+
+  const uint32_t seq = seg->sequence;
+  __atomic_store_n(&seg->sequence, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (unsigned i = 0; i < STATS_FIELDS; i++)
+    __atomic_store_n(&seg->values[i], fields[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&seg->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+static struct stats_segment *map_segment(const char *name, int create) {
+  char *path;
+  if (asprintf(&path, "/kvs3105-%s", name) == -1)
+    return NULL;
+  const int fd = shm_open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY,
+                          0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open shared memory %s: %s\n", path,
+            strerror(errno));
+    free(path);
+    return NULL;
+  }
+  free(path);
+  if (create && ftruncate(fd, sizeof(struct stats_segment))) {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, sizeof(struct stats_segment),
+                 create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                 fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  return p;
+}
+
+struct kvs3105_stats *kvs3105_stats_create(usb_handle handle,
+                                           const char *name) {
+  int slot;
+  for (slot = 0; slot < MAX_REGISTERED; slot++) {
+    if (!registered[slot])
+      break;
+  }
+  if (slot == MAX_REGISTERED)
+    return NULL;
+
+  struct kvs3105_stats *stats = calloc(1, sizeof(struct kvs3105_stats));
+  if (!stats)
+    return NULL;
+  stats->segment = map_segment(name, 1);
+  if (!stats->segment) {
+    free(stats);
+    return NULL;
+  }
+  stats->handle = handle;
+  stats->segment->magic = STATS_MAGIC;
+  stats->segment->version = STATS_VERSION;
+  publish(stats);
+  registered[slot] = stats;
+  return stats;
+}
+
+struct kvs3105_stats *kvs3105_stats_attach(const char *name) {
+  struct stats_segment *seg = map_segment(name, 0);
+  if (!seg)
+    return NULL;
+  if (seg->magic != STATS_MAGIC || seg->version != STATS_VERSION) {
+    fprintf(stderr, "kvs3105-%s is not a statistics segment\n", name);
+    munmap(seg, sizeof(*seg));
+    return NULL;
+  }
+  struct kvs3105_stats *stats = calloc(1, sizeof(struct kvs3105_stats));
+  if (!stats) {
+    munmap(seg, sizeof(*seg));
+    return NULL;
+  }
+  stats->segment = seg;
+  return stats;
+}
+
+void kvs3105_stats_read(const struct kvs3105_stats *stats,
+                        struct kvs3105_stats_values *values) {
+  const struct stats_segment *seg = stats->segment;
+  uint64_t fields[STATS_FIELDS];
+  uint32_t seq0, seq1;
+
+  do {
+    seq0 = __atomic_load_n(&seg->sequence, __ATOMIC_ACQUIRE);
+    if (seq0 & 1) {
+      seq1 = seq0 + 1;
+      continue;
+    }
+    for (unsigned i = 0; i < STATS_FIELDS; i++)
+      fields[i] = __atomic_load_n(&seg->values[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq1 = __atomic_load_n(&seg->sequence, __ATOMIC_RELAXED);
+  } while (seq0 != seq1);
+
+  memcpy(values, fields, sizeof(fields));
+}
+
+void kvs3105_stats_close(struct kvs3105_stats *stats) {
+  if (!stats)
+    return;
+  for (int i = 0; i < MAX_REGISTERED; i++) {
+    if (registered[i] == stats)
+      registered[i] = NULL;
+  }
+  munmap(stats->segment, sizeof(struct stats_segment));
+  free(stats);
+}
+
+void kvs3105_stats_note_page(usb_handle handle, uint64_t page, uint8_t side) {
+  struct kvs3105_stats *stats = find_stats(handle);
+  if (!stats)
+    return;
+  stats->values.page = page;
+  stats->values.side = side;
+  stats->values.page_bytes = 0;
+  stats->page_ended = 0;
+  publish(stats);
+}
+
+void kvs3105_stats_note_read(usb_handle handle, unsigned length,
+                             char end_of_page) {
+  struct kvs3105_stats *stats = find_stats(handle);
+  if (!stats)
+    return;
+  struct kvs3105_stats_values *v = &stats->values;
+
+  if (stats->page_ended)
+    v->page_bytes = 0;
+  stats->page_ended = end_of_page;
+  v->bytes += length;
+  v->page_bytes += length;
+  if (end_of_page)
+    v->pages++;
+
+  const uint64_t now = now_ns();
+  stats->window_bytes += length;
+  if (!stats->window_start_ns) {
+    stats->window_start_ns = now;
+    stats->window_bytes = 0;
+  } else if (now - stats->window_start_ns >= RATE_WINDOW_NS) {
+    v->rate = stats->window_bytes * 1000000000ull /
+        (now - stats->window_start_ns);
+    stats->window_start_ns = now;
+    stats->window_bytes = 0;
+  }
+  publish(stats);
+}
+
+void kvs3105_stats_note_wait(usb_handle handle, uint64_t wait_us,
+                             uint32_t buffered) {
+  struct kvs3105_stats *stats = find_stats(handle);
+  if (!stats)
+    return;
+  stats->values.wait_us += wait_us;
+  stats->values.buffer_bytes = buffered;
+  // Time spent waiting for the next image shouldn't count towards the rate
+  stats->window_start_ns = 0;
+  publish(stats);
+}
+
+void kvs3105_stats_note_buffer(usb_handle handle, uint32_t buffered) {
+  struct kvs3105_stats *stats = find_stats(handle);
+  if (!stats)
+    return;
+  stats->values.buffer_bytes = buffered;
+  publish(stats);
+}
+
+void kvs3105_stats_note_sense(usb_handle handle,
+                              const uint8_t *requestsense) {
+  struct kvs3105_stats *stats = find_stats(handle);
+  if (!stats)
+    return;
+  stats->values.last_sense = (requestsense[2] & 0x0f) << 16 |
+      scsi_usb_error_code(requestsense);
+  publish(stats);
+}
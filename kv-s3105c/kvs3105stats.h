@@ -0,0 +1,93 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Live statistics for a scanner, published in shared memory.
+//
+// kvs3105_stats_create maps a segment under /dev/shm and registers it against
+// an open scanner. From then on the library's own hot path (READ, GET DATA
+// BUFFER STATUS and REQUEST SENSE handling) keeps the counters up to date, so
+// callers don't need to do anything else.
+//
+// The segment is protected by a sequence lock: the writer bumps a counter to
+// an odd value, updates the fields and bumps it again. Readers copy the fields
+// and retry if the counter was odd or changed underneath them. Readers never
+// block the writer and never make a syscall into the scanning process, so a
+// dashboard can poll at any rate it likes.
+
+#ifndef THIRD_PARTY_KVS3105USB_KVS3105STATS_H_
+#define THIRD_PARTY_KVS3105USB_KVS3105STATS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "kvs3105usb.h"
+
+// A consistent snapshot of the counters.
+struct kvs3105_stats_values {
+  uint64_t page;           // job page number of the current side
+  uint64_t side;           // 0 -> front, 1 -> back
+  uint64_t pages;          // sides read to the end since the segment was made
+  uint64_t bytes;          // image bytes read in total
+  uint64_t page_bytes;     // image bytes read of the current side
+  uint64_t rate;           // recent read rate, in bytes per second
+  uint64_t wait_us;        // time spent in kvs3105_data_buffer_wait
+  uint64_t last_sense;     // sense key << 16 | ASC << 8 | ASCQ of last error
+  uint64_t buffer_bytes;   // last GET DATA BUFFER STATUS result
+  uint64_t updated_ns;     // CLOCK_MONOTONIC time of the last update
+};
+
+struct kvs3105_stats;
+
+// -----------------------------------------------------------------------------
+// Create (or replace) the segment /dev/shm/kvs3105-<name> and start publishing
+// statistics for the given scanner into it. Returns NULL on error.
+// -----------------------------------------------------------------------------
+struct kvs3105_stats *kvs3105_stats_create(usb_handle, const char *name);
+
+// -----------------------------------------------------------------------------
+// Map an existing segment read-only, for use by a monitoring process. Returns
+// NULL on error.
+// -----------------------------------------------------------------------------
+struct kvs3105_stats *kvs3105_stats_attach(const char *name);
+
+// -----------------------------------------------------------------------------
+// Copy a consistent snapshot of the counters into values.
+// -----------------------------------------------------------------------------
+void kvs3105_stats_read(const struct kvs3105_stats *stats,
+                        struct kvs3105_stats_values *values);
+
+// -----------------------------------------------------------------------------
+// Stop publishing and unmap the segment. The segment itself is left in
+// /dev/shm so that the last values remain readable.
+// -----------------------------------------------------------------------------
+void kvs3105_stats_close(struct kvs3105_stats *stats);
+
+// These are called by the library to update the counters for a scanner. They
+// do nothing if no segment is registered for the handle. note_page is called
+// by kvs3105_scan_stream as each side starts, with the page number of the
+// job rather than the SCSI page index inside the current SCAN block.
+void kvs3105_stats_note_page(usb_handle, uint64_t page, uint8_t side);
+void kvs3105_stats_note_read(usb_handle, unsigned length, char end_of_page);
+void kvs3105_stats_note_wait(usb_handle, uint64_t wait_us, uint32_t buffered);
+void kvs3105_stats_note_buffer(usb_handle, uint32_t buffered);
+void kvs3105_stats_note_sense(usb_handle, const uint8_t *requestsense);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_KVS3105STATS_H_
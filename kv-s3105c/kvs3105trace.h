@@ -0,0 +1,68 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Static (USDT) tracepoints.
+//
+// When <sys/sdt.h> (systemtap-sdt-dev) is available at build time, these
+// macros compile to a single nop plus an ELF note, so they cost nothing until
+// a tracer attaches. Without it they compile to nothing at all.
+//
+// Probes in the "kvs3105" provider (library):
+//   command__start(opcode, data_length, direction)
+//   command__done(opcode, result, asc_ascq)
+//   usb__command(opcode, libusb_result)
+//   usb__data__in(opcode, requested, transferred, libusb_result)
+//   usb__data__out(opcode, length, libusb_result)
+//   usb__status(opcode, scsi_status, libusb_result)
+//   buffer__wait(iteration, buffered_bytes, result)
+//   read__data(page, back, requested, returned, end_of_page, result)
+//
+// Probes in the "kvscanner" provider:
+//   page__start(page, side, width, height)
+//   page__end(page, side, bytes)
+//
+// For example, to see READ latency while a scan is running:
+//   bpftrace -e 'usdt:./kvscanner:kvs3105:command__start /arg0 == 0x28/
+//                  { @s[tid] = nsecs; }
+//                usdt:./kvscanner:kvs3105:command__done /@s[tid]/
+//                  { @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+
+#ifndef THIRD_PARTY_KVS3105USB_KVS3105TRACE_H_
+#define THIRD_PARTY_KVS3105USB_KVS3105TRACE_H_
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define KVS3105_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef KVS3105_HAVE_SDT
+#define KVS3105_TRACE2(p, n, a, b) DTRACE_PROBE2(p, n, a, b)
+#define KVS3105_TRACE3(p, n, a, b, c) DTRACE_PROBE3(p, n, a, b, c)
+#define KVS3105_TRACE4(p, n, a, b, c, d) DTRACE_PROBE4(p, n, a, b, c, d)
+#define KVS3105_TRACE6(p, n, a, b, c, d, e, f) \
+  DTRACE_PROBE6(p, n, a, b, c, d, e, f)
+#else
+// sizeof() keeps the arguments "used" without evaluating them.
+#define KVS3105_TRACE2(p, n, a, b) do { (void) sizeof((a) + (b)); } while (0)
+#define KVS3105_TRACE3(p, n, a, b, c) \
+  do { (void) sizeof((a) + (b) + (c)); } while (0)
+#define KVS3105_TRACE4(p, n, a, b, c, d) \
+  do { (void) sizeof((a) + (b) + (c) + (d)); } while (0)
+#define KVS3105_TRACE6(p, n, a, b, c, d, e, f) \
+  do { (void) sizeof((a) + (b) + (c) + (d) + (e) + (f)); } while (0)
+#endif
+
+#endif  // THIRD_PARTY_KVS3105USB_KVS3105TRACE_H_
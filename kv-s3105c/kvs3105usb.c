@@ -29,6 +29,7 @@
 
 #include <scsi/sg.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -38,6 +39,8 @@
 #endif
 
 #include "kvs3105usb.h"
+#include "kvs3105trace.h"
+#include "kvs3105stats.h"
 
 static const unsigned int kMaxBuffer = 0x10000;
 
@@ -144,6 +147,7 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
   // Transfer the command itself to the USB device.
   int ret1 = libusb_bulk_transfer(usbhandle, CMD_OUT, (unsigned char *)h,
                                   sz, &transferred, timeout);
+  KVS3105_TRACE2(kvs3105, usb__command, c->cmd[0], ret1);
   if (ret1) {
     fprintf(stderr, "  failed to send command, "
             "libusb_bulk_transfer returned %d\n", ret1);
@@ -156,6 +160,8 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
 
     ret1 = libusb_bulk_transfer(usbhandle, CMD_IN, (unsigned char *)h, sz,
                                 &transferred, timeout);
+    KVS3105_TRACE4(kvs3105, usb__data__in, c->cmd[0], c->data_size,
+                   transferred, ret1);
     c->data = h + 1;
 
     if (ret1 || transferred < sizeof(*h)) {
@@ -181,6 +187,7 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
     memcpy(h + 1, c->data, c->data_size);
     ret1 = libusb_bulk_transfer(usbhandle, CMD_OUT, (unsigned char *)h,
                                 sz, &transferred, timeout);
+    KVS3105_TRACE3(kvs3105, usb__data__out, c->cmd[0], c->data_size, ret1);
     if (ret1) {
       fprintf(stderr, "  failed to transfer data OUT, libusb error: %d %s\n",
               ret1, kvs3105_libusb_error_string(ret1));
@@ -193,12 +200,14 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
   ret1 = libusb_bulk_transfer(usbhandle, CMD_IN, (unsigned char *)resp,
                               sz, &transferred, timeout);
   if (ret1) {
+    KVS3105_TRACE3(kvs3105, usb__status, c->cmd[0], CHECK_CONDITION, ret1);
     fprintf(stderr, "Error getting SCSI status packet. code %d: %s\n", ret1,
             kvs3105_libusb_error_string(ret1));
     r->status = CHECK_CONDITION;
     return -1;
   }
   r->status = ntohl(*((uint32_t *) (resp + sizeof(*h))));
+  KVS3105_TRACE3(kvs3105, usb__status, c->cmd[0], r->status, ret1);
   return 0;
 }
 
@@ -210,6 +219,9 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
 //   command_length: length, in bytes, of command
 //   data: payload data. If NULL, the mmap buffer is used
 //   data_length: length of the payload data
+//   transfer: buffer for the USB transfer, with room for a bulk header
+//     followed by data_length bytes, or NULL to use the stack. When data
+//     points just past the header in transfer, incoming data isn't copied.
 //   requestsense: (output) resulting error buffer
 //   timeout: timeout in milliseconds. Must be > 0
 //
@@ -219,12 +231,14 @@ static int usb_send_command(usb_handle usbhandle, struct cmd *c,
 //   2 in the case of a SCSI error
 //   3 if the data transfer failed
 // -----------------------------------------------------------------------------
-static int send_command(usb_handle usbhandle, int direction,
-                        const void *command, unsigned command_length,
-                        void *data, unsigned data_length,
-                        void *requestsense, int timeout) {
+static int do_send_command(usb_handle usbhandle, int direction,
+                           const void *command, unsigned command_length,
+                           void *data, unsigned data_length,
+                           uint8_t *transfer, void *requestsense,
+                           int timeout) {
   int st;
-  uint8_t *bb = alloca(sizeof(struct bulk_header) +
+  uint8_t *bb = transfer ? transfer :
+                alloca(sizeof(struct bulk_header) +
                        (data_length > MAX_CMD_SIZE?
                         data_length:MAX_CMD_SIZE));
   struct response r = {};
@@ -252,7 +266,7 @@ static int send_command(usb_handle usbhandle, int direction,
     fprintf(stderr, "usb_send_command returned %d\n", st);
     return 1;
   }
-  if (c.dir == CMD_IN)
+  if (c.dir == CMD_IN && c.data != data)
     memcpy(data, c.data, c.data_size);
 
   if (r.status) {
@@ -290,6 +304,33 @@ static int send_command(usb_handle usbhandle, int direction,
   return 0;
 }
 
+static int send_command_into(usb_handle usbhandle, int direction,
+                             const void *command, unsigned command_length,
+                             void *data, unsigned data_length,
+                             uint8_t *transfer, void *requestsense,
+                             int timeout) {
+  const uint8_t opcode = *(const uint8_t *) command;
+  KVS3105_TRACE3(kvs3105, command__start, opcode, data_length, direction);
+  const int r = do_send_command(usbhandle, direction, command, command_length,
+                                data, data_length, transfer, requestsense,
+                                timeout);
+  KVS3105_TRACE3(kvs3105, command__done, opcode, r,
+                 r == 2 ? scsi_usb_error_code(requestsense) : 0);
+  // A short READ reports "no sense" with the ILI bit set, which isn't worth
+  // publishing as an error.
+  if (r == 2 && (((uint8_t *) requestsense)[2] & 0x0f))
+    kvs3105_stats_note_sense(usbhandle, requestsense);
+  return r;
+}
+
+static int send_command(usb_handle usbhandle, int direction,
+                        const void *command, unsigned command_length,
+                        void *data, unsigned data_length,
+                        void *requestsense, int timeout) {
+  return send_command_into(usbhandle, direction, command, command_length,
+                           data, data_length, NULL, requestsense, timeout);
+}
+
 // -----------------------------------------------------------------------------
 // KVS3105 specific function. See the header file for comments...
 
@@ -460,6 +501,16 @@ static int get_data_buffer_status(usb_handle usbhandle, uint8_t *window_id,
   return 0;
 }
 
+int kvs3105_data_buffer_status(usb_handle usbhandle, uint32_t *length,
+                               uint8_t *requestsense) {
+  uint8_t window_id;
+  const int r = get_data_buffer_status(usbhandle, &window_id, length,
+                                       requestsense);
+  if (!r)
+    kvs3105_stats_note_buffer(usbhandle, *length);
+  return r;
+}
+
 int kvs3105_unit_not_ready(usb_handle usbhandle) {
   uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
   static const uint8_t command[] = { 0, 0, 0, 0, 0, 0 };
@@ -468,15 +519,22 @@ int kvs3105_unit_not_ready(usb_handle usbhandle) {
   return retval;
 }
 
-int kvs3105_read(usb_handle usbhandle, uint8_t type, uint8_t q1, uint8_t q2,
-                 uint8_t *buffer, uint32_t length, uint8_t *requestsense) {
+static int read_into(usb_handle usbhandle, uint8_t type, uint8_t q1,
+                     uint8_t q2, uint8_t *buffer, uint8_t *transfer,
+                     uint32_t length, uint8_t *requestsense) {
   // see page 50
   const uint8_t command[] = { 0x28, 0, type, 0, q1, q2,
                               length >> 16, length >> 8, length, 0 };
 
-  return send_command(usbhandle, SG_DXFER_FROM_DEV, command,
-                                  sizeof(command), buffer, length,
-                                  requestsense, 0);
+  return send_command_into(usbhandle, SG_DXFER_FROM_DEV, command,
+                           sizeof(command), buffer, length, transfer,
+                           requestsense, 0);
+}
+
+int kvs3105_read(usb_handle usbhandle, uint8_t type, uint8_t q1, uint8_t q2,
+                 uint8_t *buffer, uint32_t length, uint8_t *requestsense) {
+  return read_into(usbhandle, type, q1, q2, buffer, NULL, length,
+                   requestsense);
 }
 
 const unsigned int KVS3105_READ_IMAGE = 0;
@@ -515,28 +573,45 @@ int kvs3105_picture_size(usb_handle usbhandle, uint8_t page, uint8_t back,
 // -----------------------------------------------------------------------------
 // Poll the scanner until it has data to send us
 // -----------------------------------------------------------------------------
-int kvs3105_data_buffer_wait(usb_handle usbhandle, uint8_t *requestsense) {
-  uint32_t length;
+// Wait for image data, returning the amount buffered in length
+static int wait_for_data(usb_handle usbhandle, uint32_t *buffered,
+                         uint8_t *requestsense) {
+  uint32_t length = 0;
   uint8_t window_id;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  for (;;) {
+  for (unsigned iteration = 0;; iteration++) {
     int return_code = get_data_buffer_status(usbhandle, &window_id,
                                              &length, requestsense);
+    KVS3105_TRACE3(kvs3105, buffer__wait, iteration, length, return_code);
     if (return_code)
       return return_code;
     if (length)
       break;
     usleep(50000);  // usleep is in microseconds
   }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  kvs3105_stats_note_wait(usbhandle,
+                          (end.tv_sec - start.tv_sec) * 1000000ull +
+                          (end.tv_nsec - start.tv_nsec) / 1000, length);
+  *buffered = length;
   return 0;
 }
 
-int kvs3105_read_data(usb_handle usbhandle, uint8_t page, uint8_t back,
-                      uint8_t *buffer, unsigned blen, unsigned *result,
-                      char *end_of_page, uint8_t *requestsense) {
+int kvs3105_data_buffer_wait(usb_handle usbhandle, uint8_t *requestsense) {
+  uint32_t length;
+  return wait_for_data(usbhandle, &length, requestsense);
+}
+
+// Read image data into buffer, which is inside transfer if that isn't NULL
+static int read_image(usb_handle usbhandle, uint8_t page, uint8_t back,
+                      uint8_t *buffer, uint8_t *transfer, unsigned blen,
+                      unsigned *result, char *end_of_page,
+                      uint8_t *requestsense) {
   const unsigned length = UNSAFE_MIN(kMaxBuffer, blen);
-  if (kvs3105_read(usbhandle, KVS3105_READ_IMAGE, page, back ? 0x80 : 0, buffer,
-                   length, requestsense)) {
+  if (read_into(usbhandle, KVS3105_READ_IMAGE, page, back ? 0x80 : 0, buffer,
+                transfer, length, requestsense)) {
     char current_error = (requestsense[0] == 0xf0) ? 1:0;
     char end_of_medium = (requestsense[2] >> 6) & 1;
     char incorrect_length_indicator = (requestsense[2] >> 5) & 1;
@@ -544,18 +619,203 @@ int kvs3105_read_data(usb_handle usbhandle, uint8_t page, uint8_t back,
       const uint32_t delta = ntohl( *((uint32_t *) &requestsense[3]));
       *result = length - delta;
       *end_of_page = end_of_medium;
+      KVS3105_TRACE6(kvs3105, read__data, page, back, length, *result,
+                     *end_of_page, 0);
+      kvs3105_stats_note_read(usbhandle, *result, *end_of_page);
       return 0;
     }
+    KVS3105_TRACE6(kvs3105, read__data, page, back, length, 0, 0, 1);
     fprintf(stderr, "Unexpected read error\n");
     scsi_usb_request_sense_dump(requestsense);
     return 1;
   }
   *result = length;
   *end_of_page = 0;
+  KVS3105_TRACE6(kvs3105, read__data, page, back, length, length, 0, 0);
+  kvs3105_stats_note_read(usbhandle, length, 0);
 
   return 0;
 }
 
+int kvs3105_read_data(usb_handle usbhandle, uint8_t page, uint8_t back,
+                      uint8_t *buffer, unsigned blen, unsigned *result,
+                      char *end_of_page, uint8_t *requestsense) {
+  return read_image(usbhandle, page, back, buffer, NULL, blen, result,
+                    end_of_page, requestsense);
+}
+
+// Transfer buffers for spans. Each is a page of slack followed by kMaxBuffer
+// bytes of data; the bulk header goes at the end of the slack so that the
+// data lands page aligned, directly where the USB transfer puts it. They're
+// allocated on first use and kept for the life of the process.
+#define SPAN_POOL_SIZE 4
+#define SPAN_DATA_OFFSET 4096
+
+static struct {
+  uint8_t *buffer;
+  int busy;
+} span_pool[SPAN_POOL_SIZE];
+
+int kvs3105_read_data_span(usb_handle usbhandle, uint8_t page, uint8_t back,
+                           struct kvs3105_span *span, char *end_of_page,
+                           uint8_t *requestsense) {
+  unsigned slot;
+  for (slot = 0; slot < SPAN_POOL_SIZE; slot++) {
+    if (!__atomic_exchange_n(&span_pool[slot].busy, 1, __ATOMIC_ACQUIRE))
+      break;
+  }
+  if (slot == SPAN_POOL_SIZE) {
+    fprintf(stderr, "All %d spans are in use\n", SPAN_POOL_SIZE);
+    return 1;
+  }
+  if (!span_pool[slot].buffer &&
+      posix_memalign((void **) &span_pool[slot].buffer, 4096,
+                     SPAN_DATA_OFFSET + kMaxBuffer)) {
+    span_pool[slot].buffer = NULL;
+    __atomic_store_n(&span_pool[slot].busy, 0, __ATOMIC_RELEASE);
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+
+  uint8_t *data = span_pool[slot].buffer + SPAN_DATA_OFFSET;
+  const int r = read_image(usbhandle, page, back, data,
+                           data - sizeof(struct bulk_header), kMaxBuffer,
+                           &span->length, end_of_page, requestsense);
+  if (r) {
+    __atomic_store_n(&span_pool[slot].busy, 0, __ATOMIC_RELEASE);
+    return r;
+  }
+  span->data = data;
+  span->slot = slot;
+  return 0;
+}
+
+void kvs3105_release_span(struct kvs3105_span *span) {
+  if (!span->data)
+    return;
+  __atomic_store_n(&span_pool[span->slot].busy, 0, __ATOMIC_RELEASE);
+  span->data = NULL;
+  span->length = 0;
+}
+
+// Report a failed step to the error callback. Returns 1 for
+// kvs3105_scan_stream to return.
+static int scan_failed(const struct kvs3105_scan_callbacks *cb,
+                       enum kvs3105_scan_step step, const char *what,
+                       int status, const uint8_t *requestsense,
+                       const struct kvs3105_page *page) {
+  if (cb->error) {
+    const struct kvs3105_scan_error error = {
+      .step = step,
+      .what = what,
+      .status = status,
+      .requestsense = requestsense,
+      .page = page,
+    };
+    cb->error(cb->arg, &error);
+  }
+  return 1;
+}
+
+// Read one side, which the scanner says is ready
+static int stream_side(usb_handle usbhandle,
+                       const struct kvs3105_scan_callbacks *cb,
+                       struct kvs3105_page *p, uint8_t scsi_page,
+                       uint8_t *requestsense) {
+  uint64_t done = 0;
+  unsigned written;
+  char end_of_page;
+  int status;
+
+  if (cb->page_start && cb->page_start(cb->arg, p))
+    return 2;
+  kvs3105_stats_note_page(usbhandle, p->page, p->side);
+  do {
+    struct kvs3105_span span = { NULL, 0, 0 };
+    uint8_t *buffer;
+    if (cb->get_buffer) {
+      if (!(buffer = cb->get_buffer(cb->arg)))
+        return 2;
+      status = kvs3105_read_data(usbhandle, scsi_page, p->side, buffer,
+                                 KVS3105_BUFFER_SIZE, &written, &end_of_page,
+                                 requestsense);
+    } else {
+      // Hand over the USB transfer buffer itself
+      status = kvs3105_read_data_span(usbhandle, scsi_page, p->side, &span,
+                                      &end_of_page, requestsense);
+      buffer = (uint8_t *) span.data;
+      written = span.length;
+    }
+    if (status) {
+      return scan_failed(cb, KVS3105_STEP_READ, "Error reading image",
+                         status, requestsense, p);
+    }
+    const int stop = cb->chunk(cb->arg, p, buffer, written);
+    kvs3105_release_span(&span);
+    if (stop)
+      return 2;
+    done += written;
+  } while (!end_of_page);
+  if (cb->page_end && cb->page_end(cb->arg, p, done))
+    return 2;
+  return 0;
+}
+
+int kvs3105_scan_stream(usb_handle usbhandle,
+                        const struct kvs3105_scan_job *job,
+                        const struct kvs3105_scan_callbacks *cb) {
+  uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
+  int status, r = 0;
+
+  for (unsigned block = 0; block < job->num_pages && !r;
+       block += job->block_size) {
+    if ((status = kvs3105_reset_windows(usbhandle, requestsense))) {
+      r = scan_failed(cb, KVS3105_STEP_RESET_WINDOWS,
+                      "Error resetting windows", status, requestsense, NULL);
+      break;
+    }
+    if ((status = kvs3105_set_windows(usbhandle, job->window, job->duplex,
+                                      requestsense))) {
+      r = scan_failed(cb, KVS3105_STEP_SET_WINDOWS, "Error setting windows",
+                      status, requestsense, NULL);
+      break;
+    }
+    if ((status = kvs3105_scan(usbhandle, requestsense))) {
+      r = scan_failed(cb, KVS3105_STEP_SCAN, "Error starting scanning",
+                      status, requestsense, NULL);
+      break;
+    }
+
+    for (unsigned i = 0; i < job->block_size * (job->duplex ? 2 : 1); i++) {
+      const unsigned page = i / (job->duplex ? 2 : 1);
+      // The scanner numbers pages within a SCAN with a single byte, which
+      // wraps in continuous mode
+      const uint8_t scsi_page = page & 0xff;
+      struct kvs3105_page p = {
+        .page = job->first_page + block + page,
+        .side = job->duplex ? i & 1 : 0,
+      };
+
+      if ((status = kvs3105_picture_size(usbhandle, scsi_page, p.side,
+                                         &p.width, &p.height,
+                                         requestsense))) {
+        r = scan_failed(cb, KVS3105_STEP_PICTURE_SIZE,
+                        "Error getting page size", status, requestsense, &p);
+        break;
+      }
+      if ((status = wait_for_data(usbhandle, &p.buffered, requestsense))) {
+        r = scan_failed(cb, KVS3105_STEP_WAIT, "Error waiting for image data",
+                        status, requestsense, &p);
+        break;
+      }
+      if ((r = stream_side(usbhandle, cb, &p, scsi_page, requestsense)))
+        break;
+    }
+  }
+
+  return r;
+}
+
 int kvs3105_detect(usb_handle usbhandle) {
   // see page 28
   uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
@@ -573,6 +833,48 @@ int kvs3105_detect(usb_handle usbhandle) {
   return memcmp(inquirydata + 16, "KV-", 3);
 }
 
+// Copy a space-padded INQUIRY field into a string of length + 1 bytes
+static void inquiry_string(char *out, const uint8_t *field, unsigned length) {
+  // serial numbers may be right aligned
+  while (length && *field == ' ') {
+    field++;
+    length--;
+  }
+  memcpy(out, field, length);
+  out[length] = 0;
+  while (length && (out[length - 1] == ' ' || !out[length - 1]))
+    out[--length] = 0;
+}
+
+int kvs3105_identify(usb_handle usbhandle, struct kvs3105_identity *identity,
+                     uint8_t *requestsense) {
+  uint8_t inquirydata[96];
+  static const uint8_t command[] = {0x12, 0, 0, 0, 0x60, 0};
+  // EVPD set, unit serial number page
+  static const uint8_t serial_command[] = {0x12, 1, 0x80, 0, 0x24, 0};
+
+  memset(identity, 0, sizeof(*identity));
+  memset(inquirydata, 0, sizeof(inquirydata));
+  int r = send_command(usbhandle, SG_DXFER_FROM_DEV, command, sizeof(command),
+                       inquirydata, sizeof(inquirydata), requestsense, 0);
+  if (r)
+    return r;
+  inquiry_string(identity->vendor, inquirydata + 8, 8);
+  inquiry_string(identity->product, inquirydata + 16, 16);
+  inquiry_string(identity->revision, inquirydata + 32, 4);
+
+  // Older firmware rejects EVPD, which just leaves the serial empty
+  memset(inquirydata, 0, sizeof(inquirydata));
+  r = send_command(usbhandle, SG_DXFER_FROM_DEV, serial_command,
+                   sizeof(serial_command), inquirydata, 0x24, requestsense, 0);
+  if (!r && inquirydata[1] == 0x80) {
+    const unsigned length = UNSAFE_MIN(inquirydata[3],
+                                       sizeof(identity->serial) - 1);
+    inquiry_string(identity->serial, inquirydata + 4, length);
+  }
+  return 0;
+}
+
 int kvs3105_stop(usb_handle usbhandle, uint8_t *requestsense) {
   // see page 89
   static const uint8_t command[] = {0xe1, 0, 0x8b, 0, 0, 0, 0, 0, 0, 0};
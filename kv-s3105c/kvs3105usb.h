@@ -148,6 +148,24 @@ void kvs3105_close(usb_handle h);
 // -----------------------------------------------------------------------------
 int kvs3105_detect(usb_handle);
 
+// Who made a scanner, from INQUIRY. Each string is NUL terminated, with
+// leading and trailing spaces removed.
+struct kvs3105_identity {
+  char vendor[9];
+  char product[17];
+  char revision[5];
+  // empty if the scanner doesn't have the unit serial number page
+  char serial[33];
+};
+
+// -----------------------------------------------------------------------------
+// Get the vendor, product and firmware revision of a scanner, and its serial
+// number from the unit serial number VPD page (0x80).
+//   identity: (output, non-NULL)
+// -----------------------------------------------------------------------------
+int kvs3105_identify(usb_handle, struct kvs3105_identity *identity,
+                     uint8_t *requestsense);
+
 // -----------------------------------------------------------------------------
 // Start scanning
 //   fd: open scanner device
@@ -188,6 +206,38 @@ int kvs3105_read_data(usb_handle handler, uint8_t page, uint8_t back,
                         unsigned length, unsigned *result, char *end_of_page,
                         uint8_t *requestsense);
 
+// A view of image data in a buffer owned by the library
+struct kvs3105_span {
+  const uint8_t *data;
+  unsigned length;
+  // private
+  unsigned slot;
+};
+
+// -----------------------------------------------------------------------------
+// Read a scanned image like kvs3105_read_data, but without copying: the span
+// points into the buffer the USB transfer wrote to. The data is page aligned,
+// up to KVS3105_BUFFER_SIZE bytes long, and stays valid until the span is
+// passed to kvs3105_release_span, which may be done from any thread. The
+// library has a small pool of these buffers, so release spans promptly; a
+// read fails if every one is in use.
+//   handler: open scanner device
+//   page: page number
+//   back: if non-zero, get the back of the page (for duplex mode)
+//   span: (output, non-NULL) the data read
+//   end_of_page: (output, non-NULL) if non-zero, the last byte of image data
+//                is in the span
+// -----------------------------------------------------------------------------
+int kvs3105_read_data_span(usb_handle handler, uint8_t page, uint8_t back,
+                           struct kvs3105_span *span, char *end_of_page,
+                           uint8_t *requestsense);
+
+// -----------------------------------------------------------------------------
+// Return a span's buffer to the library. Releasing a span which holds no data
+// does nothing.
+// -----------------------------------------------------------------------------
+void kvs3105_release_span(struct kvs3105_span *span);
+
 // -----------------------------------------------------------------------------
 // Return a human readable (English) string describing the error, or NULL if
 // the error is unknown.
@@ -201,6 +251,17 @@ kvs3105_strerror(uint8_t *requestsense);
 // -----------------------------------------------------------------------------
 int kvs3105_data_buffer_wait(usb_handle, uint8_t *requestsense);
 
+// -----------------------------------------------------------------------------
+// Get the number of bytes of image data waiting in the scanner's memory. This
+// is the same GET DATA BUFFER STATUS query that kvs3105_data_buffer_wait
+// polls, so it's cheap enough to call between reads. A rising value means
+// that the host isn't reading fast enough and the ADF will soon throttle.
+//   handler: an open scanner
+//   length: (output, non-NULL) bytes buffered in the scanner
+// -----------------------------------------------------------------------------
+int kvs3105_data_buffer_status(usb_handle, uint32_t *length,
+                               uint8_t *requestsense);
+
 // -----------------------------------------------------------------------------
 // This structure describes the scanning setup. This includes both the standard
 // SCSI fields and the device-specific ones. The comments are taken from the
@@ -397,6 +458,90 @@ int kvs3105_set_windows(usb_handle, const struct kvs3105_window *window,
 // -----------------------------------------------------------------------------
 int kvs3105_reset_windows(usb_handle, uint8_t *);
 
+// -----------------------------------------------------------------------------
+// Streaming scans
+//
+// kvs3105_scan_stream runs the whole sequence of calls described at the top
+// of this file for a job and hands the image data to callbacks as it arrives.
+// Unless the caller supplies buffers with get_buffer, each chunk is read with
+// kvs3105_read_data_span straight into one of the library's pool of transfer
+// buffers, and passed to the chunk callback without being copied. The span is
+// released when the callback returns.
+// -----------------------------------------------------------------------------
+
+// One side of one page
+struct kvs3105_page {
+  // page number, counting from the job's first_page
+  unsigned page;
+  // 0 -> front, 1 -> back
+  uint8_t side;
+  // dimensions in pixels
+  uint32_t width, height;
+  // bytes of image data waiting in the scanner when the side became ready
+  uint32_t buffered;
+};
+
+// The steps of a scan, for error reporting
+enum kvs3105_scan_step {
+  KVS3105_STEP_RESET_WINDOWS,
+  KVS3105_STEP_SET_WINDOWS,
+  KVS3105_STEP_SCAN,
+  KVS3105_STEP_PICTURE_SIZE,
+  KVS3105_STEP_WAIT,
+  KVS3105_STEP_READ,
+};
+
+struct kvs3105_scan_error {
+  enum kvs3105_scan_step step;
+  // a description of the step, e.g. "Error reading image"
+  const char *what;
+  // what the failing call returned
+  int status;
+  const uint8_t *requestsense;
+  // the side being scanned, or NULL if the failure came before any
+  const struct kvs3105_page *page;
+};
+
+struct kvs3105_scan_job {
+  const struct kvs3105_window *window;
+  char duplex;
+  // the number given to the first page
+  unsigned first_page;
+  // the number of pages to scan, in blocks of block_size pages per SCAN
+  // command. window->number_of_pages_to_scan should match block_size.
+  unsigned num_pages;
+  unsigned block_size;
+};
+
+// Each of the callbacks which returns int stops the scan if it returns
+// non-zero. Only chunk is required.
+struct kvs3105_scan_callbacks {
+  // A side is ready to be read
+  int (*page_start)(void *arg, const struct kvs3105_page *page);
+  // Return a buffer of KVS3105_BUFFER_SIZE bytes to read the next chunk into,
+  // or NULL to stop. Without this chunks are read with
+  // kvs3105_read_data_span, and passed on without being copied.
+  uint8_t *(*get_buffer)(void *arg);
+  // The next length bytes of the side. data is only valid during the call
+  // unless it came from get_buffer.
+  int (*chunk)(void *arg, const struct kvs3105_page *page,
+               const uint8_t *data, unsigned length);
+  // The last chunk of the side has been delivered
+  int (*page_end)(void *arg, const struct kvs3105_page *page,
+                  uint64_t length);
+  // The scanner reported an error, and the scan is over
+  void (*error)(void *arg, const struct kvs3105_scan_error *error);
+  void *arg;
+};
+
+// -----------------------------------------------------------------------------
+// Scan the pages of a job, front before back, calling the callbacks for each
+// side. Returns 0 on success, 1 if the scanner failed (after calling error),
+// or 2 if a callback stopped the scan.
+// -----------------------------------------------------------------------------
+int kvs3105_scan_stream(usb_handle, const struct kvs3105_scan_job *job,
+                        const struct kvs3105_scan_callbacks *callbacks);
+
 // -----------------------------------------------------------------------------
 // See if the unit is ready for commands.
 // -----------------------------------------------------------------------------
@@ -30,6 +30,11 @@
 #include <stdint.h>
 
 #include "kvs3105usb.h"
+#include "bufmon.h"
+#include "sink.h"
+#include "bitops.h"
+#include "kvs3105stats.h"
+#include "kvs3105trace.h"
 
 int usage(const char *argv0) {
   fprintf(stderr,
@@ -43,11 +48,73 @@ int usage(const char *argv0) {
           "  -h <height in inches>\n"
           "  -c <compression type> (0x81 is jpeg)\n"
           "  -s (output to stdout)\n"
+          "  -o <format>: jpeg (one file per side, default), tiff, pdf,\n"
+          "     archive, framed (length-prefixed pages, see kvframe.h) or\n"
+          "     async (jpeg files written in the background with io_uring)\n"
+          "     or serve (pass pages to clients of the socket <filebase>,\n"
+          "     see kvserve.h) or ring (stream chunks into the shared\n"
+          "     memory ring kvs3105-ring-<filebase>, see kvring.h) or zstd\n"
+          "     (uncompressed scans compressed a side per frame, see\n"
+          "     kvzstd.h)\n"
+          "  --subscribers <n>: with -o serve, wait for n clients first\n"
+          "  --ring-overwrite: with -o ring, overwrite rather than wait for\n"
+          "     slow consumers\n"
+          "  --zstd-level <n>: with -o zstd, the compression level (default 3)\n"
+          "  --zstd-threads <n>: with -o zstd, worker threads (default one per\n"
+          "     CPU, 0 for none)\n"
+          "  --validate: check the structure of every JPEG side as it's read\n"
+          "     and report bad ones (the exit status is then 2)\n"
+          "  --metadata: write JFIF and EXIF into JPEG sides with the\n"
+          "     resolution, scan time, page and scanner serial number\n"
+          "  --manifest <file>: list the length, CRC-32C and BLAKE3 of every\n"
+          "     side as written\n"
+          "  --encrypt-key <file>: encrypt every side with AES-256-GCM using\n"
+          "     this key (32 bytes or 64 hex digits). Not for tiff, pdf or\n"
+          "     zstd output, which need image data\n"
+          "  --encrypt-index <file>: where to list each side's nonce and tag\n"
+          "  --blank <drop|flag>: look for blank sides, and drop or just\n"
+          "     report them\n"
+          "  --blank-ink <percent>: less ink than this is blank (default 0.5)\n"
+          "  --blank-level <0-255>: pixels darker than this are ink (default\n"
+          "     128)\n"
+          "  --blank-size <bytes>: compressed sides bigger than this per\n"
+          "     megapixel aren't blank (default 100000 JPEG, 1500 MH/MR/MMR)\n"
+          "  --blank-report <file>: write a CSV line about every side\n"
+          "  --duplicates <file>: hash every side perceptually, report sides\n"
+          "     which look like a recent one and list the hashes in file\n"
+          "  --duplicate-window <sides>: how far back to look (default 8)\n"
+          "  --duplicate-distance <bits>: hashes this close match (default 8)\n"
+          "  --duplicate-threads <n>: hashing threads (default one per CPU)\n"
+          "  --host-mmr: with -m binary -c 3, scan uncompressed and do the\n"
+          "     G4 (MMR) encoding on the host, several pages at once\n"
+          "  --host-jpeg: with -m gray or colour and JPEG compression, scan\n"
+          "     uncompressed and do the JPEG encoding on the host, in strips\n"
+          "     on several threads\n"
+          "  --host-threads <n>: threads for host encoding (default one per\n"
+          "     CPU)\n"
+          "  --invert: swap black and white in binary scans\n"
+          "  --mirror: mirror scans left to right\n"
+          "  --msb-first: pack uncompressed binary scans MSB first\n"
+          "  --host-layout: with -m binary -c 0, do the above on the host and\n"
+          "     leave the scanner in its fastest mode\n"
+          "  -m <mode>: binary, gray or colour (default)\n"
           "  -r <resolution> (e.g. 300)\n"
           "  -f scan from flatbed\n"
           "  -i or --interactive: interactive mode\n"
           "  --list: show USB devices\n"
-          "  --duplex: scan front and back\n",
+          "  --duplex: scan front and back\n"
+          "  --buffer-log <file>: record scanner buffer occupancy as CSV\n"
+          "  --buffer-alarm <bytes>: warn when the scanner buffer exceeds this\n"
+          "  --buffer-interval <ms>: buffer sampling interval (default 100)\n"
+          "  --zero-copy: pass image data to the output with vmsplice/splice\n"
+          "  --preallocate: size jpeg files up front, write each side at once\n"
+          "  --io-stats: print write calls and file extents per side\n"
+          "  --atomic: only name jpeg files once they're complete and synced\n"
+          "  --commit-pages <n>: sync every n sides (default 8)\n"
+          "  --commit-interval <ms>: or after this long (default 1000)\n"
+          "  --stats <name>: publish live statistics in /dev/shm/kvs3105-<name>\n"
+          "  --watch-stats <name>: print the statistics published by another "
+          "kvscanner\n",
           argv0);
   return 1;
 }
@@ -62,11 +129,174 @@ void report(const char *comment, uint8_t *requestsense) {
   }
 }
 
+// The output formats. The sink is given a path made from the filebase and the
+// extension, the filebase itself if there's no extension, or NULL to write to
+// stdout.
+struct output_format {
+  const char *name;
+  const char *extension;
+  int can_stream;
+  struct page_sink *(*make)(const char *path);
+} formats[] = {
+  // The default comes first
+  {"jpeg", NULL, 1, file_sink_new},
+  {"tiff", "tif", 0, tiff_sink_new},
+  {"pdf", "pdf", 1, pdf_sink_new},
+  {"archive", "kvpak", 0, archive_sink_new},
+  {"framed", "kvframes", 1, frame_sink_new},
+  {"async", NULL, 0, uring_sink_new},
+  {"serve", NULL, 0, serve_sink_new},
+  {"ring", NULL, 0, ring_sink_new},
+  {"zstd", "zst", 1, zstd_sink_new},
+  {0},
+};
+
+// Long options that take an argument
+enum {
+  OPT_BUFFER_LOG = 256,
+  OPT_BUFFER_ALARM,
+  OPT_BUFFER_INTERVAL,
+  OPT_STATS,
+  OPT_WATCH_STATS,
+  OPT_COMMIT_PAGES,
+  OPT_COMMIT_INTERVAL,
+  OPT_SUBSCRIBERS,
+  OPT_MANIFEST,
+  OPT_ENCRYPT_KEY,
+  OPT_ENCRYPT_INDEX,
+  OPT_ZSTD_LEVEL,
+  OPT_ZSTD_THREADS,
+  OPT_BLANK,
+  OPT_BLANK_INK,
+  OPT_BLANK_LEVEL,
+  OPT_BLANK_SIZE,
+  OPT_BLANK_REPORT,
+  OPT_DUPLICATES,
+  OPT_DUPLICATE_WINDOW,
+  OPT_DUPLICATE_DISTANCE,
+  OPT_DUPLICATE_THREADS,
+  OPT_HOST_THREADS,
+};
+
+// Print the statistics published by another kvscanner once a second.
+int watch_stats(const char *name) {
+  struct kvs3105_stats *stats = kvs3105_stats_attach(name);
+  if (!stats)
+    return 2;
+  for (;;) {
+    struct kvs3105_stats_values v;
+    kvs3105_stats_read(stats, &v);
+    fprintf(stdout, "page %llu%c: %llu bytes, %.2f MB/s, %llu pages, "
+            "%llu MB total, waited %.1fs, buffer %llu, last sense %06llx\n",
+            (unsigned long long) v.page, v.side ? 'B' : 'A',
+            (unsigned long long) v.page_bytes, v.rate / 1e6,
+            (unsigned long long) v.pages,
+            (unsigned long long) (v.bytes >> 20), v.wait_us / 1e6,
+            (unsigned long long) v.buffer_bytes,
+            (unsigned long long) v.last_sense);
+    fflush(stdout);
+    sleep(1);
+  }
+}
+
 usb_handle reset_and_attach(const char *devicename) {
   kvs3105_reset(devicename);
   return kvs3105_open(devicename);
 }
 
+// Guess the length of a side: the scanner's buffer holds at least the start of
+// it and may hold later pages too, so this is capped at the uncompressed size.
+static uint32_t side_size_hint(const struct kvs3105_window *w,
+                               const struct kvs3105_page *p) {
+  const uint64_t raw = (uint64_t) (p->width * w->bpp + 7) / 8 * p->height;
+
+  if (!w->compression_type)
+    return raw;
+  if (!p->buffered)
+    return raw / 8;
+  return p->buffered < raw ? p->buffered : raw;
+}
+
+// Passes a streaming scan on to a sink
+struct scan_state {
+  usb_handle uh;
+  const struct kvs3105_window *window;
+  struct page_sink *sink;
+  struct bufmon *bufmon;
+};
+
+static int on_page_start(void *arg, const struct kvs3105_page *p) {
+  struct scan_state *state = arg;
+  const struct page_info info = {
+    .page = p->page,
+    .side = p->side,
+    .width = p->width,
+    .height = p->height,
+    .compression_type = state->window->compression_type,
+    .window = state->window,
+    .size_hint = side_size_hint(state->window, p),
+  };
+  KVS3105_TRACE4(kvscanner, page__start, p->page, p->side, p->width,
+                 p->height);
+  return state->sink->begin_page(state->sink, &info);
+}
+
+static uint8_t *on_get_buffer(void *arg) {
+  struct scan_state *state = arg;
+  return state->sink->get_buffer(state->sink);
+}
+
+static int on_chunk(void *arg, const struct kvs3105_page *p,
+                    const uint8_t *data, unsigned length) {
+  struct scan_state *state = arg;
+  if (state->sink->write(state->sink, data, length))
+    return 1;
+  if (state->bufmon)
+    bufmon_sample(state->bufmon, state->uh, p->page, p->side);
+  return 0;
+}
+
+static int on_page_end(void *arg, const struct kvs3105_page *p,
+                       uint64_t length) {
+  struct scan_state *state = arg;
+  KVS3105_TRACE3(kvscanner, page__end, p->page, p->side, length);
+  return state->sink->end_page(state->sink);
+}
+
+static void on_error(void *arg, const struct kvs3105_scan_error *error) {
+  report(error->what, (uint8_t *) error->requestsense);
+  // TODO(dgluss): 3 is a bad name for a condition.  Put in a name.
+  if (error->step == KVS3105_STEP_WAIT && error->page->side == 0 &&
+      error->status == 3)
+    fprintf(stderr, "end of book.\n");
+}
+
+// Scan num_pages pages, in blocks of block_size, into the sink. Returns 0 on
+// success or 2 on error.
+int scan_pages(usb_handle uh, const struct kvs3105_window *window, int duplex,
+               unsigned first_page_number, unsigned num_pages,
+               unsigned block_size, struct page_sink *sink,
+               struct bufmon *bufmon) {
+  struct scan_state state = { uh, window, sink, bufmon };
+  const struct kvs3105_scan_job job = {
+    .window = window,
+    .duplex = duplex,
+    .first_page = first_page_number,
+    .num_pages = num_pages,
+    .block_size = block_size,
+  };
+  const struct kvs3105_scan_callbacks callbacks = {
+    .page_start = on_page_start,
+    .get_buffer = sink->get_buffer ? on_get_buffer : NULL,
+    .chunk = on_chunk,
+    .page_end = on_page_end,
+    .error = on_error,
+    .arg = &state,
+  };
+
+  return kvs3105_scan_stream(uh, &job, &callbacks) ? 2 : 0;
+}
+
 int main(int argc, char **argv) {
   float width = 8.5, height = 11.0;
   unsigned num_pages = 1;
@@ -74,23 +304,91 @@ int main(int argc, char **argv) {
   int interactive_mode = 0;
   int duplex = 0;
   int list = 0;
+  int zero_copy = 0;
+  int atomic = 0;
+  int preallocate = 0;
+  int io_stats = 0;
+  unsigned subscribers = 0;
+  int ring_overwrite = 0;
+  int validate = 0;
+  int zstd_level = 0;
+  int zstd_threads = -1;
+  const char *blank = 0;
+  struct blank_options blank_options = { 0, 128, 0.005, 0, NULL };
+  int metadata = 0;
+  int invert = 0;
+  int mirror = 0;
+  int msb_first = 0;
+  int host_layout = 0;
+  int host_mmr = 0;
+  int host_jpeg = 0;
+  unsigned host_threads = 0;
+  struct phash_options phash_options = { NULL, 8, 8, 0 };
+  unsigned commit_pages = 8;
+  unsigned commit_interval = 1000;
   int quality = 90;
   int pixels_per_inch = 400;
   int flatbed = 0;
   int compression_type = 0x81;  // JPEG
   int output_to_stdout = 0;
+  const char *output_format = 0;
+  int composition = KVS3105_COMPOSITION_COLOUR;
 
   int first_page_number = 0;
   const char *device_name = 0;
+  const char *buffer_log = 0;
+  uint32_t buffer_alarm = 0;
+  unsigned buffer_interval = 100;
+  const char *stats_name = 0;
+  const char *watch_stats_name = 0;
+  const char *manifest = 0;
+  const char *encrypt_key = 0;
+  const char *encrypt_index = 0;
   struct option longopts[] = {
     { "duplex", 0, &duplex, 1 },
     { "list", 0, &list, 1 },
     { "interactive", 0, &interactive_mode, 1 },
+    { "zero-copy", 0, &zero_copy, 1 },
+    { "atomic", 0, &atomic, 1 },
+    { "preallocate", 0, &preallocate, 1 },
+    { "io-stats", 0, &io_stats, 1 },
+    { "commit-pages", 1, 0, OPT_COMMIT_PAGES },
+    { "commit-interval", 1, 0, OPT_COMMIT_INTERVAL },
+    { "subscribers", 1, 0, OPT_SUBSCRIBERS },
+    { "ring-overwrite", 0, &ring_overwrite, 1 },
+    { "validate", 0, &validate, 1 },
+    { "metadata", 0, &metadata, 1 },
+    { "invert", 0, &invert, 1 },
+    { "mirror", 0, &mirror, 1 },
+    { "msb-first", 0, &msb_first, 1 },
+    { "host-layout", 0, &host_layout, 1 },
+    { "host-mmr", 0, &host_mmr, 1 },
+    { "host-jpeg", 0, &host_jpeg, 1 },
+    { "host-threads", 1, 0, OPT_HOST_THREADS },
+    { "manifest", 1, 0, OPT_MANIFEST },
+    { "encrypt-key", 1, 0, OPT_ENCRYPT_KEY },
+    { "encrypt-index", 1, 0, OPT_ENCRYPT_INDEX },
+    { "zstd-level", 1, 0, OPT_ZSTD_LEVEL },
+    { "zstd-threads", 1, 0, OPT_ZSTD_THREADS },
+    { "blank", 1, 0, OPT_BLANK },
+    { "blank-ink", 1, 0, OPT_BLANK_INK },
+    { "blank-level", 1, 0, OPT_BLANK_LEVEL },
+    { "blank-size", 1, 0, OPT_BLANK_SIZE },
+    { "blank-report", 1, 0, OPT_BLANK_REPORT },
+    { "duplicates", 1, 0, OPT_DUPLICATES },
+    { "duplicate-window", 1, 0, OPT_DUPLICATE_WINDOW },
+    { "duplicate-distance", 1, 0, OPT_DUPLICATE_DISTANCE },
+    { "duplicate-threads", 1, 0, OPT_DUPLICATE_THREADS },
+    { "buffer-log", 1, 0, OPT_BUFFER_LOG },
+    { "buffer-alarm", 1, 0, OPT_BUFFER_ALARM },
+    { "buffer-interval", 1, 0, OPT_BUFFER_INTERVAL },
+    { "stats", 1, 0, OPT_STATS },
+    { "watch-stats", 1, 0, OPT_WATCH_STATS },
     { 0 } };
 
   int opt;
   while ((opt = getopt_long(argc, argv,
-                            "d:n:p:q:b:w:h:c:sr:if",
+                            "d:n:p:q:b:w:h:c:so:m:r:if",
                             longopts,
                             NULL)) != -1) {
     switch (opt) {
@@ -123,6 +421,21 @@ int main(int argc, char **argv) {
       case 's':
         output_to_stdout = 1;
         break;
+      case 'o':
+        output_format = optarg;
+        break;
+      case 'm':
+        if (!strcmp(optarg, "binary")) {
+          composition = KVS3105_COMPOSITION_BINARY;
+        } else if (!strcmp(optarg, "gray")) {
+          composition = KVS3105_COMPOSITION_GRAYSCALE;
+        } else if (!strcmp(optarg, "colour")) {
+          composition = KVS3105_COMPOSITION_COLOUR;
+        } else {
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
       case 'r':
         pixels_per_inch = atoi(optarg);
         break;
@@ -132,6 +445,75 @@ int main(int argc, char **argv) {
       case 'i':
         interactive_mode++;
         break;
+      case OPT_BUFFER_LOG:
+        buffer_log = optarg;
+        break;
+      case OPT_BUFFER_ALARM:
+        buffer_alarm = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_BUFFER_INTERVAL:
+        buffer_interval = atoi(optarg);
+        break;
+      case OPT_STATS:
+        stats_name = optarg;
+        break;
+      case OPT_WATCH_STATS:
+        watch_stats_name = optarg;
+        break;
+      case OPT_COMMIT_PAGES:
+        commit_pages = atoi(optarg);
+        break;
+      case OPT_COMMIT_INTERVAL:
+        commit_interval = atoi(optarg);
+        break;
+      case OPT_SUBSCRIBERS:
+        subscribers = atoi(optarg);
+        break;
+      case OPT_MANIFEST:
+        manifest = optarg;
+        break;
+      case OPT_ENCRYPT_KEY:
+        encrypt_key = optarg;
+        break;
+      case OPT_ENCRYPT_INDEX:
+        encrypt_index = optarg;
+        break;
+      case OPT_ZSTD_LEVEL:
+        zstd_level = atoi(optarg);
+        break;
+      case OPT_ZSTD_THREADS:
+        zstd_threads = atoi(optarg);
+        break;
+      case OPT_BLANK:
+        blank = optarg;
+        break;
+      case OPT_BLANK_INK:
+        blank_options.ink = strtod(optarg, NULL) / 100;
+        break;
+      case OPT_BLANK_LEVEL:
+        blank_options.level = atoi(optarg);
+        break;
+      case OPT_BLANK_SIZE:
+        blank_options.size = atoi(optarg);
+        break;
+      case OPT_BLANK_REPORT:
+        blank_options.report = optarg;
+        break;
+      case OPT_DUPLICATES:
+        phash_options.index = optarg;
+        break;
+      case OPT_DUPLICATE_WINDOW:
+        phash_options.window = atoi(optarg);
+        break;
+      case OPT_DUPLICATE_DISTANCE:
+        phash_options.distance = atoi(optarg);
+        break;
+      case OPT_DUPLICATE_THREADS:
+        phash_options.threads = atoi(optarg);
+        break;
+      case OPT_HOST_THREADS:
+        host_threads = atoi(optarg);
+        break;
       default:
         fprintf(stderr, "Unknown option: %s\n", optarg);
         return usage(argv[0]);
@@ -145,6 +527,9 @@ int main(int argc, char **argv) {
     exit(0);
   }
 
+  if (watch_stats_name)
+    return watch_stats(watch_stats_name);
+
   if (interactive_mode) {
     do_interactive();
     exit(0);
@@ -153,6 +538,88 @@ int main(int argc, char **argv) {
   if (optind >= argc && !output_to_stdout)
     return usage(argv[0]);
 
+  const struct output_format *format = formats;
+  if (output_format) {
+    while (format->name && strcmp(format->name, output_format))
+      format++;
+    if (!format->name) {
+      fprintf(stderr, "Unknown output format: %s\n", output_format);
+      return usage(argv[0]);
+    }
+  }
+  if (zero_copy && format->make != file_sink_new) {
+    fprintf(stderr, "--zero-copy only applies to jpeg output\n");
+    return 1;
+  }
+  if ((preallocate || io_stats) && format->make != file_sink_new) {
+    fprintf(stderr, "--preallocate and --io-stats only apply to jpeg output\n");
+    return 1;
+  }
+  if (subscribers && format->make != serve_sink_new) {
+    fprintf(stderr, "--subscribers only applies to serve output\n");
+    return 1;
+  }
+  if (ring_overwrite && format->make != ring_sink_new) {
+    fprintf(stderr, "--ring-overwrite only applies to ring output\n");
+    return 1;
+  }
+  if (format->make == zstd_sink_new && compression_type) {
+    fprintf(stderr, "zstd output is for uncompressed scans (-c 0)\n");
+    return 1;
+  }
+  if ((zstd_level || zstd_threads != -1) && format->make != zstd_sink_new) {
+    fprintf(stderr, "--zstd-level and --zstd-threads only apply to zstd "
+            "output\n");
+    return 1;
+  }
+  if (atomic && (format->make != file_sink_new || output_to_stdout)) {
+    fprintf(stderr, "--atomic only applies to jpeg files\n");
+    return 1;
+  }
+  if (blank) {
+    if (!strcmp(blank, "drop")) {
+      blank_options.drop = 1;
+    } else if (strcmp(blank, "flag")) {
+      fprintf(stderr, "--blank takes drop or flag, not %s\n", blank);
+      return usage(argv[0]);
+    }
+  }
+  if (host_mmr &&
+      (composition != KVS3105_COMPOSITION_BINARY || compression_type != 3)) {
+    fprintf(stderr, "--host-mmr needs -m binary -c 3\n");
+    return 1;
+  }
+  if (host_jpeg && (composition == KVS3105_COMPOSITION_BINARY ||
+                    !KVS3105_IS_JPEG(compression_type))) {
+    fprintf(stderr, "--host-jpeg needs -m gray or colour, and JPEG "
+            "compression\n");
+    return 1;
+  }
+  if (host_mmr || host_jpeg)
+    compression_type = 0;
+  if (host_layout &&
+      (composition != KVS3105_COMPOSITION_BINARY || compression_type)) {
+    fprintf(stderr, "--host-layout only applies to uncompressed binary "
+            "scans\n");
+    return 1;
+  }
+  if (!encrypt_key != !encrypt_index) {
+    fprintf(stderr, "--encrypt-key and --encrypt-index go together\n");
+    return 1;
+  }
+  // These containers would wrap the ciphertext as if it were the image
+  if (encrypt_key && (format->make == tiff_sink_new ||
+                      format->make == pdf_sink_new ||
+                      format->make == zstd_sink_new)) {
+    fprintf(stderr, "--encrypt-key doesn't apply to %s output\n",
+            format->name);
+    return 1;
+  }
+  if (output_to_stdout && !format->can_stream) {
+    fprintf(stderr, "%s output can't go to stdout\n", format->name);
+    return 1;
+  }
+
   const char *const filebase = argv[optind];
 
   usb_handle uh = reset_and_attach(device_name);
@@ -162,6 +629,20 @@ int main(int argc, char **argv) {
     return 2;
   }
 
+  struct kvs3105_stats *stats = NULL;
+  if (stats_name) {
+    stats = kvs3105_stats_create(uh, stats_name);
+    if (!stats)
+      return 2;
+  }
+
+  struct bufmon *bufmon = NULL;
+  if (buffer_log || buffer_alarm) {
+    bufmon = bufmon_new(buffer_log, buffer_alarm, buffer_interval);
+    if (!bufmon)
+      return 2;
+  }
+
   struct kvs3105_window window;
   kvs3105_window_init(&window);
 
@@ -169,12 +650,20 @@ int main(int argc, char **argv) {
   window.document_width = window.width = width * 1200;
   window.compression_argument = quality;
   window.compression_type = compression_type;
+  window.composition = composition;
+  window.bpp = composition == KVS3105_COMPOSITION_BINARY ? 1 :
+      composition == KVS3105_COMPOSITION_GRAYSCALE ? 8 : 24;
 
   // match the behavior of sheetfed_server
   window.emphasis = 0xf0;
   window.subsample = 0;
   window.xres = window.yres = pixels_per_inch;
   window.flatbed = flatbed;
+  if (!host_layout) {
+    window.reverse_image = invert;
+    window.mirror_image = mirror ? 0x80 : 0;
+    window.bit_ordering = msb_first;
+  }
 
   if (block_size > 254) {
     block_size = num_pages;
@@ -187,95 +676,134 @@ int main(int argc, char **argv) {
     window.number_of_pages_to_scan = block_size;
   }
 
-  uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
-  for (unsigned pageno = first_page_number;
-       pageno < first_page_number + num_pages;) {
-    if (kvs3105_reset_windows(uh, requestsense)) {
-      report("Error resetting windows", requestsense);
+  struct page_sink *sink;
+  if (output_to_stdout) {
+    sink = format->make(NULL);
+  } else if (!format->extension) {
+    sink = format->make(filebase);
+  } else {
+    char *path;
+    if (asprintf(&path, "%s.%s", filebase, format->extension) == -1) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      exit(1);
+    }
+    sink = format->make(path);
+    free(path);
+  }
+  if (!sink)
+    return 2;
+  struct page_sink *const output = sink;
+  if ((zero_copy && file_sink_use_zero_copy(sink)) ||
+      (preallocate && file_sink_use_preallocate(sink)) ||
+      (atomic && file_sink_use_atomic(sink, commit_pages, commit_interval)) ||
+      (subscribers && serve_sink_wait(sink, subscribers)) ||
+      ((zstd_level || zstd_threads != -1) &&
+       zstd_sink_configure(sink, zstd_level, zstd_threads))) {
+    sink->close(sink);
+    return 2;
+  }
+
+  if (io_stats)
+    file_sink_count_io(sink);
+  if (ring_overwrite)
+    ring_sink_overwrite(sink);
+  // Each of these wraps the ones before, so the manifest hashes exactly what
+  // reaches the output, after encryption and the new metadata.
+  if (manifest) {
+    struct page_sink *hash = hash_sink_new(sink, manifest);
+    if (!hash) {
+      sink->close(sink);
       return 2;
     }
-    if (kvs3105_set_windows(uh, &window, duplex, requestsense)) {
-      report("Error setting windows", requestsense);
+    sink = hash;
+  }
+  if (encrypt_key) {
+    struct page_sink *crypt = crypt_sink_new(sink, encrypt_key,
+                                             encrypt_index);
+    if (!crypt) {
+      sink->close(sink);
       return 2;
     }
-    if (kvs3105_scan(uh, requestsense)) {
-      report("Error starting scanning", requestsense);
+    sink = crypt;
+  }
+  if (metadata) {
+    struct kvs3105_identity identity;
+    uint8_t requestsense[KVS3105_REQUEST_SENSE_SIZE];
+    if (kvs3105_identify(uh, &identity, requestsense))
+      report("Error identifying the scanner", requestsense);
+    struct page_sink *meta = meta_sink_new(sink, &identity);
+    if (!meta) {
+      sink->close(sink);
       return 2;
     }
-
-    // We scan in blocks of block_size pages
-    int side = 0;
-    for (unsigned page = 0; page < block_size;) {
-      uint32_t width, height;
-      if (kvs3105_picture_size(uh, page, side, &width, &height, requestsense)) {
-        report("Error getting page size", requestsense);
-        return 2;
-      }
-
-      int outfd;
-      char *output_filename;
-      if (output_to_stdout) {
-        outfd = 1;
-        output_filename = strdup("stdout");
-      } else {
-        if (asprintf(&output_filename, "%s-%03d-%s.jpeg", filebase,
-                     pageno + page, side ? "B" : "A" ) == -1) {
-          fprintf(stderr, "Memory allocation failed!\n");
-          exit(1);
-        }
-        outfd = open(output_filename,
-                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      }
-      if (outfd < 0) {
-        fprintf(stderr, "Failed to write to %s: %s\n", output_filename,
-                strerror(errno));
-        free(output_filename);
-        return 2;
-      }
-      int waitstatus;
-      if ((waitstatus = kvs3105_data_buffer_wait(uh, requestsense))) {
-        report("Error waiting for image data", requestsense);
-        // TODO(dgluss): 3 is a bad name for a condition.  Put in a name.
-        if (side == 0 && waitstatus == 3)
-          fprintf(stderr, "end of book.\n");
-        close(outfd);
-        unlink(output_filename);
-        free(output_filename);
-        return 2;
-      }
-
-      uint8_t buffer[KVS3105_BUFFER_SIZE];
-      unsigned done = 0;
-      unsigned written;
-      char end_of_page;
-
-      for (;;) {
-        if (kvs3105_read_data(uh, page, side, buffer, sizeof(buffer),
-                               &written, &end_of_page, requestsense)) {
-          report("Error reading image", requestsense);
-          free(output_filename);
-          return 2;
-        }
-
-        written = write(outfd, buffer, written);
-        done += written;
-        if (end_of_page) break;
-      }
-      fprintf(stderr, "%s: %d bytes\n", output_filename, done);
-      free(output_filename);
-
-      close(outfd);
-      if (duplex) {
-        if (side) {
-          page++;
-          side = 0;
-        } else {
-          side = 1;
-        }
-      } else {
-        page++;
-      }
+    sink = meta;
+  }
+  // Inside the blank detection, so that dropped sides aren't hashed
+  if (phash_options.index) {
+    struct page_sink *phash = phash_sink_new(sink, &phash_options);
+    if (!phash) {
+      sink->close(sink);
+      return 2;
     }
-    pageno += block_size;
+    sink = phash;
   }
+  if (blank) {
+    struct page_sink *detect = blank_sink_new(sink, &blank_options);
+    if (!detect) {
+      sink->close(sink);
+      return 2;
+    }
+    sink = detect;
+  }
+  if (validate) {
+    struct page_sink *check = check_sink_new(sink);
+    if (!check) {
+      sink->close(sink);
+      return 2;
+    }
+    sink = check;
+  }
+  // Everything but the layout change sees G4 or JPEG data, just as if the
+  // scanner had encoded it
+  if (host_mmr) {
+    struct page_sink *g4 = g4_sink_new(sink, host_threads);
+    if (!g4) {
+      sink->close(sink);
+      return 2;
+    }
+    sink = g4;
+  }
+  if (host_jpeg) {
+    struct page_sink *encode = jpeg_encode_sink_new(sink, quality,
+                                                    host_threads);
+    if (!encode) {
+      sink->close(sink);
+      return 2;
+    }
+    sink = encode;
+  }
+  // Outermost, so that everything else sees the final layout
+  if (host_layout && (invert || mirror || msb_first)) {
+    struct page_sink *layout = layout_sink_new(
+        sink, (invert ? BITOPS_INVERT : 0) | (mirror ? BITOPS_MIRROR : 0) |
+              (msb_first ? BITOPS_REVERSE : 0));
+    if (!layout) {
+      sink->close(sink);
+      return 2;
+    }
+    sink = layout;
+  }
+
+  const int status = scan_pages(uh, &window, duplex, first_page_number,
+                                num_pages, block_size, sink, bufmon);
+  // Only a job which succeeded gets an end marker
+  if (!status && format->make == frame_sink_new)
+    frame_sink_finish(output);
+  if (!status && format->make == serve_sink_new)
+    serve_sink_finish(output);
+  if (sink->close(sink))
+    return 2;
+  bufmon_close(bufmon);
+  kvs3105_stats_close(stats);
+  return status;
 }
@@ -0,0 +1,63 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The protocol spoken by kvscanner -o serve.
+//
+// kvscanner listens on a SOCK_SEQPACKET Unix domain socket at the path given
+// as the filebase. Clients connect and then only receive; whatever they send
+// is ignored. Pages scanned before a client connects aren't sent to it (see
+// kvscanner --subscribers).
+//
+// Every message is one struct kvserve_message, in host byte order. A page
+// message carries a single descriptor in an SCM_RIGHTS control message: a
+// memfd holding the side's data exactly as the scanner produced it, sealed
+// against writing, growing and shrinking, so it can be mmapped read-only and
+// trusted not to change. Every client gets a descriptor for the same memfd,
+// so there is only ever one copy of a page in memory, which is freed when the
+// last client closes it.
+//
+// The last message of a job which succeeded is an end message without a
+// descriptor; if the scan fails, the socket is closed without one. A client
+// which can't keep up, so that its socket fills, is disconnected rather than
+// stalling the scanner.
+
+#ifndef THIRD_PARTY_KVS3105USB_KVSERVE_H_
+#define THIRD_PARTY_KVS3105USB_KVSERVE_H_
+
+#include <stdint.h>
+
+#define KVSERVE_PAGE_MAGIC "KVSP"
+#define KVSERVE_END_MAGIC "KVSE"
+
+// 40 bytes, with no implicit padding
+struct kvserve_message {
+  // KVSERVE_PAGE_MAGIC or KVSERVE_END_MAGIC
+  char magic[4];
+  // page number
+  uint32_t page;
+  // 0 -> front, 1 -> back
+  uint8_t side;
+  // compression type (as in kvs3105_window)
+  uint8_t compression_type;
+  uint16_t reserved;
+  // dimensions in pixels, and resolution in dots per inch
+  uint32_t width, height;
+  uint16_t xres, yres;
+  uint32_t reserved2[2];
+  // page: the length of the data in the memfd
+  // end: the number of pages sent in the job
+  uint64_t length;
+};
+
+#endif  // THIRD_PARTY_KVS3105USB_KVSERVE_H_
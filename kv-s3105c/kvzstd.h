@@ -0,0 +1,58 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The file written by kvscanner -o zstd.
+//
+// Each side is compressed as its own zstd frame, one after another, so the
+// file decompresses with plain zstd -d to all the sides back-to-back. After
+// the last side come two skippable frames, which decoders ignore:
+//
+//   page table: skippable frame magic 0x184D2A50, then
+//      0: magic "KVZP"
+//      4: uint32 number of sides
+//      8: for each side, 16 bytes:
+//           0: uint32 page number
+//           4: uint8 side (0 -> front, 1 -> back)
+//           5: uint8 compression type (as in kvs3105_window)
+//           6: uint16 bits per pixel
+//           8: uint32 width in pixels
+//          12: uint32 height in pixels
+//
+//   seek table: as in zstd's seekable format (contrib/seekable_format in the
+//   zstd sources), with an entry of compressed and decompressed size for each
+//   side's frame and no checksums.
+//
+// All integers are little endian, as zstd's are. Both tables list the sides
+// in the same order, so a reader takes the footer from the last 9 bytes,
+// adds up the frame sizes to find the side it wants and decompresses just
+// that frame.
+//
+// If the job stops part way through a side, that side's frame is cut off the
+// end of the file before the tables are written. When the output can't be
+// truncated (stdout), the frame is finished instead and listed with the
+// length it got to, which is short of width and height.
+
+#ifndef THIRD_PARTY_KVS3105USB_KVZSTD_H_
+#define THIRD_PARTY_KVS3105USB_KVZSTD_H_
+
+#define KVZSTD_PAGE_TABLE_FRAME 0x184D2A50
+#define KVZSTD_PAGE_TABLE_MAGIC "KVZP"
+#define KVZSTD_PAGE_ENTRY_SIZE 16
+
+#define KVZSTD_SEEK_TABLE_FRAME 0x184D2A5E
+#define KVZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define KVZSTD_SEEK_ENTRY_SIZE 8
+#define KVZSTD_SEEK_FOOTER_SIZE 9
+
+#endif  // THIRD_PARTY_KVS3105USB_KVZSTD_H_
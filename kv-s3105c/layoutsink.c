@@ -0,0 +1,207 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bit order, inversion and mirroring of uncompressed binary scans, done on
+// the host on the way to another sink (see bitops.h).
+//
+// The window passed on with each side describes the data after the change,
+// so that, for example, the TIFF FillOrder is right. Swapping the bit order
+// and inverting work byte by byte as chunks arrive; mirroring needs whole rows,
+// so the end of a chunk that splits a row is held until the next one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+#include "bitops.h"
+
+struct layout_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  unsigned ops;
+  struct page_info info;
+  struct kvs3105_window window;
+  // whether the current side is one to change
+  int active;
+  int lsb_first;
+  size_t stride;
+  // where changed data goes: next's buffer, or our own
+  uint8_t *buffer, *out;
+  // where chunks are read when next has buffers
+  uint8_t *in;
+  size_t used;
+  // the start of a row split between chunks
+  uint8_t *row;
+  size_t carried;
+};
+
+static int layout_begin_page(struct page_sink *sink,
+                             const struct page_info *info) {
+  struct layout_sink *s = (struct layout_sink *) sink;
+
+  s->info = *info;
+  s->active = !info->compression_type && info->window->bpp == 1;
+  if (s->active) {
+    s->window = *info->window;
+    s->lsb_first = !s->window.bit_ordering;
+    s->stride = ((size_t) info->width + 7) / 8;
+    if (s->stride > KVS3105_BUFFER_SIZE) {
+      fprintf(stderr, "page %d%s: rows too wide to change the layout\n",
+              info->page, info->side ? "B" : "A");
+      return 1;
+    }
+    if (s->ops & BITOPS_REVERSE)
+      s->window.bit_ordering = !s->window.bit_ordering;
+    if (s->ops & BITOPS_INVERT)
+      s->window.reverse_image = !s->window.reverse_image;
+    if (s->ops & BITOPS_MIRROR)
+      s->window.mirror_image ^= 0x80;
+    s->info.window = &s->window;
+  }
+  s->carried = 0;
+  return s->next->begin_page(s->next, &s->info);
+}
+
+static uint8_t *output(struct layout_sink *s) {
+  if (!s->out) {
+    s->out = s->next->get_buffer ? s->next->get_buffer(s->next) : s->buffer;
+    s->used = 0;
+  }
+  return s->out;
+}
+
+static int flush(struct layout_sink *s) {
+  uint8_t *const out = s->out;
+
+  s->out = NULL;
+  if (!out || !s->used)
+    return 0;
+  return s->next->write(s->next, out, s->used);
+}
+
+static int put_row(struct layout_sink *s, const uint8_t *row) {
+  if (s->out && s->used + s->stride > KVS3105_BUFFER_SIZE && flush(s))
+    return 1;
+  if (!output(s))
+    return 1;
+  bitops_row(s->out + s->used, row, s->info.width, s->lsb_first, s->ops);
+  s->used += s->stride;
+  return 0;
+}
+
+static int layout_write(struct page_sink *sink, const uint8_t *data,
+                        unsigned length) {
+  struct layout_sink *s = (struct layout_sink *) sink;
+
+  if (!s->active)
+    return s->next->write(s->next, data, length);
+
+  if (!(s->ops & BITOPS_MIRROR)) {
+    while (length) {
+      const unsigned n = length < KVS3105_BUFFER_SIZE ? length :
+          KVS3105_BUFFER_SIZE;
+      if (!output(s))
+        return 1;
+      bitops_bytes(s->out, data, n, s->ops);
+      s->used = n;
+      if (flush(s))
+        return 1;
+      data += n;
+      length -= n;
+    }
+    return 0;
+  }
+
+  while (length) {
+    if (s->carried || length < s->stride) {
+      size_t n = s->stride - s->carried;
+      if (n > length)
+        n = length;
+      memcpy(s->row + s->carried, data, n);
+      s->carried += n;
+      data += n;
+      length -= n;
+      if (s->carried < s->stride)
+        break;
+      s->carried = 0;
+      if (put_row(s, s->row))
+        return 1;
+    } else {
+      if (put_row(s, data))
+        return 1;
+      data += s->stride;
+      length -= s->stride;
+    }
+  }
+  return flush(s);
+}
+
+static int layout_end_page(struct page_sink *sink) {
+  struct layout_sink *s = (struct layout_sink *) sink;
+
+  if (s->carried) {
+    fprintf(stderr, "page %d%s: ends part way through a row\n", s->info.page,
+            s->info.side ? "B" : "A");
+    if (s->next->write(s->next, s->row, s->carried))
+      return 1;
+  }
+  return s->next->end_page(s->next);
+}
+
+// Sides to change are read into our buffer, and written into next's
+static uint8_t *layout_get_buffer(struct page_sink *sink) {
+  struct layout_sink *s = (struct layout_sink *) sink;
+  return s->active ? s->in : s->next->get_buffer(s->next);
+}
+
+static int layout_close(struct page_sink *sink) {
+  struct layout_sink *s = (struct layout_sink *) sink;
+  int r = s->next->close(s->next);
+
+  free(s->buffer);
+  free(s->in);
+  free(s->row);
+  free(s);
+  return r;
+}
+
+struct page_sink *layout_sink_new(struct page_sink *next, unsigned ops) {
+  struct layout_sink *s = calloc(1, sizeof(struct layout_sink));
+  if (s) {
+    s->row = malloc(KVS3105_BUFFER_SIZE);
+    if (next->get_buffer)
+      s->in = malloc(KVS3105_BUFFER_SIZE);
+    else
+      s->buffer = malloc(KVS3105_BUFFER_SIZE);
+  }
+  if (!s || !s->row || !(s->in || s->buffer)) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    if (s) {
+      free(s->row);
+      free(s->in);
+      free(s->buffer);
+    }
+    free(s);
+    return NULL;
+  }
+  s->base.begin_page = layout_begin_page;
+  s->base.write = layout_write;
+  s->base.end_page = layout_end_page;
+  s->base.get_buffer = next->get_buffer ? layout_get_buffer : NULL;
+  s->base.close = layout_close;
+  s->next = next;
+  s->ops = ops;
+  return &s->base;
+}
@@ -0,0 +1,300 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Rewriting of the JFIF and EXIF segments of JPEG sides on their way to
+// another sink.
+//
+// The scanner's APP0 doesn't carry the resolution and there's no APP1, so
+// without this every file has to be rewritten later to say what it is. Only
+// the start of each side is touched: the SOI is passed on, followed by a new
+// APP0 and APP1, and any APP0 and APP1 segments from the scanner are dropped.
+// Everything from the next marker on is passed on as it arrives, so nothing
+// is decoded and nothing is buffered beyond a segment header.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sink.h"
+
+// Big enough for APP0 and an APP1 with the longest strings
+#define META_HEADER_SIZE 512
+
+enum {
+  // looking for SOI
+  META_SOI,
+  // reading the marker and length of the next segment
+  META_SEGMENT,
+  // dropping the rest of an APP0 or APP1 segment
+  META_DROP,
+  // passing everything on
+  META_PASS,
+};
+
+struct meta_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  struct kvs3105_identity identity;
+  // SOI, APP0 and APP1 for the current side
+  uint8_t header[META_HEADER_SIZE];
+  unsigned header_length;
+  int state;
+  // bytes held while a segment header is incomplete
+  uint8_t held[4];
+  unsigned num_held;
+  unsigned remaining;
+  unsigned sides;
+};
+
+static void put16(uint8_t *p, unsigned v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+// A TIFF directory entry. Values which don't fit in the entry go in the data
+// area after the directories.
+struct tiff_entry {
+  uint16_t tag, type;
+  uint32_t count;
+  const void *value;
+  unsigned size;
+};
+
+enum {
+  TIFF_ASCII = 2,
+  TIFF_SHORT = 3,
+  TIFF_LONG = 4,
+  TIFF_RATIONAL = 5,
+};
+
+// Write an IFD at offset ifd from tiff, which is big-endian, putting large
+// values at *data. Returns the offset after the directory.
+static unsigned write_ifd(uint8_t *tiff, unsigned ifd,
+                          const struct tiff_entry *entries, unsigned count,
+                          unsigned *data) {
+  put16(tiff + ifd, count);
+  for (unsigned i = 0; i < count; i++) {
+    const struct tiff_entry *e = &entries[i];
+    uint8_t *p = tiff + ifd + 2 + 12 * i;
+    put16(p, e->tag);
+    put16(p + 2, e->type);
+    put32(p + 4, e->count);
+    memset(p + 8, 0, 4);
+    if (e->size <= 4) {
+      memcpy(p + 8, e->value, e->size);
+    } else {
+      put32(p + 8, *data);
+      memcpy(tiff + *data, e->value, e->size);
+      *data += (e->size + 1) & ~1;
+    }
+  }
+  put32(tiff + ifd + 2 + 12 * count, 0);
+  return ifd + 2 + 12 * count + 4;
+}
+
+#define ASCII_ENTRY(tag, s) \
+    { tag, TIFF_ASCII, strlen(s) + 1, s, strlen(s) + 1 }
+
+// Build SOI, APP0 and APP1 for a side
+static void make_header(struct meta_sink *s, const struct page_info *info) {
+  const unsigned xres = KVS3105_XRES(info->window);
+  const unsigned yres = KVS3105_YRES(info->window);
+  uint8_t *p = s->header;
+
+  // SOI
+  put16(p, 0xffd8);
+  p += 2;
+
+  // JFIF 1.02, with the density in dots per inch and no thumbnail
+  put16(p, 0xffe0);
+  put16(p + 2, 16);
+  memcpy(p + 4, "JFIF\0\1\2\1", 8);
+  put16(p + 12, xres);
+  put16(p + 14, yres);
+  p[16] = p[17] = 0;
+  p += 18;
+
+  char description[64], when[20];
+  const time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  strftime(when, sizeof(when), "%Y:%m:%d %H:%M:%S", &tm);
+  snprintf(description, sizeof(description), "page %u side %s", info->page,
+           info->side ? "B" : "A");
+  uint8_t xres_rational[8], yres_rational[8], unit[2], width[4], height[4],
+          exif_ifd[4];
+  put32(xres_rational, xres);
+  put32(xres_rational + 4, 1);
+  put32(yres_rational, yres);
+  put32(yres_rational + 4, 1);
+  put16(unit, 2);  // inches
+  put32(width, info->width);
+  put32(height, info->height);
+
+  const struct tiff_entry ifd0[] = {
+    ASCII_ENTRY(0x010e, description),
+    ASCII_ENTRY(0x010f, s->identity.vendor),
+    ASCII_ENTRY(0x0110, s->identity.product),
+    { 0x011a, TIFF_RATIONAL, 1, xres_rational, 8 },
+    { 0x011b, TIFF_RATIONAL, 1, yres_rational, 8 },
+    { 0x0128, TIFF_SHORT, 1, unit, 2 },
+    ASCII_ENTRY(0x0132, when),
+    // ExifIFD
+    { 0x8769, TIFF_LONG, 1, exif_ifd, 4 },
+  };
+  const struct tiff_entry exif[] = {
+    // DateTimeOriginal
+    ASCII_ENTRY(0x9003, when),
+    // PixelXDimension, PixelYDimension
+    { 0xa002, TIFF_LONG, 1, width, 4 },
+    { 0xa003, TIFF_LONG, 1, height, 4 },
+    // BodySerialNumber, last so that it can be left out
+    ASCII_ENTRY(0xa431, s->identity.serial),
+  };
+  const unsigned num_ifd0 = sizeof(ifd0) / sizeof(ifd0[0]);
+  const unsigned num_exif = sizeof(exif) / sizeof(exif[0]) -
+                            (s->identity.serial[0] ? 0 : 1);
+
+  // The TIFF structure: header, IFD0, the Exif IFD, then the data area
+  uint8_t *tiff = p + 10;
+  const unsigned exif_offset = 8 + 2 + 12 * num_ifd0 + 4;
+  unsigned data = exif_offset + 2 + 12 * num_exif + 4;
+  memcpy(tiff, "MM\0\x2a", 4);
+  put32(tiff + 4, 8);
+  put32(exif_ifd, exif_offset);
+  write_ifd(tiff, 8, ifd0, num_ifd0, &data);
+  write_ifd(tiff, exif_offset, exif, num_exif, &data);
+
+  put16(p, 0xffe1);
+  put16(p + 2, 8 + data);
+  memcpy(p + 4, "Exif\0\0", 6);
+  p += 4 + 6 + data;
+
+  s->header_length = p - s->header;
+}
+
+static int meta_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct meta_sink *s = (struct meta_sink *) sink;
+
+  s->num_held = 0;
+  if (KVS3105_IS_JPEG(info->compression_type)) {
+    make_header(s, info);
+    s->state = META_SOI;
+  } else {
+    s->state = META_PASS;
+  }
+  return s->next->begin_page(s->next, info);
+}
+
+static int meta_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct meta_sink *s = (struct meta_sink *) sink;
+  const uint8_t *p = data, *const end = data + length;
+
+  while (p < end && s->state != META_PASS) {
+    if (s->state == META_DROP) {
+      const unsigned n = end - p < s->remaining ? end - p : s->remaining;
+      p += n;
+      s->remaining -= n;
+      if (!s->remaining)
+        s->state = META_SEGMENT;
+      continue;
+    }
+
+    s->held[s->num_held++] = *p++;
+    if (s->state == META_SOI) {
+      if (s->num_held < 2)
+        continue;
+      s->num_held = 0;
+      if (s->held[0] != 0xff || s->held[1] != 0xd8) {
+        // Not JPEG after all, so leave it alone
+        if (s->next->write(s->next, s->held, 2))
+          return 1;
+        s->state = META_PASS;
+        break;
+      }
+      if (s->next->write(s->next, s->header, s->header_length))
+        return 1;
+      s->sides++;
+      s->state = META_SEGMENT;
+    } else if (s->num_held == 4) {
+      const unsigned segment_length = (s->held[2] << 8) | s->held[3];
+      s->num_held = 0;
+      if (s->held[0] == 0xff && (s->held[1] == 0xe0 || s->held[1] == 0xe1) &&
+          segment_length >= 2) {
+        s->remaining = segment_length - 2;
+        s->state = s->remaining ? META_DROP : META_SEGMENT;
+      } else {
+        if (s->next->write(s->next, s->held, 4))
+          return 1;
+        s->state = META_PASS;
+      }
+    }
+  }
+  if (p == end)
+    return 0;
+  // Pass on the original pointer where possible, which may be a buffer from
+  // next's get_buffer
+  return s->next->write(s->next, p, end - p);
+}
+
+static int meta_end_page(struct page_sink *sink) {
+  struct meta_sink *s = (struct meta_sink *) sink;
+
+  // A side too short to have a segment after the SOI
+  if (s->num_held && s->next->write(s->next, s->held, s->num_held))
+    return 1;
+  s->num_held = 0;
+  return s->next->end_page(s->next);
+}
+
+static uint8_t *meta_get_buffer(struct page_sink *sink) {
+  struct meta_sink *s = (struct meta_sink *) sink;
+  return s->next->get_buffer(s->next);
+}
+
+static int meta_close(struct page_sink *sink) {
+  struct meta_sink *s = (struct meta_sink *) sink;
+  const int r = s->next->close(s->next);
+
+  fprintf(stderr, "metadata: rewrote %u sides\n", s->sides);
+  free(s);
+  return r;
+}
+
+struct page_sink *meta_sink_new(struct page_sink *next,
+                                const struct kvs3105_identity *identity) {
+  struct meta_sink *s = calloc(1, sizeof(struct meta_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  s->base.begin_page = meta_begin_page;
+  s->base.write = meta_write;
+  s->base.end_page = meta_end_page;
+  s->base.get_buffer = next->get_buffer ? meta_get_buffer : NULL;
+  s->base.close = meta_close;
+  s->next = next;
+  s->identity = *identity;
+  return &s->base;
+}
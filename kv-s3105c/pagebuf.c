@@ -0,0 +1,53 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pagebuf.h"
+
+int pagebuf_reserve(struct pagebuf *buf, size_t size) {
+  if (size <= buf->allocated)
+    return 0;
+  size_t allocated = buf->allocated ? buf->allocated : 1 << 20;
+  while (allocated < size)
+    allocated *= 2;
+  uint8_t *data = realloc(buf->data, allocated);
+  if (!data) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  buf->data = data;
+  buf->allocated = allocated;
+  return 0;
+}
+
+int pagebuf_append(struct pagebuf *buf, const void *data, size_t length) {
+  if (pagebuf_reserve(buf, buf->length + length))
+    return 1;
+  memcpy(buf->data + buf->length, data, length);
+  buf->length += length;
+  return 0;
+}
+
+void pagebuf_reset(struct pagebuf *buf) {
+  buf->length = 0;
+}
+
+void pagebuf_free(struct pagebuf *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->length = buf->allocated = 0;
+}
@@ -0,0 +1,51 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A growable buffer for holding a whole side in memory. Resetting it keeps the
+// allocation, so after the first few pages a job stops calling malloc.
+
+#ifndef THIRD_PARTY_KVS3105USB_PAGEBUF_H_
+#define THIRD_PARTY_KVS3105USB_PAGEBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pagebuf {
+  uint8_t *data;
+  size_t length;
+  size_t allocated;
+};
+
+// -----------------------------------------------------------------------------
+// Make sure there's room for at least size bytes in total. Returns 0 on
+// success.
+// -----------------------------------------------------------------------------
+int pagebuf_reserve(struct pagebuf *buf, size_t size);
+
+// -----------------------------------------------------------------------------
+// Append length bytes. Returns 0 on success.
+// -----------------------------------------------------------------------------
+int pagebuf_append(struct pagebuf *buf, const void *data, size_t length);
+
+// -----------------------------------------------------------------------------
+// Empty the buffer, keeping its memory for the next page.
+// -----------------------------------------------------------------------------
+void pagebuf_reset(struct pagebuf *buf);
+
+// -----------------------------------------------------------------------------
+// Release the buffer's memory.
+// -----------------------------------------------------------------------------
+void pagebuf_free(struct pagebuf *buf);
+
+#endif  // THIRD_PARTY_KVS3105USB_PAGEBUF_H_
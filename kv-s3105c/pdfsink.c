@@ -0,0 +1,291 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Multi-page PDF output.
+//
+// Each side becomes a page holding one image XObject whose stream is the
+// scanner's data, unchanged: JPEG data with the DCTDecode filter and MH, MR
+// or MMR data with CCITTFaxDecode. The stream is written as it's read from the
+// scanner, and since its length isn't known until the end, it's given as an
+// indirect object which follows the stream.
+//
+// The file is written strictly front to back, so it can go to a pipe. Object
+// 2 (the page tree) and the cross reference table are written when the sink
+// is closed. See the PDF Reference, sections 3.3, 3.4 and 4.8.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sink.h"
+
+#define CATALOG_OBJECT 1
+#define PAGES_OBJECT 2
+
+struct pdf_sink {
+  struct page_sink base;
+  char *path;
+  int fd;
+  uint64_t offset;
+  // offsets[i] is the file offset of object i
+  uint64_t *offsets;
+  unsigned objects, objects_allocated;
+  // object numbers of the page objects, in order
+  unsigned *pages;
+  unsigned npages, pages_allocated;
+  struct page_info info;
+  unsigned image_object, length_object;
+  int in_page;
+  uint64_t stream_start;
+};
+
+static int write_all(struct pdf_sink *s, const void *data, size_t length) {
+  const uint8_t *p = data;
+  while (length) {
+    const ssize_t n = write(s->fd, p, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->path,
+              strerror(errno));
+      return 1;
+    }
+    s->offset += n;
+    p += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static int pdf_printf(struct pdf_sink *s, const char *format, ...) {
+  va_list ap;
+  char *str;
+  va_start(ap, format);
+  const int n = vasprintf(&str, format, ap);
+  va_end(ap);
+  if (n < 0) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    exit(1);
+  }
+  const int r = write_all(s, str, n);
+  free(str);
+  return r;
+}
+
+// Allocate an object number without writing anything yet
+static unsigned new_object(struct pdf_sink *s) {
+  if (s->objects == s->objects_allocated) {
+    s->objects_allocated = s->objects_allocated ? s->objects_allocated * 2 : 64;
+    s->offsets = realloc(s->offsets, s->objects_allocated * sizeof(uint64_t));
+    if (!s->offsets) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      exit(1);
+    }
+  }
+  s->offsets[s->objects] = 0;
+  return s->objects++;
+}
+
+// Start writing object number obj at the current offset
+static int begin_object(struct pdf_sink *s, unsigned obj) {
+  s->offsets[obj] = s->offset;
+  return pdf_printf(s, "%u 0 obj\n", obj);
+}
+
+static int pdf_begin_page(struct page_sink *sink,
+                          const struct page_info *info) {
+  struct pdf_sink *s = (struct pdf_sink *) sink;
+  const struct kvs3105_window *w = info->window;
+  const char *colour_space = w->bpp == 24 ? "/DeviceRGB" :
+      w->bpp == 8 ? "/DeviceGray" : NULL;
+
+  s->info = *info;
+  s->image_object = new_object(s);
+  s->length_object = new_object(s);
+  s->in_page = 1;
+  if (begin_object(s, s->image_object) ||
+      pdf_printf(s, "<< /Type /XObject /Subtype /Image /Width %u "
+                 "/Height %u /Length %u 0 R\n", info->width, info->height,
+                 s->length_object))
+    return 1;
+
+  switch (info->compression_type) {
+    case 1:
+    case 2:
+    case 3:
+      // K: < 0 -> pure 2D (G4), 0 -> 1D (MH), > 0 -> mixed (MR)
+      if (pdf_printf(s, "/ColorSpace /DeviceGray /BitsPerComponent 1 "
+                     "/Filter /CCITTFaxDecode /DecodeParms << /K %d "
+                     "/Columns %u /Rows %u >>\n",
+                     info->compression_type == 3 ? -1 :
+                     info->compression_type == 2 ? 1 : 0,
+                     info->width, info->height))
+        return 1;
+      break;
+    case 4:
+    case 0x81:
+      if (!colour_space) {
+        fprintf(stderr, "%s: JPEG needs a gray or colour scan\n", s->path);
+        return 1;
+      }
+      if (pdf_printf(s, "/ColorSpace %s /BitsPerComponent 8 "
+                     "/Filter /DCTDecode\n", colour_space))
+        return 1;
+      break;
+    default:
+      fprintf(stderr, "%s: PDF output needs JPEG, MH, MR or MMR data, not "
+              "compression type 0x%x\n", s->path, info->compression_type);
+      return 1;
+  }
+
+  if (pdf_printf(s, ">>\nstream\n"))
+    return 1;
+  s->stream_start = s->offset;
+  return 0;
+}
+
+static int pdf_write(struct page_sink *sink, const uint8_t *data,
+                     unsigned length) {
+  struct pdf_sink *s = (struct pdf_sink *) sink;
+  return write_all(s, data, length);
+}
+
+static int pdf_end_page(struct page_sink *sink) {
+  struct pdf_sink *s = (struct pdf_sink *) sink;
+  const uint64_t length = s->offset - s->stream_start;
+  const unsigned content_object = new_object(s);
+  const unsigned page_object = new_object(s);
+
+  // Page size in points (1/72")
+  const double width = s->info.width * 72.0 / KVS3105_XRES(s->info.window);
+  const double height = s->info.height * 72.0 / KVS3105_YRES(s->info.window);
+  char content[128];
+  const int content_length = snprintf(content, sizeof(content),
+                                      "q %.2f 0 0 %.2f 0 0 cm /Im0 Do Q\n",
+                                      width, height);
+
+  if (pdf_printf(s, "\nendstream\nendobj\n") ||
+      begin_object(s, s->length_object) ||
+      pdf_printf(s, "%llu\nendobj\n", (unsigned long long) length) ||
+      begin_object(s, content_object) ||
+      pdf_printf(s, "<< /Length %d >>\nstream\n%sendstream\nendobj\n",
+                 content_length, content) ||
+      begin_object(s, page_object) ||
+      pdf_printf(s, "<< /Type /Page /Parent %u 0 R "
+                 "/MediaBox [0 0 %.2f %.2f] /Contents %u 0 R\n"
+                 "/Resources << /XObject << /Im0 %u 0 R >> >> >>\nendobj\n",
+                 PAGES_OBJECT, width, height, content_object,
+                 s->image_object))
+    return 1;
+
+  if (s->npages == s->pages_allocated) {
+    s->pages_allocated = s->pages_allocated ? s->pages_allocated * 2 : 64;
+    s->pages = realloc(s->pages, s->pages_allocated * sizeof(unsigned));
+    if (!s->pages) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      exit(1);
+    }
+  }
+  s->pages[s->npages++] = page_object;
+  s->in_page = 0;
+
+  fprintf(stderr, "%s: page %d%s: %llu bytes\n", s->path, s->info.page,
+          s->info.side ? "B" : "A", (unsigned long long) length);
+  return 0;
+}
+
+static int pdf_close(struct page_sink *sink) {
+  struct pdf_sink *s = (struct pdf_sink *) sink;
+  int r = 0;
+
+  // If a page was interrupted, its image is left unreferenced and marked as
+  // free in the xref table, so it doesn't stop the file from being read.
+  if (s->in_page)
+    s->offsets[s->image_object] = 0;
+  r |= begin_object(s, PAGES_OBJECT);
+  r |= pdf_printf(s, "<< /Type /Pages /Count %u /Kids [", s->npages);
+  for (unsigned i = 0; i < s->npages && !r; i++)
+    r |= pdf_printf(s, "%s%u 0 R", i ? " " : "", s->pages[i]);
+  r |= pdf_printf(s, "] >>\nendobj\n");
+
+  const uint64_t xref = s->offset;
+  r |= pdf_printf(s, "xref\n0 %u\n0000000000 65535 f \n", s->objects);
+  for (unsigned i = 1; i < s->objects && !r; i++) {
+    if (s->offsets[i])
+      r |= pdf_printf(s, "%010llu 00000 n \n",
+                      (unsigned long long) s->offsets[i]);
+    else
+      r |= pdf_printf(s, "0000000000 65535 f \n");
+  }
+  r |= pdf_printf(s, "trailer\n<< /Size %u /Root %u 0 R >>\nstartxref\n%llu\n"
+                  "%%%%EOF\n", s->objects, CATALOG_OBJECT,
+                  (unsigned long long) xref);
+
+  if (s->fd != 1 && close(s->fd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  fprintf(stderr, "%s: %u pages\n", s->path, s->npages);
+  free(s->offsets);
+  free(s->pages);
+  free(s->path);
+  free(s);
+  return r;
+}
+
+struct page_sink *pdf_sink_new(const char *path) {
+  struct pdf_sink *s = calloc(1, sizeof(struct pdf_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = pdf_begin_page;
+  s->base.write = pdf_write;
+  s->base.end_page = pdf_end_page;
+  s->base.close = pdf_close;
+  if (path) {
+    s->path = strdup(path);
+    s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else {
+    s->path = strdup("stdout");
+    s->fd = 1;
+  }
+  if (s->fd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+
+  new_object(s);  // object 0 is always free
+  new_object(s);  // CATALOG_OBJECT
+  new_object(s);  // PAGES_OBJECT
+  // The binary comment marks the file as containing binary data
+  if (pdf_printf(s, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n") ||
+      begin_object(s, CATALOG_OBJECT) ||
+      pdf_printf(s, "<< /Type /Catalog /Pages %u 0 R >>\nendobj\n",
+                 PAGES_OBJECT)) {
+    if (s->fd != 1)
+      close(s->fd);
+    free(s->offsets);
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
@@ -0,0 +1,535 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Perceptual hashing of every side on its way to another sink, to catch
+// sheets which went through twice.
+//
+// The hash is the usual DCT one: the side is reduced to 32x32 gray, and each
+// bit of the 64-bit hash says whether one of the 8x8 lowest frequencies of
+// its DCT is above their median. Near-identical images have hashes a few bits
+// apart, whatever their compression or small shifts in position.
+//
+// Uncompressed sides are reduced to the 32x32 cells as their chunks arrive,
+// sampling every fourth row and column, so nothing is kept of them but the
+// cells. JPEG sides are copied into a buffer and decoded on a worker pool at
+// 1/8 scale, which only needs the DC coefficient of each block, so what's
+// hashed comes almost straight from the DCT domain. The hashing itself runs
+// on the pool too. MH/MR/MMR sides aren't hashed. Each hash is compared with those of the sides within
+// the window before and after it as soon as both are known, and a near match
+// is reported there and then.
+//
+// If the workers fall so far behind that PHASH_MAX_PENDING JPEG sides are
+// waiting, further ones go unhashed until they catch up, rather than hold up
+// reading.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+#include "jpegsmall.h"
+#include "pagebuf.h"
+#include "workpool.h"
+
+#define PHASH_SIZE 32
+#define PHASH_FREQUENCIES 8
+#define PHASH_MAX_PENDING 32
+// Spare buffers which grew bigger than this for an unusual side let go of
+// their memory, rather than keep it for the rest of the job
+#define PHASH_SPARE_SIZE (16 << 20)
+// Sides whose reduced image has less contrast than this (the standard
+// deviation, in gray levels) are treated as blank: their hashes are noise and
+// would match each other.
+#define PHASH_FLAT 2.0
+
+enum side_state {
+  SIDE_UNHASHED,
+  SIDE_PENDING,
+  SIDE_HASHED,
+  SIDE_FLAT,
+};
+
+struct phash_side {
+  struct workpool_task task;
+  struct phash_sink *sink;
+  // position in sink->sides
+  unsigned index;
+  unsigned page;
+  int side;
+  uint8_t compression_type;
+  // what's hashed: a JPEG side's data, or an uncompressed side's cells
+  struct pagebuf *data;
+  float (*cells)[PHASH_SIZE];
+  // the rest is protected by sink->lock once the side is submitted
+  enum side_state state;
+  uint64_t hash;
+  // the earlier side this one matches most closely, or -1
+  int duplicate_of;
+  unsigned distance;
+};
+
+// Averages an image into PHASH_SIZE x PHASH_SIZE gray cells as it arrives, in
+// chunks which needn't end on a row. Bilevel data is WhiteIsZero, in the bit
+// order given by lsb_first; colour is reduced to its green channel, which is
+// close enough to luminance for comparing pages.
+struct reducer {
+  uint32_t width, height;
+  unsigned bpp, step;
+  int lsb_first;
+  size_t stride;
+  // the current row, and how much of it has arrived
+  uint32_t y;
+  size_t filled;
+  // a sampled row which arrives in more than one piece
+  uint8_t *row;
+  uint32_t sum[PHASH_SIZE][PHASH_SIZE];
+  uint32_t n[PHASH_SIZE][PHASH_SIZE];
+};
+
+struct phash_sink {
+  struct page_sink base;
+  struct page_sink *next;
+  struct phash_options options;
+  FILE *index;
+  struct workpool *pool;
+  // cos((2x + 1) u pi / 64), for the DCT
+  float cosine[PHASH_FREQUENCIES][PHASH_SIZE];
+  // the side being read, and its cells if it's being reduced
+  struct phash_side *current;
+  struct reducer reducer;
+  int reducing;
+  pthread_mutex_t lock;
+  struct phash_side **sides;
+  unsigned count, allocated;
+  // buffers which aren't in use
+  struct pagebuf *spare[PHASH_MAX_PENDING];
+  unsigned spares;
+  unsigned pending, skipped, duplicates;
+};
+
+static int reducer_start(struct reducer *r, uint32_t width, uint32_t height,
+                         unsigned bpp, int lsb_first) {
+  const size_t stride = ((size_t) width * bpp + 7) / 8;
+  uint8_t *row = realloc(r->row, stride ? stride : 1);
+
+  if (!row) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  r->row = row;
+  r->width = width;
+  r->height = height;
+  r->bpp = bpp;
+  r->lsb_first = lsb_first;
+  r->stride = stride;
+  // Every pixel of a small decode, but only every fourth row and column of a
+  // full-size side
+  r->step = width > 8 * PHASH_SIZE ? 4 : 1;
+  r->y = 0;
+  r->filled = 0;
+  memset(r->sum, 0, sizeof(r->sum));
+  memset(r->n, 0, sizeof(r->n));
+  return 0;
+}
+
+static void reduce_row(struct reducer *r, const uint8_t *row) {
+  uint32_t *sum_row = r->sum[(uint64_t) r->y * PHASH_SIZE / r->height];
+  uint32_t *n_row = r->n[(uint64_t) r->y * PHASH_SIZE / r->height];
+
+  for (uint32_t x = 0; x < r->width; x += r->step) {
+    const unsigned cell = (uint64_t) x * PHASH_SIZE / r->width;
+    unsigned gray;
+    if (r->bpp == 1)
+      gray = row[x >> 3] & (r->lsb_first ? 1 << (x & 7) : 0x80 >> (x & 7)) ?
+          0 : 255;
+    else if (r->bpp == 24)
+      gray = row[3 * x + 1];
+    else
+      gray = row[x];
+    sum_row[cell] += gray;
+    n_row[cell]++;
+  }
+}
+
+static void reducer_add(struct reducer *r, const uint8_t *data,
+                        size_t length) {
+  while (length && r->stride && r->y < r->height) {
+    size_t n = r->stride - r->filled;
+    if (n > length)
+      n = length;
+    if (r->y % r->step == 0) {
+      if (!r->filled && n == r->stride) {
+        reduce_row(r, data);
+      } else {
+        memcpy(r->row + r->filled, data, n);
+        if (r->filled + n == r->stride)
+          reduce_row(r, r->row);
+      }
+    }
+    data += n;
+    length -= n;
+    r->filled += n;
+    if (r->filled == r->stride) {
+      r->filled = 0;
+      r->y++;
+    }
+  }
+}
+
+// Cells which no pixels reached, e.g. below the end of a short side, are
+// white
+static void reducer_cells(const struct reducer *r,
+                          float cells[PHASH_SIZE][PHASH_SIZE]) {
+  for (int y = 0; y < PHASH_SIZE; y++)
+    for (int x = 0; x < PHASH_SIZE; x++)
+      cells[y][x] = r->n[y][x] ? (float) r->sum[y][x] / r->n[y][x] : 255;
+}
+
+// Put a buffer back on the spare list. Called with the lock held.
+static void release_buffer(struct phash_sink *s, struct pagebuf *buf) {
+  if (buf->allocated > PHASH_SPARE_SIZE)
+    pagebuf_free(buf);
+  else
+    pagebuf_reset(buf);
+  s->spare[s->spares++] = buf;
+}
+
+static int compare_floats(const void *a, const void *b) {
+  const float x = *(const float *) a, y = *(const float *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Hash a reduced image. Returns 0 if it's flat.
+static int hash_cells(const struct phash_sink *s,
+                      float cells[PHASH_SIZE][PHASH_SIZE], uint64_t *hash) {
+  float rows[PHASH_FREQUENCIES][PHASH_SIZE];
+  float dct[PHASH_FREQUENCIES * PHASH_FREQUENCIES];
+  float sorted[PHASH_FREQUENCIES * PHASH_FREQUENCIES];
+  double total = 0, squares = 0;
+
+  for (int y = 0; y < PHASH_SIZE; y++)
+    for (int x = 0; x < PHASH_SIZE; x++) {
+      total += cells[y][x];
+      squares += cells[y][x] * cells[y][x];
+    }
+  const double mean = total / (PHASH_SIZE * PHASH_SIZE);
+  if (squares / (PHASH_SIZE * PHASH_SIZE) - mean * mean <
+      PHASH_FLAT * PHASH_FLAT)
+    return 0;
+
+  // Only the lowest frequencies are needed, so the two passes of the DCT are
+  // done directly rather than with a fast transform
+  for (int u = 0; u < PHASH_FREQUENCIES; u++)
+    for (int y = 0; y < PHASH_SIZE; y++) {
+      float t = 0;
+      for (int x = 0; x < PHASH_SIZE; x++)
+        t += s->cosine[u][x] * cells[y][x];
+      rows[u][y] = t;
+    }
+  for (int v = 0; v < PHASH_FREQUENCIES; v++)
+    for (int u = 0; u < PHASH_FREQUENCIES; u++) {
+      float t = 0;
+      for (int y = 0; y < PHASH_SIZE; y++)
+        t += s->cosine[v][y] * rows[u][y];
+      dct[v * PHASH_FREQUENCIES + u] = t;
+    }
+
+  memcpy(sorted, dct, sizeof(dct));
+  qsort(sorted, PHASH_FREQUENCIES * PHASH_FREQUENCIES, sizeof(float),
+        compare_floats);
+  const float median = (sorted[31] + sorted[32]) / 2;
+  *hash = 0;
+  for (int i = 0; i < PHASH_FREQUENCIES * PHASH_FREQUENCIES; i++)
+    if (dct[i] > median)
+      *hash |= 1ull << i;
+  return 1;
+}
+
+// Compare a newly hashed side with the hashed sides in the window around it.
+// Called with the lock held.
+static void find_duplicates(struct phash_sink *s, struct phash_side *side) {
+  const unsigned window = s->options.window;
+  const unsigned first = side->index > window ? side->index - window : 0;
+
+  for (unsigned i = first; i < s->count && i <= side->index + window; i++) {
+    struct phash_side *other = s->sides[i];
+    if (other == side || other->state != SIDE_HASHED)
+      continue;
+    const unsigned distance = __builtin_popcountll(side->hash ^ other->hash);
+    if (distance > s->options.distance)
+      continue;
+    struct phash_side *earlier = i < side->index ? other : side;
+    struct phash_side *later = i < side->index ? side : other;
+    if (later->duplicate_of >= 0 && later->distance <= distance)
+      continue;
+    if (later->duplicate_of < 0)
+      s->duplicates++;
+    later->duplicate_of = earlier->index;
+    later->distance = distance;
+    fprintf(stderr, "page %d%s: looks like page %d%s again (%u bits "
+            "different)\n", later->page, later->side ? "B" : "A",
+            earlier->page, earlier->side ? "B" : "A", distance);
+  }
+}
+
+static void hash_side(struct workpool_task *task) {
+  struct phash_side *side = (struct phash_side *) task;
+  struct phash_sink *s = side->sink;
+  float cells[PHASH_SIZE][PHASH_SIZE];
+  enum side_state state = SIDE_UNHASHED;
+  uint64_t hash = 0;
+
+  if (side->cells) {
+    memcpy(cells, side->cells, sizeof(cells));
+    state = SIDE_FLAT;
+  } else {
+    struct reducer r = { .row = NULL };
+    uint8_t *pixels;
+    unsigned width, height;
+    if (jpeg_decode_small(side->data->data, side->data->length, &pixels,
+                          &width, &height)) {
+      fprintf(stderr, "page %d%s: can't decode to hash\n", side->page,
+              side->side ? "B" : "A");
+    } else {
+      if (!reducer_start(&r, width, height, 8, 0)) {
+        reducer_add(&r, pixels, (size_t) width * height);
+        reducer_cells(&r, cells);
+        state = SIDE_FLAT;
+      }
+      free(r.row);
+      free(pixels);
+    }
+  }
+  if (state == SIDE_FLAT && hash_cells(s, cells, &hash))
+    state = SIDE_HASHED;
+
+  pthread_mutex_lock(&s->lock);
+  side->state = state;
+  side->hash = hash;
+  if (state == SIDE_HASHED)
+    find_duplicates(s, side);
+  if (side->data)
+    release_buffer(s, side->data);
+  side->data = NULL;
+  free(side->cells);
+  side->cells = NULL;
+  s->pending--;
+  pthread_mutex_unlock(&s->lock);
+}
+
+static int phash_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct phash_sink *s = (struct phash_sink *) sink;
+  struct phash_side *side = calloc(1, sizeof(struct phash_side));
+
+  if (!side) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return 1;
+  }
+  side->task.run = hash_side;
+  side->sink = s;
+  side->page = info->page;
+  side->side = info->side;
+  side->compression_type = info->compression_type;
+  side->duplicate_of = -1;
+  const unsigned bpp = info->window->bpp;
+  s->reducing = !info->compression_type &&
+      (bpp == 1 || bpp == 8 || bpp == 24) &&
+      !reducer_start(&s->reducer, info->width, info->height, bpp,
+                     !info->window->bit_ordering);
+
+  pthread_mutex_lock(&s->lock);
+  if (s->count == s->allocated) {
+    const unsigned allocated = s->allocated ? 2 * s->allocated : 64;
+    struct phash_side **sides = realloc(s->sides,
+                                        allocated * sizeof(*sides));
+    if (!sides) {
+      pthread_mutex_unlock(&s->lock);
+      fprintf(stderr, "Memory allocation failed!\n");
+      free(side);
+      return 1;
+    }
+    s->sides = sides;
+    s->allocated = allocated;
+  }
+  side->index = s->count;
+  s->sides[s->count++] = side;
+  const int jpeg = KVS3105_IS_JPEG(side->compression_type);
+  if (jpeg && s->spares) {
+    side->data = s->spare[--s->spares];
+    s->pending++;
+  } else if (jpeg) {
+    s->skipped++;
+    fprintf(stderr, "page %d%s: hashing is %u sides behind, skipping this "
+            "one\n", side->page, side->side ? "B" : "A", s->pending);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  s->current = side;
+  return s->next->begin_page(s->next, info);
+}
+
+static int phash_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct phash_sink *s = (struct phash_sink *) sink;
+  struct phash_side *side = s->current;
+
+  if (s->reducing)
+    reducer_add(&s->reducer, data, length);
+  if (side->data && pagebuf_append(side->data, data, length)) {
+    // Give up hashing this side rather than the page
+    pthread_mutex_lock(&s->lock);
+    release_buffer(s, side->data);
+    s->pending--;
+    pthread_mutex_unlock(&s->lock);
+    side->data = NULL;
+  }
+  return s->next->write(s->next, data, length);
+}
+
+static int phash_end_page(struct page_sink *sink) {
+  struct phash_sink *s = (struct phash_sink *) sink;
+  struct phash_side *side = s->current;
+
+  s->current = NULL;
+  if (s->reducing) {
+    s->reducing = 0;
+    side->cells = malloc(sizeof(float[PHASH_SIZE][PHASH_SIZE]));
+    if (side->cells)
+      reducer_cells(&s->reducer, side->cells);
+  }
+  if (side->data || side->cells) {
+    pthread_mutex_lock(&s->lock);
+    side->state = SIDE_PENDING;
+    if (side->cells)
+      s->pending++;
+    pthread_mutex_unlock(&s->lock);
+    workpool_submit(s->pool, &side->task);
+  }
+  return s->next->end_page(s->next);
+}
+
+static uint8_t *phash_get_buffer(struct page_sink *sink) {
+  struct phash_sink *s = (struct phash_sink *) sink;
+  return s->next->get_buffer(s->next);
+}
+
+static int write_index(struct phash_sink *s) {
+  FILE *f = s->index;
+
+  s->index = NULL;
+  for (unsigned i = 0; i < s->count; i++) {
+    const struct phash_side *side = s->sides[i];
+    fprintf(f, "%u %c ", side->page, side->side ? 'B' : 'A');
+    if (side->state == SIDE_HASHED)
+      fprintf(f, "%016llx", (unsigned long long) side->hash);
+    else
+      fprintf(f, "%s", side->state == SIDE_FLAT ? "flat" : "-");
+    if (side->duplicate_of >= 0) {
+      const struct phash_side *other = s->sides[side->duplicate_of];
+      fprintf(f, " %u%c %u\n", other->page, other->side ? 'B' : 'A',
+              side->distance);
+    } else {
+      fprintf(f, " - -\n");
+    }
+  }
+  if (fclose(f)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->options.index,
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static void free_sink(struct phash_sink *s) {
+  for (unsigned i = 0; i < s->count; i++)
+    free(s->sides[i]);
+  for (unsigned i = 0; i < s->spares; i++) {
+    pagebuf_free(s->spare[i]);
+    free(s->spare[i]);
+  }
+  free(s->sides);
+  free(s->reducer.row);
+  if (s->index)
+    fclose(s->index);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+static int phash_close(struct page_sink *sink) {
+  struct phash_sink *s = (struct phash_sink *) sink;
+  int r = s->next->close(s->next);
+
+  // A side that was being read when the job stopped was never submitted
+  if (s->current && s->current->data) {
+    release_buffer(s, s->current->data);
+    s->current->data = NULL;
+  }
+  workpool_free(s->pool);
+  if (write_index(s))
+    r = 1;
+  fprintf(stderr, "%u possible duplicate sides", s->duplicates);
+  if (s->skipped)
+    fprintf(stderr, ", %u sides not hashed to keep up", s->skipped);
+  fprintf(stderr, "\n");
+  free_sink(s);
+  return r;
+}
+
+struct page_sink *phash_sink_new(struct page_sink *next,
+                                 const struct phash_options *options) {
+  struct phash_sink *s = calloc(1, sizeof(struct phash_sink));
+  if (!s) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  s->index = fopen(options->index, "w");
+  if (!s->index) {
+    fprintf(stderr, "Failed to open %s: %s\n", options->index,
+            strerror(errno));
+    free_sink(s);
+    return NULL;
+  }
+  fprintf(s->index, "# page side phash duplicate_of distance\n");
+  for (; s->spares < PHASH_MAX_PENDING; s->spares++) {
+    s->spare[s->spares] = calloc(1, sizeof(struct pagebuf));
+    if (!s->spare[s->spares]) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      free_sink(s);
+      return NULL;
+    }
+  }
+  s->pool = workpool_new(options->threads);
+  if (!s->pool) {
+    free_sink(s);
+    return NULL;
+  }
+  for (int u = 0; u < PHASH_FREQUENCIES; u++)
+    for (int x = 0; x < PHASH_SIZE; x++)
+      s->cosine[u][x] = cos((2 * x + 1) * u * M_PI / (2 * PHASH_SIZE));
+  s->base.begin_page = phash_begin_page;
+  s->base.write = phash_write;
+  s->base.end_page = phash_end_page;
+  s->base.get_buffer = next->get_buffer ? phash_get_buffer : NULL;
+  s->base.close = phash_close;
+  s->next = next;
+  s->options = *options;
+  return &s->base;
+}
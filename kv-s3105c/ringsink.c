@@ -0,0 +1,98 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Shared-memory ring output. Every chunk is published as soon as it has been
+// read; see kvring.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sink.h"
+#include "kvring.h"
+
+#define RING_SINK_CAPACITY (16 << 20)
+
+struct ring_sink {
+  struct page_sink base;
+  struct kvring *ring;
+  // the page fields of the current side, repeated in each record
+  struct kvring_record record;
+  unsigned done;
+};
+
+static int put(struct ring_sink *s, uint32_t type, const uint8_t *data,
+               unsigned length) {
+  s->record.type = type;
+  s->record.length = length;
+  return kvring_write(s->ring, &s->record, data);
+}
+
+static int ring_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct ring_sink *s = (struct ring_sink *) sink;
+
+  memset(&s->record, 0, sizeof(s->record));
+  s->record.page = info->page;
+  s->record.side = info->side;
+  s->record.compression_type = info->compression_type;
+  s->record.width = info->width;
+  s->record.height = info->height;
+  s->done = 0;
+  return put(s, KVRING_PAGE_START, NULL, 0);
+}
+
+static int ring_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct ring_sink *s = (struct ring_sink *) sink;
+  s->done += length;
+  return put(s, KVRING_CHUNK, data, length);
+}
+
+static int ring_end_page(struct page_sink *sink) {
+  struct ring_sink *s = (struct ring_sink *) sink;
+
+  fprintf(stderr, "ring: page %d%s: %u bytes\n", s->record.page,
+          s->record.side ? "B" : "A", s->done);
+  return put(s, KVRING_PAGE_END, NULL, 0);
+}
+
+static int ring_close(struct page_sink *sink) {
+  struct ring_sink *s = (struct ring_sink *) sink;
+
+  kvring_close(s->ring);
+  free(s);
+  return 0;
+}
+
+struct page_sink *ring_sink_new(const char *name) {
+  struct ring_sink *s = calloc(1, sizeof(struct ring_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = ring_begin_page;
+  s->base.write = ring_write;
+  s->base.end_page = ring_end_page;
+  s->base.close = ring_close;
+  s->ring = kvring_create(name, RING_SINK_CAPACITY, KVRING_BLOCK);
+  if (!s->ring) {
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
+
+void ring_sink_overwrite(struct page_sink *sink) {
+  struct ring_sink *s = (struct ring_sink *) sink;
+  kvring_set_policy(s->ring, KVRING_OVERWRITE);
+}
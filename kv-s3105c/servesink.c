@@ -0,0 +1,271 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Local page server: each side goes into a sealed memfd which is passed to
+// every connected client. See kvserve.h for the protocol.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sink.h"
+#include "kvserve.h"
+
+#define MAX_CLIENTS 16
+
+struct serve_sink {
+  struct page_sink base;
+  char *path;
+  int listen_fd;
+  int clients[MAX_CLIENTS];
+  unsigned num_clients;
+  // the memfd of the current side
+  int memfd;
+  struct kvserve_message message;
+  unsigned pages;
+  // set by serve_sink_finish: the job succeeded, so close sends the end
+  int finished;
+  // the socket file bound at path, so that close only removes that
+  dev_t dev;
+  ino_t ino;
+};
+
+// Take any connections which are waiting
+static void accept_clients(struct serve_sink *s) {
+  for (;;) {
+    const int fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    if (s->num_clients == MAX_CLIENTS) {
+      fprintf(stderr, "%s: too many clients\n", s->path);
+      close(fd);
+      continue;
+    }
+    s->clients[s->num_clients++] = fd;
+    fprintf(stderr, "%s: client connected (%u)\n", s->path, s->num_clients);
+  }
+}
+
+static void drop_client(struct serve_sink *s, unsigned i, const char *why) {
+  fprintf(stderr, "%s: dropping client: %s\n", s->path, why);
+  close(s->clients[i]);
+  s->clients[i] = s->clients[--s->num_clients];
+}
+
+// Send the message to every client, with fd attached if it isn't -1
+static void broadcast(struct serve_sink *s, int fd) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = { &s->message, sizeof(s->message) };
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  for (unsigned i = 0; i < s->num_clients;) {
+    ssize_t n;
+    do {
+      n = sendmsg(s->clients[i], &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      drop_client(s, i, errno == EAGAIN ? "not keeping up" : strerror(errno));
+      continue;
+    }
+    i++;
+  }
+}
+
+static int serve_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct serve_sink *s = (struct serve_sink *) sink;
+
+  accept_clients(s);
+  s->memfd = memfd_create("kvs3105-page", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (s->memfd < 0) {
+    fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  memset(&s->message, 0, sizeof(s->message));
+  memcpy(s->message.magic, KVSERVE_PAGE_MAGIC, 4);
+  s->message.page = info->page;
+  s->message.side = info->side;
+  s->message.compression_type = info->compression_type;
+  s->message.width = info->width;
+  s->message.height = info->height;
+  s->message.xres = KVS3105_XRES(info->window);
+  s->message.yres = KVS3105_YRES(info->window);
+  return 0;
+}
+
+static int serve_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct serve_sink *s = (struct serve_sink *) sink;
+
+  while (length) {
+    const ssize_t written = write(s->memfd, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to memfd: %s\n", strerror(errno));
+      return 1;
+    }
+    s->message.length += written;
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+static int serve_end_page(struct page_sink *sink) {
+  struct serve_sink *s = (struct serve_sink *) sink;
+
+  if (fcntl(s->memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+    fprintf(stderr, "Failed to seal memfd: %s\n", strerror(errno));
+    close(s->memfd);
+    s->memfd = -1;
+    return 1;
+  }
+  accept_clients(s);
+  broadcast(s, s->memfd);
+  // The clients have their own references now
+  close(s->memfd);
+  s->memfd = -1;
+  s->pages++;
+
+  fprintf(stderr, "%s: page %d%s: %llu bytes to %u clients\n", s->path,
+          s->message.page, s->message.side ? "B" : "A",
+          (unsigned long long) s->message.length, s->num_clients);
+  return 0;
+}
+
+static int serve_close(struct page_sink *sink) {
+  struct serve_sink *s = (struct serve_sink *) sink;
+
+  if (s->memfd >= 0)
+    close(s->memfd);
+  if (s->finished) {
+    memset(&s->message, 0, sizeof(s->message));
+    memcpy(s->message.magic, KVSERVE_END_MAGIC, 4);
+    s->message.length = s->pages;
+    broadcast(s, -1);
+  }
+  for (unsigned i = 0; i < s->num_clients; i++)
+    close(s->clients[i]);
+
+  close(s->listen_fd);
+  struct stat st;
+  if (!lstat(s->path, &st) && S_ISSOCK(st.st_mode) && st.st_dev == s->dev &&
+      st.st_ino == s->ino)
+    unlink(s->path);
+  free(s->path);
+  free(s);
+  return 0;
+}
+
+void serve_sink_finish(struct page_sink *sink) {
+  ((struct serve_sink *) sink)->finished = 1;
+}
+
+int serve_sink_wait(struct page_sink *sink, unsigned clients) {
+  struct serve_sink *s = (struct serve_sink *) sink;
+
+  if (s->num_clients < clients) {
+    fprintf(stderr, "%s: waiting for %u clients\n", s->path,
+            clients - s->num_clients);
+  }
+  while (s->num_clients < clients) {
+    struct pollfd pfd = { .fd = s->listen_fd, .events = POLLIN };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      return 1;
+    }
+    accept_clients(s);
+  }
+  return 0;
+}
+
+struct page_sink *serve_sink_new(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return NULL;
+  }
+  // A socket left behind by an earlier run would make bind fail, but
+  // anything else at path is the user's
+  if (!lstat(path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and isn't a socket\n", path);
+      return NULL;
+    }
+    unlink(path);
+  }
+  struct serve_sink *s = calloc(1, sizeof(struct serve_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = serve_begin_page;
+  s->base.write = serve_write;
+  s->base.end_page = serve_end_page;
+  s->base.close = serve_close;
+  s->memfd = -1;
+  s->path = strdup(path);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  s->listen_fd = socket(AF_UNIX,
+                        SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s->listen_fd < 0 ||
+      bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      listen(s->listen_fd, MAX_CLIENTS)) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    if (s->listen_fd >= 0)
+      close(s->listen_fd);
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+  if (!lstat(path, &st)) {
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+  }
+  fprintf(stderr, "Serving pages on %s\n", path);
+  return &s->base;
+}
@@ -0,0 +1,30 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Helpers shared by the sinks. See sink.h.
+
+#include "sink.h"
+
+int page_sink_write(struct page_sink *next, const uint8_t *data,
+                    size_t length) {
+  while (length) {
+    const unsigned piece = length < KVS3105_BUFFER_SIZE ?
+        length : KVS3105_BUFFER_SIZE;
+    if (next->write(next, data, piece))
+      return 1;
+    data += piece;
+    length -= piece;
+  }
+  return 0;
+}
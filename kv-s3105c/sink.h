@@ -0,0 +1,290 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Output sinks for kvscanner.
+//
+// kvscanner hands each side of each page to a sink as it streams off the
+// scanner: begin_page once the size is known, write for every chunk that
+// kvs3105_read_data returns and end_page after the last one. A sink decides
+// where the bytes go (a file per side, a multi-page container, a pipe...).
+// Like a chunk, a write is never more than KVS3105_BUFFER_SIZE bytes: sinks
+// which pass on data of their own use page_sink_write to split it.
+//
+// Like the rest of this code, the functions return 0 on success and non-zero
+// on error, having printed a message to stderr.
+
+#ifndef THIRD_PARTY_KVS3105USB_SINK_H_
+#define THIRD_PARTY_KVS3105USB_SINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs3105usb.h"
+
+struct page_info {
+  // page number, counting from the first page given on the command line
+  unsigned page;
+  // 0 -> front, 1 -> back
+  int side;
+  // dimensions in pixels, from kvs3105_picture_size
+  uint32_t width, height;
+  // compression of the bytes passed to write (see kvs3105_window)
+  uint8_t compression_type;
+  // the settings the page was scanned with
+  const struct kvs3105_window *window;
+  // roughly how many bytes the side will be: what the scanner has buffered,
+  // or a guess from the window. Only exact for uncompressed data.
+  uint32_t size_hint;
+};
+
+struct page_sink {
+  int (*begin_page)(struct page_sink *sink, const struct page_info *info);
+  int (*write)(struct page_sink *sink, const uint8_t *data, unsigned length);
+  int (*end_page)(struct page_sink *sink);
+  // Optional: return a buffer of KVS3105_BUFFER_SIZE bytes to read the next
+  // chunk into, or NULL on error. Sinks which provide buffers can hand the
+  // chunk on to the kernel in write rather than copy it.
+  uint8_t *(*get_buffer)(struct page_sink *sink);
+  // Finish the job and free the sink. This is also called after an error so
+  // that the pages which were completed are kept.
+  int (*close)(struct page_sink *sink);
+};
+
+// -----------------------------------------------------------------------------
+// Pass length bytes on to next's write in pieces of at most
+// KVS3105_BUFFER_SIZE bytes.
+// -----------------------------------------------------------------------------
+int page_sink_write(struct page_sink *next, const uint8_t *data,
+                    size_t length);
+
+// -----------------------------------------------------------------------------
+// Write each side to its own file, named <filebase>-<page>-<A|B>.jpeg, or
+// everything back-to-back to stdout if filebase is NULL.
+// -----------------------------------------------------------------------------
+struct page_sink *file_sink_new(const char *filebase);
+
+// -----------------------------------------------------------------------------
+// Make a file sink read into pooled buffers and pass them to the output with
+// vmsplice (or splice, for files) rather than copying them. See zcopy.h.
+// -----------------------------------------------------------------------------
+int file_sink_use_zero_copy(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Write the same files as file_sink_new, but asynchronously with io_uring:
+// each side is opened, written, fsynced and closed in the background while
+// the following pages are scanned.
+// -----------------------------------------------------------------------------
+struct page_sink *uring_sink_new(const char *filebase);
+
+// -----------------------------------------------------------------------------
+// Make a file sink publish each side under its name only once it's complete
+// and on disk. Completed sides are synced and published together once
+// commit_pages of them are waiting or commit_ms has passed since the first,
+// and at the end of the job.
+// -----------------------------------------------------------------------------
+int file_sink_use_atomic(struct page_sink *sink, unsigned commit_pages,
+                         unsigned commit_ms);
+
+// -----------------------------------------------------------------------------
+// Make a file sink fallocate each file from the page's size hint, collect the
+// side in memory and write it with a single pwrite, then truncate it to size.
+// This keeps files in one extent on filesystems which fragment them when
+// they're extended 64KB at a time.
+// -----------------------------------------------------------------------------
+int file_sink_use_preallocate(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Make a file sink count the write calls it makes and, before closing each
+// file, its extents (FIEMAP), and print the averages per side at the end.
+// -----------------------------------------------------------------------------
+void file_sink_count_io(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Write all sides to a single multi-page TIFF file. The scanner's CCITT (MH,
+// MR and MMR) or uncompressed data is wrapped as-is, without re-encoding.
+// -----------------------------------------------------------------------------
+struct page_sink *tiff_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Write all sides to a single PDF file, or to stdout if path is NULL. JPEG and
+// CCITT data from the scanner is embedded as-is.
+// -----------------------------------------------------------------------------
+struct page_sink *pdf_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Append all sides to a single packed archive, indexed at the end. See
+// kvarchive.h.
+// -----------------------------------------------------------------------------
+struct page_sink *archive_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Write each side with a length-prefixed header, and a trailer at the end of
+// the job, to path or to stdout if path is NULL. See kvframe.h.
+// -----------------------------------------------------------------------------
+struct page_sink *frame_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Mark the job written to a frame sink as complete, so that closing it writes
+// the trailer. Without this the stream ends after the last page.
+// -----------------------------------------------------------------------------
+void frame_sink_finish(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Listen on a Unix domain socket at path and pass each side, as a sealed
+// memfd, to every client connected at the time. See kvserve.h.
+// -----------------------------------------------------------------------------
+struct page_sink *serve_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Wait until a serve sink has at least the given number of clients.
+// -----------------------------------------------------------------------------
+int serve_sink_wait(struct page_sink *sink, unsigned clients);
+
+// -----------------------------------------------------------------------------
+// Mark the job served by a serve sink as complete, so that closing it sends
+// the end message. Without this the clients just see the socket close.
+// -----------------------------------------------------------------------------
+void serve_sink_finish(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Publish every chunk into the shared-memory ring kvs3105-ring-<name> as soon
+// as it's read. The producer waits for consumers which fall 16MB behind. See
+// kvring.h.
+// -----------------------------------------------------------------------------
+struct page_sink *ring_sink_new(const char *name);
+
+// -----------------------------------------------------------------------------
+// Make a ring sink overwrite data that slow consumers haven't read, rather
+// than wait for them.
+// -----------------------------------------------------------------------------
+void ring_sink_overwrite(struct page_sink *sink);
+
+// -----------------------------------------------------------------------------
+// Compress each side of an uncompressed scan as a zstd frame in a single file,
+// or to stdout if path is NULL, with tables for finding each side at the end.
+// See kvzstd.h.
+// -----------------------------------------------------------------------------
+struct page_sink *zstd_sink_new(const char *path);
+
+// -----------------------------------------------------------------------------
+// Set the compression level of a zstd sink (0 for zstd's default, 3), and the
+// number of worker threads: 0 to compress in the reading thread, or -1 (the
+// default) for one per CPU.
+// -----------------------------------------------------------------------------
+int zstd_sink_configure(struct page_sink *sink, int level, int threads);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, encoding uncompressed binary sides with Group 4
+// on a pool of threads worker threads (0 for one per CPU) so that next sees
+// compression_type 3, as if the scanner had done it. Other sides pass through
+// unchanged. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *g4_sink_new(struct page_sink *next, unsigned threads);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, encoding uncompressed gray and colour sides as
+// baseline JPEG at the given quality, a strip at a time on a pool of threads
+// worker threads (0 for one per CPU), so that next sees compression_type
+// 0x81. Other sides pass through unchanged. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *jpeg_encode_sink_new(struct page_sink *next, int quality,
+                                       unsigned threads);
+
+struct blank_options {
+  // drop blank sides, rather than just report them
+  int drop;
+  // pixels darker than this (0-255) are ink
+  unsigned level;
+  // a side with less than this fraction of ink pixels is blank
+  double ink;
+  // compressed sides of more than this many bytes per megapixel are never
+  // blank; 0 for the defaults (100000 for JPEG, 1500 for MH/MR/MMR)
+  unsigned size;
+  // if not NULL, where to write a CSV line about every side
+  const char *report;
+};
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, looking for blank ones and reporting or
+// dropping them. When dropping, each side only reaches next once it has been
+// read completely. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *blank_sink_new(struct page_sink *next,
+                                 const struct blank_options *options);
+
+struct phash_options {
+  // where to write the hash of every side, at the end of the job
+  const char *index;
+  // how many sides before and after each side to compare it with
+  unsigned window;
+  // hashes at most this many bits apart are reported as duplicates
+  unsigned distance;
+  // worker threads for hashing, 0 for one per CPU
+  unsigned threads;
+};
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, computing a perceptual hash of each JPEG or
+// uncompressed side on a pool of worker threads, and reporting sides which
+// look like one shortly before them. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *phash_sink_new(struct page_sink *next,
+                                 const struct phash_options *options);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, applying ops (BITOPS_REVERSE, BITOPS_INVERT and
+// BITOPS_MIRROR, see bitops.h) to uncompressed binary ones. Other sides pass
+// through unchanged. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *layout_sink_new(struct page_sink *next, unsigned ops);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, checking the structure of JPEG sides on the way
+// (see jpegcheck.h). Bad sides are reported as they finish, and still passed
+// on; close fails if there were any. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *check_sink_new(struct page_sink *next);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, hashing it on the way with CRC-32C and BLAKE3.
+// A line of page, side, length and the two digests in hex is added to the
+// manifest at path as each side finishes. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *hash_sink_new(struct page_sink *next, const char *path);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next encrypted with AES-256-GCM, using the key in
+// key_path (32 bytes, or 64 hex digits). The nonce and tag of each side are
+// listed in the index at index_path. Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *crypt_sink_new(struct page_sink *next, const char *key_path,
+                                 const char *index_path);
+
+// -----------------------------------------------------------------------------
+// Pass every side on to next, replacing the APP0 and APP1 segments of JPEG
+// sides with JFIF giving the resolution and EXIF giving the scan time, page,
+// side and scanner (make, model and serial number), without re-encoding.
+// Closing this sink closes next.
+// -----------------------------------------------------------------------------
+struct page_sink *meta_sink_new(struct page_sink *next,
+                                const struct kvs3105_identity *identity);
+
+// Whether a compression type (see kvs3105_window) is JPEG
+#define KVS3105_IS_JPEG(type) ((type) == 4 || (type) == 0x81)
+
+// The resolution a window actually scans at, in dots per inch
+#define KVS3105_XRES(w) ((w)->xres ? (w)->xres : 400)
+#define KVS3105_YRES(w) ((w)->yres ? (w)->yres : 400)
+
+#endif  // THIRD_PARTY_KVS3105USB_SINK_H_
@@ -0,0 +1,285 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Multi-page TIFF output.
+//
+// Each side becomes one TIFF page holding a single strip. The strip is the
+// scanner's data exactly as it was read: the device's MH/MR/MMR encoders
+// produce the same bitstreams that TIFF calls T.4 and T.6, so there's no need
+// to decode anything. The file is written front to back: the strip is
+// streamed out as it arrives, then the page's IFD is appended after it and the
+// previous IFD (or the header) is patched to point at it. If the scan stops
+// half way the file still holds every completed page.
+//
+// See the TIFF 6.0 specification, sections 2, 3, 8 and 11.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sink.h"
+
+enum {
+  TIFF_SHORT = 3,
+  TIFF_LONG = 4,
+  TIFF_RATIONAL = 5,
+};
+
+#define MAX_ENTRIES 20
+
+struct tiff_entry {
+  uint16_t tag, type;
+  uint32_t count;
+  uint8_t value[4];
+};
+
+struct tiff_sink {
+  struct page_sink base;
+  char *path;
+  int fd;
+  // the current end of the file
+  uint64_t offset;
+  // the file offset of the "next IFD" pointer to patch for the next page
+  uint32_t next_ifd_link;
+  struct page_info info;
+  uint32_t strip_offset, strip_bytes;
+  unsigned pages;
+};
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static int write_all(struct tiff_sink *s, const uint8_t *data, size_t length) {
+  if (s->offset + length > 0xffffffffu) {
+    fprintf(stderr, "%s: TIFF files are limited to 4GB\n", s->path);
+    return 1;
+  }
+  while (length) {
+    const ssize_t n = write(s->fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->path,
+              strerror(errno));
+      return 1;
+    }
+    s->offset += n;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static int tiff_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct tiff_sink *s = (struct tiff_sink *) sink;
+
+  if (info->compression_type > 3) {
+    fprintf(stderr, "%s: TIFF output needs uncompressed, MH, MR or MMR "
+            "data, not compression type 0x%x\n", s->path,
+            info->compression_type);
+    return 1;
+  }
+  if (info->compression_type && info->window->bpp != 1) {
+    fprintf(stderr, "%s: CCITT compression needs a binary scan\n", s->path);
+    return 1;
+  }
+
+  s->info = *info;
+  s->strip_offset = s->offset;
+  s->strip_bytes = 0;
+  return 0;
+}
+
+static int tiff_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct tiff_sink *s = (struct tiff_sink *) sink;
+
+  s->strip_bytes += length;
+  return write_all(s, data, length);
+}
+
+static void add_entry(struct tiff_entry *entries, unsigned *n, uint16_t tag,
+                      uint16_t type, uint32_t count, uint32_t value) {
+  struct tiff_entry *e = &entries[(*n)++];
+  e->tag = tag;
+  e->type = type;
+  e->count = count;
+  memset(e->value, 0, sizeof(e->value));
+  if (type == TIFF_SHORT && count == 1)
+    put16(e->value, value);
+  else
+    put32(e->value, value);
+}
+
+static int tiff_end_page(struct page_sink *sink) {
+  struct tiff_sink *s = (struct tiff_sink *) sink;
+  const struct kvs3105_window *w = s->info.window;
+  struct tiff_entry entries[MAX_ENTRIES];
+  unsigned n = 0;
+
+  // IFDs must start on a word boundary
+  if (s->offset & 1) {
+    static const uint8_t zero = 0;
+    if (write_all(s, &zero, 1))
+      return 1;
+  }
+
+  const int samples = w->bpp == 24 ? 3 : 1;
+  unsigned entry_count = 15 + (samples == 3) +
+      (s->info.compression_type ? 1 : 0);
+  const uint32_t ifd_offset = s->offset;
+  // Values which don't fit in an entry follow the IFD
+  const uint32_t extra_offset = ifd_offset + 2 + entry_count * 12 + 4;
+  const uint32_t xres_offset = extra_offset;
+  const uint32_t yres_offset = extra_offset + 8;
+  const uint32_t bps_offset = extra_offset + 16;
+
+  static const uint16_t compression_tags[] = { 1, 3, 3, 4 };
+  const uint8_t ctype = s->info.compression_type;
+
+  // These must be in ascending tag order
+  add_entry(entries, &n, 254, TIFF_LONG, 1, 2);  // NewSubfileType: page
+  add_entry(entries, &n, 256, TIFF_LONG, 1, s->info.width);
+  add_entry(entries, &n, 257, TIFF_LONG, 1, s->info.height);
+  if (samples == 3)
+    add_entry(entries, &n, 258, TIFF_SHORT, 3, bps_offset);
+  else
+    add_entry(entries, &n, 258, TIFF_SHORT, 1, w->bpp);
+  add_entry(entries, &n, 259, TIFF_SHORT, 1, compression_tags[ctype]);
+  // PhotometricInterpretation: WhiteIsZero for bilevel, as fax data is,
+  // BlackIsZero for grayscale, otherwise RGB
+  add_entry(entries, &n, 262, TIFF_SHORT, 1,
+            w->bpp == 1 ? 0 : samples == 3 ? 2 : 1);
+  // FillOrder: bit_ordering only applies to uncompressed data
+  add_entry(entries, &n, 266, TIFF_SHORT, 1,
+            !ctype && w->bpp == 1 && !w->bit_ordering ? 2 : 1);
+  add_entry(entries, &n, 273, TIFF_LONG, 1, s->strip_offset);
+  add_entry(entries, &n, 277, TIFF_SHORT, 1, samples);
+  add_entry(entries, &n, 278, TIFF_LONG, 1, s->info.height);
+  add_entry(entries, &n, 279, TIFF_LONG, 1, s->strip_bytes);
+  add_entry(entries, &n, 282, TIFF_RATIONAL, 1, xres_offset);
+  add_entry(entries, &n, 283, TIFF_RATIONAL, 1, yres_offset);
+  if (samples == 3)
+    add_entry(entries, &n, 284, TIFF_SHORT, 1, 1);  // PlanarConfiguration
+  if (ctype == 1 || ctype == 2)
+    add_entry(entries, &n, 292, TIFF_LONG, 1, ctype == 2);  // T4Options: 2D
+  else if (ctype == 3)
+    add_entry(entries, &n, 293, TIFF_LONG, 1, 0);  // T6Options
+  add_entry(entries, &n, 296, TIFF_SHORT, 1, 2);  // ResolutionUnit: inch
+  // PageNumber: this page, total unknown
+  add_entry(entries, &n, 297, TIFF_SHORT, 2, s->pages);
+  if (n != entry_count)
+    abort();
+
+  uint8_t ifd[2 + MAX_ENTRIES * 12 + 4 + 22];
+  uint8_t *p = ifd;
+  put16(p, n);
+  p += 2;
+  for (unsigned i = 0; i < n; i++) {
+    put16(p, entries[i].tag);
+    put16(p + 2, entries[i].type);
+    put32(p + 4, entries[i].count);
+    memcpy(p + 8, entries[i].value, 4);
+    p += 12;
+  }
+  put32(p, 0);  // no next IFD, yet
+  p += 4;
+  put32(p, KVS3105_XRES(w));
+  put32(p + 4, 1);
+  put32(p + 8, KVS3105_YRES(w));
+  put32(p + 12, 1);
+  p += 16;
+  if (samples == 3) {
+    put16(p, 8);
+    put16(p + 2, 8);
+    put16(p + 4, 8);
+    p += 6;
+  }
+
+  if (write_all(s, ifd, p - ifd))
+    return 1;
+
+  // Only now that the IFD is complete is it linked into the file
+  uint8_t link[4];
+  put32(link, ifd_offset);
+  if (pwrite(s->fd, link, 4, s->next_ifd_link) != 4) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    return 1;
+  }
+  s->next_ifd_link = ifd_offset + 2 + n * 12;
+  s->pages++;
+
+  fprintf(stderr, "%s: page %d%s: %u bytes\n", s->path, s->info.page,
+          s->info.side ? "B" : "A", s->strip_bytes);
+  return 0;
+}
+
+static int tiff_close(struct page_sink *sink) {
+  struct tiff_sink *s = (struct tiff_sink *) sink;
+  int r = 0;
+
+  // Any partial strip after the last IFD is simply unreferenced
+  if (close(s->fd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  fprintf(stderr, "%s: %u pages\n", s->path, s->pages);
+  free(s->path);
+  free(s);
+  return r;
+}
+
+struct page_sink *tiff_sink_new(const char *path) {
+  struct tiff_sink *s = calloc(1, sizeof(struct tiff_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = tiff_begin_page;
+  s->base.write = tiff_write;
+  s->base.end_page = tiff_end_page;
+  s->base.close = tiff_close;
+  s->path = strdup(path);
+  s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (s->fd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+
+  // Little endian header. The first IFD offset is filled in by the first page
+  static const uint8_t header[8] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+  s->next_ifd_link = 4;
+  if (write_all(s, header, sizeof(header))) {
+    close(s->fd);
+    free(s->path);
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
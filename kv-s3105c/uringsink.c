@@ -0,0 +1,379 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Asynchronous per-side file output with io_uring.
+//
+// The files are the same as the jpeg sink's, but nothing is done to them on
+// the scanning thread. Each side is collected in memory and, once it's
+// complete, an openat, write, fsync and close are submitted as one linked
+// chain. The file is opened into a registered (direct) descriptor slot, so
+// the later operations can refer to it before the open has even run. On a
+// network filesystem the four round trips then overlap with scanning the
+// following pages.
+//
+// The chain is hard-linked, so the close always runs even if the write
+// fails. Each side in flight owns a slot and its buffer; when every slot is
+// busy, begin_page waits for the oldest to finish, which bounds memory use and
+// the queue depth.
+//
+// This talks to the kernel directly (Linux 5.15 or later) rather than through
+// liburing.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "sink.h"
+#include "pagebuf.h"
+
+// The number of sides which can be in flight at once
+#define URING_SLOTS 8
+#define OPS_PER_SIDE 4
+
+enum {
+  OP_OPEN,
+  OP_WRITE,
+  OP_FSYNC,
+  OP_CLOSE,
+};
+
+static const char *const op_names[OPS_PER_SIDE] = {
+  "open", "write", "fsync", "close",
+};
+
+struct ring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring_map;
+  size_t ring_map_size, sqes_size;
+};
+
+struct slot {
+  char *path;
+  struct pagebuf data;
+  // operations submitted but not yet completed
+  unsigned pending;
+  // the first operation which failed, and its error
+  int failed_op, failed_errno;
+};
+
+struct uring_sink {
+  struct page_sink base;
+  const char *filebase;
+  struct ring ring;
+  struct slot slots[URING_SLOTS];
+  // the slot being filled by the current side
+  struct slot *current;
+  int error;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int ring_init(struct ring *ring, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = io_uring_setup(entries, &p);
+  if (ring->fd < 0) {
+    fprintf(stderr, "io_uring_setup failed: %s\n", strerror(errno));
+    return 1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    fprintf(stderr, "This kernel's io_uring is too old\n");
+    close(ring->fd);
+    return 1;
+  }
+
+  // The submission and completion rings share one mapping
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+  if (ring->ring_map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map io_uring: %s\n", strerror(errno));
+    close(ring->fd);
+    return 1;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    fprintf(stderr, "Failed to map io_uring: %s\n", strerror(errno));
+    munmap(ring->ring_map, ring->ring_map_size);
+    close(ring->fd);
+    return 1;
+  }
+
+  uint8_t *base = ring->ring_map;
+  ring->sq_tail = (unsigned *) (base + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (base + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (base + p.sq_off.array);
+  ring->cq_head = (unsigned *) (base + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (base + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (base + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+  return 0;
+}
+
+static void ring_free(struct ring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring_map, ring->ring_map_size);
+  close(ring->fd);
+}
+
+// Return the next submission entry, cleared. The caller makes sure there's
+// room: there are never more than URING_SLOTS * OPS_PER_SIDE entries in use.
+static struct io_uring_sqe *next_sqe(struct ring *ring, unsigned *tail) {
+  const unsigned index = *tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  (*tail)++;
+  return sqe;
+}
+
+static void handle_completion(struct uring_sink *s,
+                              const struct io_uring_cqe *cqe) {
+  struct slot *slot = &s->slots[cqe->user_data / OPS_PER_SIDE];
+  const int op = cqe->user_data % OPS_PER_SIDE;
+
+  int err = 0;
+  if (cqe->res < 0)
+    err = -cqe->res;
+  else if (op == OP_WRITE && (size_t) cqe->res != slot->data.length)
+    err = EIO;  // a short write
+  if (err && slot->failed_op < 0) {
+    slot->failed_op = op;
+    slot->failed_errno = err;
+  }
+
+  if (--slot->pending)
+    return;
+  if (slot->failed_op >= 0) {
+    fprintf(stderr, "Failed to write to %s: %s: %s\n", slot->path,
+            op_names[slot->failed_op], strerror(slot->failed_errno));
+    s->error = 1;
+  } else {
+    fprintf(stderr, "%s: %zu bytes\n", slot->path, slot->data.length);
+  }
+}
+
+// Handle completions, waiting for at least min_complete of them
+static int reap(struct uring_sink *s, unsigned min_complete) {
+  struct ring *ring = &s->ring;
+
+  for (;;) {
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      handle_completion(s, &ring->cqes[head & *ring->cq_mask]);
+      if (min_complete)
+        min_complete--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (!min_complete)
+      return 0;
+
+    if (io_uring_enter(ring->fd, 0, min_complete, IORING_ENTER_GETEVENTS) <
+        0 && errno != EINTR) {
+      fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+}
+
+static int submit_side(struct uring_sink *s, struct slot *slot) {
+  struct ring *ring = &s->ring;
+  const unsigned index = slot - s->slots;
+  unsigned tail = *ring->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  sqe = next_sqe(ring, &tail);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->flags = IOSQE_IO_HARDLINK;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t) slot->path;
+  sqe->len = 0644;
+  sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  sqe->file_index = index + 1;
+  sqe->user_data = index * OPS_PER_SIDE + OP_OPEN;
+
+  sqe = next_sqe(ring, &tail);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+  sqe->fd = index;
+  sqe->addr = (uintptr_t) slot->data.data;
+  sqe->len = slot->data.length;
+  sqe->off = 0;
+  sqe->user_data = index * OPS_PER_SIDE + OP_WRITE;
+
+  sqe = next_sqe(ring, &tail);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+  sqe->fd = index;
+  sqe->user_data = index * OPS_PER_SIDE + OP_FSYNC;
+
+  sqe = next_sqe(ring, &tail);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->file_index = index + 1;
+  sqe->user_data = index * OPS_PER_SIDE + OP_CLOSE;
+
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  slot->pending = OPS_PER_SIDE;
+  slot->failed_op = -1;
+
+  unsigned to_submit = OPS_PER_SIDE;
+  while (to_submit) {
+    const int n = io_uring_enter(ring->fd, to_submit, 0, 0);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+      return 1;
+    }
+    to_submit -= n;
+  }
+  return 0;
+}
+
+static struct slot *free_slot(struct uring_sink *s) {
+  for (int i = 0; i < URING_SLOTS; i++) {
+    if (!s->slots[i].pending)
+      return &s->slots[i];
+  }
+  return NULL;
+}
+
+static int uring_begin_page(struct page_sink *sink,
+                            const struct page_info *info) {
+  struct uring_sink *s = (struct uring_sink *) sink;
+
+  // Pick up whatever has finished, and only wait if every slot is busy
+  if (reap(s, 0))
+    return 1;
+  while (!(s->current = free_slot(s))) {
+    if (reap(s, 1))
+      return 1;
+  }
+  if (s->error)
+    return 1;
+
+  struct slot *slot = s->current;
+  free(slot->path);
+  if (asprintf(&slot->path, "%s-%03d-%s.jpeg", s->filebase, info->page,
+               info->side ? "B" : "A") == -1) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    exit(1);
+  }
+  pagebuf_reset(&slot->data);
+  return 0;
+}
+
+static int uring_write(struct page_sink *sink, const uint8_t *data,
+                       unsigned length) {
+  struct uring_sink *s = (struct uring_sink *) sink;
+  return pagebuf_append(&s->current->data, data, length);
+}
+
+static int uring_end_page(struct page_sink *sink) {
+  struct uring_sink *s = (struct uring_sink *) sink;
+  struct slot *slot = s->current;
+
+  s->current = NULL;
+  if (submit_side(s, slot))
+    return 1;
+  if (reap(s, 0))
+    return 1;
+  return s->error;
+}
+
+static int uring_close(struct page_sink *sink) {
+  struct uring_sink *s = (struct uring_sink *) sink;
+  int r = 0;
+
+  // A side that was started but never finished is simply dropped
+  for (int i = 0; i < URING_SLOTS; i++) {
+    while (s->slots[i].pending) {
+      if (reap(s, 1)) {
+        r = 1;
+        break;
+      }
+    }
+  }
+  if (s->error)
+    r = 1;
+
+  ring_free(&s->ring);
+  for (int i = 0; i < URING_SLOTS; i++) {
+    free(s->slots[i].path);
+    pagebuf_free(&s->slots[i].data);
+  }
+  free(s);
+  return r;
+}
+
+struct page_sink *uring_sink_new(const char *filebase) {
+  struct uring_sink *s = calloc(1, sizeof(struct uring_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = uring_begin_page;
+  s->base.write = uring_write;
+  s->base.end_page = uring_end_page;
+  s->base.close = uring_close;
+  s->filebase = filebase;
+
+  if (ring_init(&s->ring, URING_SLOTS * OPS_PER_SIDE)) {
+    free(s);
+    return NULL;
+  }
+  // An empty table of direct descriptors for the files to be opened into
+  int files[URING_SLOTS];
+  for (int i = 0; i < URING_SLOTS; i++)
+    files[i] = -1;
+  if (io_uring_register(s->ring.fd, IORING_REGISTER_FILES, files,
+                        URING_SLOTS) < 0) {
+    fprintf(stderr, "Failed to register io_uring files: %s\n",
+            strerror(errno));
+    ring_free(&s->ring);
+    free(s);
+    return NULL;
+  }
+  return &s->base;
+}
@@ -0,0 +1,133 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workpool.h"
+
+#define WORKPOOL_MAX_THREADS 64
+
+struct workpool {
+  pthread_mutex_t lock;
+  // signalled when a task is queued, or the workers should stop
+  pthread_cond_t queued;
+  // signalled when the last outstanding task finishes
+  pthread_cond_t idle;
+  struct workpool_task *head, *tail;
+  // tasks queued or running
+  unsigned outstanding;
+  int stop;
+  unsigned threads;
+  pthread_t thread[WORKPOOL_MAX_THREADS];
+};
+
+static void *worker(void *arg) {
+  struct workpool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->head && !pool->stop)
+      pthread_cond_wait(&pool->queued, &pool->lock);
+    if (!pool->head)
+      break;
+    struct workpool_task *task = pool->head;
+    pool->head = task->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    task->run(task);
+
+    pthread_mutex_lock(&pool->lock);
+    if (!--pool->outstanding)
+      pthread_cond_broadcast(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct workpool *workpool_new(unsigned threads) {
+  struct workpool *pool;
+
+  if (!threads) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  if (threads > WORKPOOL_MAX_THREADS)
+    threads = WORKPOOL_MAX_THREADS;
+  pool = calloc(1, sizeof(struct workpool));
+  if (!pool) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->queued, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  for (; pool->threads < threads; pool->threads++) {
+    const int r = pthread_create(&pool->thread[pool->threads], NULL, worker,
+                                 pool);
+    if (r) {
+      fprintf(stderr, "Failed to start a worker thread: %s\n", strerror(r));
+      if (pool->threads)
+        break;
+      free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+unsigned workpool_threads(const struct workpool *pool) {
+  return pool->threads;
+}
+
+void workpool_submit(struct workpool *pool, struct workpool_task *task) {
+  task->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail)
+    pool->tail->next = task;
+  else
+    pool->head = task;
+  pool->tail = task;
+  pool->outstanding++;
+  pthread_cond_signal(&pool->queued);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_wait(struct workpool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->outstanding)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_free(struct workpool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->queued);
+  pthread_mutex_unlock(&pool->lock);
+  // The workers drain the queue before they see stop
+  for (unsigned i = 0; i < pool->threads; i++)
+    pthread_join(pool->thread[i], NULL);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->queued);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
@@ -0,0 +1,59 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A fixed pool of worker threads for work that shouldn't hold up reading from
+// the scanner.
+//
+// Tasks are embedded in the caller's own structures, as the first member, so
+// submitting one never allocates and can't fail. They run in the order they
+// were submitted, but as many at once as there are threads.
+
+#ifndef THIRD_PARTY_KVS3105USB_WORKPOOL_H_
+#define THIRD_PARTY_KVS3105USB_WORKPOOL_H_
+
+struct workpool_task {
+  // called on a worker thread; the task may be freed once this starts
+  void (*run)(struct workpool_task *task);
+  struct workpool_task *next;
+};
+
+struct workpool;
+
+// -----------------------------------------------------------------------------
+// Start threads workers, or one per CPU if threads is 0. Returns NULL on
+// error.
+// -----------------------------------------------------------------------------
+struct workpool *workpool_new(unsigned threads);
+
+// -----------------------------------------------------------------------------
+// The number of workers.
+// -----------------------------------------------------------------------------
+unsigned workpool_threads(const struct workpool *pool);
+
+// -----------------------------------------------------------------------------
+// Queue task->run to be called on a worker.
+// -----------------------------------------------------------------------------
+void workpool_submit(struct workpool *pool, struct workpool_task *task);
+
+// -----------------------------------------------------------------------------
+// Wait until every task submitted so far has finished running.
+// -----------------------------------------------------------------------------
+void workpool_wait(struct workpool *pool);
+
+// -----------------------------------------------------------------------------
+// Wait for the tasks, stop the workers and free the pool.
+// -----------------------------------------------------------------------------
+void workpool_free(struct workpool *pool);
+
+#endif  // THIRD_PARTY_KVS3105USB_WORKPOOL_H_
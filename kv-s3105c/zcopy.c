@@ -0,0 +1,281 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "kvs3105usb.h"
+#include "zcopy.h"
+
+enum buffer_state {
+  BUFFER_FREE,
+  BUFFER_LENT,     // handed out by zcopy_buffer
+  BUFFER_QUEUED,   // spliced into the output pipe, maybe not yet read
+};
+
+struct zc_buffer {
+  uint8_t *data;
+  enum buffer_state state;
+  // the value of zcopy.sent once this buffer was queued
+  uint64_t end;
+};
+
+enum output_kind {
+  OUTPUT_UNKNOWN,
+  OUTPUT_PIPE,
+  OUTPUT_FILE,
+  OUTPUT_OTHER,
+};
+
+struct zcopy {
+  struct zc_buffer *buffers;
+  unsigned count;
+  // The output pipe which buffers are queued in, and the number of bytes
+  // which have been put into it, whether vmspliced or copied. Every byte has
+  // to be counted for consumed() to be right.
+  int pipe_out;
+  uint64_t sent;
+  // A private pipe for splicing into regular files
+  int pipefd[2];
+  // the kind of the last fd written to
+  int last_fd;
+  enum output_kind last_kind;
+  uint64_t spliced, copied;
+};
+
+struct zcopy *zcopy_new(unsigned count) {
+  struct zcopy *zc = calloc(1, sizeof(struct zcopy));
+  if (!zc)
+    return NULL;
+  zc->buffers = calloc(count, sizeof(struct zc_buffer));
+  if (!zc->buffers) {
+    free(zc);
+    return NULL;
+  }
+  zc->count = count;
+  for (unsigned i = 0; i < count; i++) {
+    // Page aligned, so that whole pages can be given to the pipe
+    if (posix_memalign((void **) &zc->buffers[i].data, 4096,
+                       KVS3105_BUFFER_SIZE)) {
+      fprintf(stderr, "Memory allocation failed!\n");
+      zcopy_free(zc);
+      return NULL;
+    }
+  }
+  zc->pipe_out = -1;
+  zc->pipefd[0] = zc->pipefd[1] = -1;
+  zc->last_fd = -1;
+  return zc;
+}
+
+// Return the number of bytes the reader has taken out of the output pipe
+static uint64_t consumed(struct zcopy *zc) {
+  int queued;
+  if (zc->pipe_out < 0 || ioctl(zc->pipe_out, FIONREAD, &queued))
+    return zc->sent;
+  return zc->sent - queued;
+}
+
+uint8_t *zcopy_buffer(struct zcopy *zc) {
+  for (;;) {
+    const uint64_t done = consumed(zc);
+    for (unsigned i = 0; i < zc->count; i++) {
+      struct zc_buffer *b = &zc->buffers[i];
+      // A buffer that was lent but never written is free again
+      if (b->state == BUFFER_LENT ||
+          (b->state == BUFFER_QUEUED && done >= b->end))
+        b->state = BUFFER_FREE;
+    }
+    for (unsigned i = 0; i < zc->count; i++) {
+      struct zc_buffer *b = &zc->buffers[i];
+      if (b->state == BUFFER_FREE) {
+        b->state = BUFFER_LENT;
+        return b->data;
+      }
+    }
+
+    // Everything is still in the pipe: wait for the reader to make progress
+    struct pollfd pfd = { .fd = zc->pipe_out, .events = POLLOUT };
+    if (poll(&pfd, 1, 10) < 0 && errno != EINTR) {
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      return NULL;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+      fprintf(stderr, "Output pipe closed\n");
+      return NULL;
+    }
+  }
+}
+
+static int copy_out(struct zcopy *zc, int fd, const uint8_t *data,
+                    size_t length) {
+  zc->copied += length;
+  while (length) {
+    const ssize_t n = write(fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "write failed: %s\n", strerror(errno));
+      return 1;
+    }
+    if (fd == zc->pipe_out)
+      zc->sent += n;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+static enum output_kind output_kind(struct zcopy *zc, int fd) {
+  if (fd == zc->last_fd)
+    return zc->last_kind;
+
+  struct stat st;
+  enum output_kind kind = OUTPUT_OTHER;
+  if (!fstat(fd, &st)) {
+    if (S_ISFIFO(st.st_mode) && (zc->pipe_out < 0 || zc->pipe_out == fd))
+      kind = OUTPUT_PIPE;
+    else if (S_ISREG(st.st_mode))
+      kind = OUTPUT_FILE;
+  }
+  if (kind == OUTPUT_PIPE && zc->pipe_out < 0) {
+    zc->pipe_out = fd;
+    // Let the pipe hold the whole pool, so that the reader can fall behind by
+    // that much without stalling us. This is only a hint.
+    fcntl(fd, F_SETPIPE_SZ, zc->count * KVS3105_BUFFER_SIZE);
+  }
+  if (kind == OUTPUT_FILE && zc->pipefd[0] < 0) {
+    if (pipe(zc->pipefd)) {
+      kind = OUTPUT_OTHER;
+    } else if (fcntl(zc->pipefd[1], F_SETPIPE_SZ, KVS3105_BUFFER_SIZE) <
+               KVS3105_BUFFER_SIZE) {
+      // A buffer must fit in the pipe or vmsplice would block forever
+      close(zc->pipefd[0]);
+      close(zc->pipefd[1]);
+      zc->pipefd[0] = zc->pipefd[1] = -1;
+      kind = OUTPUT_OTHER;
+    }
+  }
+  zc->last_fd = fd;
+  zc->last_kind = kind;
+  return kind;
+}
+
+// Give length bytes at data to the pipe. Returns the number of bytes which
+// went, which is less than length only if vmsplice isn't supported.
+static size_t gift(int pipe, const uint8_t *data, size_t length) {
+  size_t done = 0;
+  while (done < length) {
+    struct iovec iov = { (void *) (data + done), length - done };
+    const ssize_t n = vmsplice(pipe, &iov, 1, SPLICE_F_GIFT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int zcopy_write(struct zcopy *zc, int fd, const uint8_t *data,
+                size_t length) {
+  struct zc_buffer *b = NULL;
+  for (unsigned i = 0; i < zc->count; i++) {
+    if (zc->buffers[i].data == data)
+      b = &zc->buffers[i];
+  }
+  if (!b) {
+    // Find out if fd is the output pipe, so the copy is counted in sent
+    output_kind(zc, fd);
+    return copy_out(zc, fd, data, length);
+  }
+
+  switch (output_kind(zc, fd)) {
+    case OUTPUT_PIPE: {
+      const size_t n = gift(fd, data, length);
+      zc->sent += n;
+      zc->spliced += n;
+      b->state = BUFFER_QUEUED;
+      b->end = zc->sent;
+      if (n < length)
+        return copy_out(zc, fd, data + n, length - n);
+      return 0;
+    }
+
+    case OUTPUT_FILE: {
+      // The private pipe is empty between calls, and a buffer always fits in
+      // it, so the buffer is free again as soon as this returns.
+      b->state = BUFFER_FREE;
+      size_t done = 0;
+      while (done < length) {
+        const size_t n = gift(zc->pipefd[1], data + done, length - done);
+        if (!n)
+          break;
+        size_t moved = 0;
+        while (moved < n) {
+          const ssize_t m = splice(zc->pipefd[0], NULL, fd, NULL, n - moved,
+                                   SPLICE_F_MOVE);
+          if (m < 0 && errno == EINTR)
+            continue;
+          if (m <= 0) {
+            // The data is stuck in our pipe, so there's no falling back now
+            fprintf(stderr, "splice failed: %s\n", strerror(errno));
+            return 1;
+          }
+          moved += m;
+        }
+        done += n;
+        zc->spliced += n;
+      }
+      if (done < length)
+        return copy_out(zc, fd, data + done, length - done);
+      return 0;
+    }
+
+    default:
+      b->state = BUFFER_FREE;
+      return copy_out(zc, fd, data, length);
+  }
+}
+
+void zcopy_free(struct zcopy *zc) {
+  if (!zc)
+    return;
+  if (zc->spliced || zc->copied)
+    fprintf(stderr, "zero copy: %llu bytes spliced, %llu bytes copied\n",
+            (unsigned long long) zc->spliced,
+            (unsigned long long) zc->copied);
+  const uint64_t done = consumed(zc);
+  for (unsigned i = 0; i < zc->count; i++) {
+    if (zc->buffers[i].state != BUFFER_QUEUED || done >= zc->buffers[i].end)
+      free(zc->buffers[i].data);
+  }
+  if (zc->pipefd[0] >= 0) {
+    close(zc->pipefd[0]);
+    close(zc->pipefd[1]);
+  }
+  free(zc->buffers);
+  free(zc);
+}
@@ -0,0 +1,63 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Zero-copy output with vmsplice(2).
+//
+// A zcopy owns a pool of page-aligned read buffers. Image data is read into a
+// pool buffer and then, rather than being copied into the kernel with
+// write(2), the buffer's pages are handed to a pipe with vmsplice. Because the
+// pipe refers to the pages themselves, a buffer can only be reused once the
+// reader has drained everything up to its end; that's tracked by comparing the
+// number of bytes spliced with the amount still queued (FIONREAD).
+//
+// When the output is a regular file, the buffer is vmspliced into a private
+// pipe and then spliced into the file. If neither works (e.g. a terminal), it
+// falls back to write.
+
+#ifndef THIRD_PARTY_KVS3105USB_ZCOPY_H_
+#define THIRD_PARTY_KVS3105USB_ZCOPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct zcopy;
+
+// -----------------------------------------------------------------------------
+// Create a pool of count buffers, each KVS3105_BUFFER_SIZE bytes. Returns NULL
+// on error.
+// -----------------------------------------------------------------------------
+struct zcopy *zcopy_new(unsigned count);
+
+// -----------------------------------------------------------------------------
+// Return a buffer to read the next chunk into, waiting for the reader of the
+// output to drain one if they're all in use. Returns NULL on error.
+// -----------------------------------------------------------------------------
+uint8_t *zcopy_buffer(struct zcopy *zc);
+
+// -----------------------------------------------------------------------------
+// Write length bytes to fd. If data is the start of a buffer returned by
+// zcopy_buffer, the buffer's pages are passed to the kernel rather than
+// copied and the buffer mustn't be written to again until zcopy_buffer hands
+// it out again. Any other data is simply written.
+// -----------------------------------------------------------------------------
+int zcopy_write(struct zcopy *zc, int fd, const uint8_t *data, size_t length);
+
+// -----------------------------------------------------------------------------
+// Print how much data went out each way and free the pool. The pipe may still
+// refer to the buffers, so the memory of buffers which haven't been drained is
+// deliberately leaked rather than freed.
+// -----------------------------------------------------------------------------
+void zcopy_free(struct zcopy *zc);
+
+#endif  // THIRD_PARTY_KVS3105USB_ZCOPY_H_
@@ -0,0 +1,275 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// zstd compressed output for uncompressed scans. See kvzstd.h for the format.
+//
+// zstd's own worker threads do the compressing: each chunk is handed over in
+// ZSTD_compressStream2, which only copies it into the current job, so the
+// thread reading from USB spends its time reading. It does write out what
+// the workers have finished.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+#include "sink.h"
+#include "kvzstd.h"
+#include "pagebuf.h"
+
+struct zstd_sink {
+  struct page_sink base;
+  char *path;
+  int fd;
+  ZSTD_CCtx *cctx;
+  uint8_t *out;
+  size_t out_size;
+  struct page_info info;
+  // where the current side's frame started, and how much went in
+  uint64_t frame_start, side_length;
+  // a side has begun and its frame isn't finished yet
+  int in_page;
+  uint64_t offset, total;
+  unsigned sides;
+  // the page and seek table entries
+  struct pagebuf page_table, seek_table;
+};
+
+static void put16le(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32le(uint8_t *p, uint32_t v) {
+  put16le(p, v);
+  put16le(p + 2, v >> 16);
+}
+
+static int write_all(struct zstd_sink *s, const uint8_t *data, size_t length) {
+  while (length) {
+    const ssize_t n = write(s->fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+      return 1;
+    }
+    data += n;
+    length -= n;
+    s->offset += n;
+  }
+  return 0;
+}
+
+// Feed data to the compressor and write out whatever it produces. With
+// ZSTD_e_end this finishes the frame.
+static int compress(struct zstd_sink *s, const uint8_t *data, size_t length,
+                    ZSTD_EndDirective mode) {
+  ZSTD_inBuffer in = { data, length, 0 };
+  size_t remaining;
+
+  do {
+    ZSTD_outBuffer out = { s->out, s->out_size, 0 };
+    remaining = ZSTD_compressStream2(s->cctx, &out, &in, mode);
+    if (ZSTD_isError(remaining)) {
+      fprintf(stderr, "%s: zstd failed: %s\n", s->path,
+              ZSTD_getErrorName(remaining));
+      return 1;
+    }
+    if (write_all(s, s->out, out.pos))
+      return 1;
+  } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+  return 0;
+}
+
+static int zstd_begin_page(struct page_sink *sink,
+                           const struct page_info *info) {
+  struct zstd_sink *s = (struct zstd_sink *) sink;
+
+  s->info = *info;
+  s->frame_start = s->offset;
+  s->side_length = 0;
+  s->in_page = 1;
+  return 0;
+}
+
+static int zstd_write(struct page_sink *sink, const uint8_t *data,
+                      unsigned length) {
+  struct zstd_sink *s = (struct zstd_sink *) sink;
+
+  s->side_length += length;
+  return compress(s, data, length, ZSTD_e_continue);
+}
+
+static int zstd_end_page(struct page_sink *sink) {
+  struct zstd_sink *s = (struct zstd_sink *) sink;
+  uint8_t entry[KVZSTD_PAGE_ENTRY_SIZE], seek[KVZSTD_SEEK_ENTRY_SIZE];
+
+  if (compress(s, NULL, 0, ZSTD_e_end))
+    return 1;
+  s->in_page = 0;
+  const uint64_t compressed = s->offset - s->frame_start;
+  if (compressed > UINT32_MAX || s->side_length > UINT32_MAX) {
+    fprintf(stderr, "%s: page %d is too big for the seek table\n", s->path,
+            s->info.page);
+    return 1;
+  }
+
+  memset(entry, 0, sizeof(entry));
+  put32le(entry, s->info.page);
+  entry[4] = s->info.side;
+  entry[5] = s->info.compression_type;
+  put16le(entry + 6, s->info.window->bpp);
+  put32le(entry + 8, s->info.width);
+  put32le(entry + 12, s->info.height);
+  put32le(seek, compressed);
+  put32le(seek + 4, s->side_length);
+  if (pagebuf_append(&s->page_table, entry, sizeof(entry)) ||
+      pagebuf_append(&s->seek_table, seek, sizeof(seek)))
+    return 1;
+
+  s->sides++;
+  s->total += s->side_length;
+  fprintf(stderr, "%s: page %d%s: %llu bytes, %llu compressed\n", s->path,
+          s->info.page, s->info.side ? "B" : "A",
+          (unsigned long long) s->side_length,
+          (unsigned long long) compressed);
+  return 0;
+}
+
+// Write the page table and the seek table
+static int write_tables(struct zstd_sink *s) {
+  uint8_t header[16], footer[KVZSTD_SEEK_FOOTER_SIZE];
+
+  put32le(header, KVZSTD_PAGE_TABLE_FRAME);
+  put32le(header + 4, 8 + s->page_table.length);
+  memcpy(header + 8, KVZSTD_PAGE_TABLE_MAGIC, 4);
+  put32le(header + 12, s->sides);
+  if (write_all(s, header, 16) ||
+      write_all(s, s->page_table.data, s->page_table.length))
+    return 1;
+
+  put32le(header, KVZSTD_SEEK_TABLE_FRAME);
+  put32le(header + 4, s->seek_table.length + KVZSTD_SEEK_FOOTER_SIZE);
+  put32le(footer, s->sides);
+  footer[4] = 0;  // no checksums
+  put32le(footer + 5, KVZSTD_SEEKABLE_MAGIC);
+  return write_all(s, header, 8) ||
+         write_all(s, s->seek_table.data, s->seek_table.length) ||
+         write_all(s, footer, sizeof(footer));
+}
+
+// Deal with a side the job stopped part way through, so that the file stays
+// valid: cut its frame off a file, or else finish it and list it as it is
+static int end_partial_side(struct zstd_sink *s) {
+  if (s->fd != 1 && !ftruncate(s->fd, s->frame_start) &&
+      lseek(s->fd, s->frame_start, SEEK_SET) >= 0) {
+    ZSTD_CCtx_reset(s->cctx, ZSTD_reset_session_only);
+    s->offset = s->frame_start;
+    s->in_page = 0;
+    fprintf(stderr, "%s: page %d%s: incomplete, left out\n", s->path,
+            s->info.page, s->info.side ? "B" : "A");
+    return 0;
+  }
+  fprintf(stderr, "%s: page %d%s: incomplete, %llu bytes kept\n", s->path,
+          s->info.page, s->info.side ? "B" : "A",
+          (unsigned long long) s->side_length);
+  return zstd_end_page(&s->base);
+}
+
+static void free_sink(struct zstd_sink *s) {
+  ZSTD_freeCCtx(s->cctx);
+  pagebuf_free(&s->page_table);
+  pagebuf_free(&s->seek_table);
+  free(s->out);
+  free(s->path);
+  free(s);
+}
+
+static int zstd_close(struct page_sink *sink) {
+  struct zstd_sink *s = (struct zstd_sink *) sink;
+  int r = s->in_page && end_partial_side(s);
+
+  if (write_tables(s))
+    r = 1;
+
+  if (s->fd != 1 && close(s->fd)) {
+    fprintf(stderr, "Failed to write to %s: %s\n", s->path, strerror(errno));
+    r = 1;
+  }
+  if (s->total) {
+    fprintf(stderr, "%s: %u sides, %llu bytes compressed to %llu (%.1f%%)\n",
+            s->path, s->sides, (unsigned long long) s->total,
+            (unsigned long long) s->offset, 100.0 * s->offset / s->total);
+  }
+  free_sink(s);
+  return r;
+}
+
+struct page_sink *zstd_sink_new(const char *path) {
+  struct zstd_sink *s = calloc(1, sizeof(struct zstd_sink));
+  if (!s)
+    return NULL;
+  s->base.begin_page = zstd_begin_page;
+  s->base.write = zstd_write;
+  s->base.end_page = zstd_end_page;
+  s->base.close = zstd_close;
+  s->path = strdup(path ? path : "stdout");
+  s->out_size = ZSTD_CStreamOutSize();
+  s->out = malloc(s->out_size);
+  s->cctx = ZSTD_createCCtx();
+  if (!s->path || !s->out || !s->cctx) {
+    fprintf(stderr, "Memory allocation failed!\n");
+    free_sink(s);
+    return NULL;
+  }
+  // Let readers check each side as they decompress it
+  ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_checksumFlag, 1);
+  if (zstd_sink_configure(&s->base, 0, -1)) {
+    free_sink(s);
+    return NULL;
+  }
+
+  s->fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+  if (s->fd < 0) {
+    fprintf(stderr, "Failed to write to %s: %s\n", path, strerror(errno));
+    free_sink(s);
+    return NULL;
+  }
+  return &s->base;
+}
+
+int zstd_sink_configure(struct page_sink *sink, int level, int threads) {
+  struct zstd_sink *s = (struct zstd_sink *) sink;
+  size_t r;
+
+  if (threads < 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  r = ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_compressionLevel, level);
+  if (ZSTD_isError(r)) {
+    fprintf(stderr, "Bad zstd level %d: %s\n", level, ZSTD_getErrorName(r));
+    return 1;
+  }
+  r = ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_nbWorkers, threads);
+  if (ZSTD_isError(r))
+    fprintf(stderr, "zstd: can't use %d threads (%s), compressing in the "
+            "reading thread\n", threads, ZSTD_getErrorName(r));
+  return 0;
+}